@@ -1050,9 +1050,22 @@ LUA_API void lua_sharestring (lua_State *L, int index) {
     luaG_runerror(L, "need a string to share");
 
   TString *ts = (TString *)(str - sizeof(UTString));
+  if (isshared(ts))
+    return;
+  if (ts->tt == LUA_TLNGSTR)
+    luaS_hashlongstr(ts);  /* other states may use it as a key */
   luaS_share(ts);
 }
 
+LUA_API void lua_clonestring (lua_State *L, const char * str) {
+  TString *ts = (TString *)(str - sizeof(UTString));
+  api_check(L, isshared(ts), "Not a shared string");
+  lua_lock(L);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  lua_unlock(L);
+}
+
 LUA_API void lua_clonetable(lua_State *L, const void * tp) {
   Table *t = cast(Table *, tp);
 
@@ -237,6 +237,7 @@ LUA_API int   (lua_pushthread) (lua_State *L);
 LUA_API void  (lua_clonefunction) (lua_State *L, const void * fp);
 LUA_API void  (lua_sharefunction) (lua_State *L, int index);
 LUA_API void  (lua_sharestring) (lua_State *L, int index);
+LUA_API void  (lua_clonestring) (lua_State *L, const char * str);
 LUA_API void  (lua_clonetable) (lua_State *L, const void * t);
 
 /*
@@ -5,6 +5,8 @@
 #define LUA_LIB
 
 #include "skynet_malloc.h"
+#include "sharebuffer.h"
+#include "lua-sharebuffer.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -12,6 +14,11 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define TYPE_NIL 0
 #define TYPE_BOOLEAN 1
@@ -26,93 +33,176 @@
 #define TYPE_NUMBER_REAL 8
 
 #define TYPE_USERDATA 3
+// hibits 0 : lightuserdata 1 : sharebuffer（之后跟 4 字节的序号） 2 : sharebuffer 列表，只出现在消息开头，见 wb_sharelist
+#define TYPE_USERDATA_POINTER 0
+#define TYPE_USERDATA_SHAREBUFFER 1
+#define TYPE_USERDATA_SHARELIST 2
 #define TYPE_SHORT_STRING 4
 // hibits 0~31 : len
 #define TYPE_LONG_STRING 5
 #define TYPE_TABLE 6
+#define TYPE_EXTEND 7
+// hibits 0~29 : 引用本消息里第 n 个短字符串 key，30 : 下一个字节 + 30，31 : 纯数字数组
+#define EXTEND_REF_LONG 30
+#define EXTEND_ARRAY 31
 
 #define MAX_COOKIE 32
 #define COMBINE_TYPE(t,v) ((t) | (v) << 3)
 
-#define BLOCK_SIZE 128
+#define INIT_SIZE 128
 #define MAX_DEPTH 32
+#define MAX_REF (EXTEND_REF_LONG + 0x100)
+#define INIT_SLOT 32
+#define DENSE_ARRAY 8
 
-struct block {
-	struct block * next;
-	char buffer[BLOCK_SIZE];
+/**
+ * 字符串 key 引用表：table 的 key 是短字符串时，按出现顺序给前 MAX_REF 个不同的 key 编号，
+ * 之后再出现同一个 key 只写编号；解包时按同样的规则记下 key 的位置，不需要额外的数据
+ * lua 的短字符串是内部化的，同样内容的 key 地址相同，所以按地址查找
+ * __pairs 返回的 key 可能在打包途中被回收，地址又分给了别的字符串，所以命中后还要和写出的内容比较
+*/
+struct key_slot {
+	const char * key;
+	int index;		// -1 表示编号已经用完，只记下最后一次写出的位置
+	int len;
+	int pos;		// 第一次写出时内容在 buffer 里的位置
+};
+
+struct key_table {
+	int n;
+	int size;		// 槽数，0 表示还没有用到
+	struct key_slot * slot;
+	struct key_slot init[INIT_SLOT];
 };
 
+/**
+ * 打包进来的 sharebuffer，打包成功后才给每一项增加引用，出错时不用回滚
+ * 只有打包成消息时允许：消息的每个 sharebuffer 各持有一个引用，分发时第一次 unpack 交给解出的 userdata
+*/
+struct share_list {
+	int n;
+	int cap;
+	struct sharebuffer ** sb;
+};
+
+/**
+ * 打包到一块连续的内存：先用栈上的 init，不够时到堆上按两倍扩展
+ * 打包完成后堆上的内存直接交给调用者，不再拷贝
+*/
 struct write_block {
-	struct block * head;
-	struct block * current;
+	char * buffer;
 	int len;
-	int ptr;
+	int cap;
+	struct share_list * share;	// NULL 表示不允许打包 sharebuffer
+	int compact;	// 1 表示使用 key 引用和纯数字数组，老版本读不了，见 luaseri_packcompact
+	struct key_table keys;
+	char init[INIT_SIZE];
+};
+
+struct key_ref {
+	const char * str;
+	int sz;
 };
 
 struct read_block {
 	char * buffer;
 	int len;
 	int ptr;
+	int nref;
+	int maxref;		// 最多记录多少个 key，按需解包时 key 都已经在扫描时记好了，为 0
+	int adopt;		// 消息里的 sharebuffer：1 接管消息持有的引用，0 另外增加一个引用
+	int local;		// 1 表示正在分发的本进程消息，只有这时才认 sharebuffer，见 luaseri_dispatch
+	int view;		// 按需解包时，栈上视图的元表位置（下一个位置是 offsets 表），否则为 0
+	int nshare;
+	const char * share;	// 消息开头校验过的 sharebuffer 列表，见 rb_sharelist
+	struct key_ref * ref;
 };
 
-inline static struct block *
-blk_alloc(void) {
-	struct block *b = skynet_malloc(sizeof(struct block));
-	b->next = NULL;
-	return b;
-}
-
-inline static void
-wb_push(struct write_block *b, const void *buf, int sz) {
-	const char * buffer = buf;
-	if (b->ptr == BLOCK_SIZE) {
-_again:
-		b->current = b->current->next = blk_alloc();
-		b->ptr = 0;
-	}
-	if (b->ptr <= BLOCK_SIZE - sz) {
-		memcpy(b->current->buffer + b->ptr, buffer, sz);
-		b->ptr+=sz;
-		b->len+=sz;
+static void
+wb_grow(struct write_block *wb, int sz) {
+	int cap = wb->cap;
+	do {
+		cap *= 2;
+	} while (cap - wb->len < sz);
+	if (wb->buffer == wb->init) {
+		wb->buffer = skynet_malloc(cap);
+		memcpy(wb->buffer, wb->init, wb->len);
 	} else {
-		int copy = BLOCK_SIZE - b->ptr;
-		memcpy(b->current->buffer + b->ptr, buffer, copy);
-		buffer += copy;
-		b->len += copy;
-		sz -= copy;
-		goto _again;
+		wb->buffer = skynet_realloc(wb->buffer, cap);
+	}
+	wb->cap = cap;
+}
+
+// 保证还能写入 sz 字节，返回写入的位置
+static inline char *
+wb_reserve(struct write_block *wb, int sz) {
+	if (wb->cap - wb->len < sz) {
+		wb_grow(wb, sz);
 	}
+	return wb->buffer + wb->len;
+}
+
+static inline void
+wb_push(struct write_block *wb, const void *buf, int sz) {
+	memcpy(wb_reserve(wb, sz), buf, sz);
+	wb->len += sz;
 }
 
 static void
-wb_init(struct write_block *wb , struct block *b) {
-	wb->head = b;
-	assert(b->next == NULL);
+wb_init(struct write_block *wb) {
+	wb->buffer = wb->init;
 	wb->len = 0;
-	wb->current = wb->head;
-	wb->ptr = 0;
+	wb->cap = INIT_SIZE;
+	wb->share = NULL;
+	wb->compact = 0;
+	wb->keys.n = 0;
+	wb->keys.size = 0;
+	wb->keys.slot = NULL;
 }
 
 static void
 wb_free(struct write_block *wb) {
-	struct block *blk = wb->head;
-	blk = blk->next;	// the first block is on stack
-	while (blk) {
-		struct block * next = blk->next;
-		skynet_free(blk);
-		blk = next;
-	}
-	wb->head = NULL;
-	wb->current = NULL;
-	wb->ptr = 0;
+	if (wb->buffer != wb->init) {
+		skynet_free(wb->buffer);
+	}
+	if (wb->keys.slot != wb->keys.init) {
+		skynet_free(wb->keys.slot);
+	}
+	if (wb->share) {
+		skynet_free(wb->share->sb);
+		wb->share->sb = NULL;
+		wb->share->n = 0;
+	}
+	wb->buffer = wb->init;
+	wb->keys.slot = NULL;
 	wb->len = 0;
 }
 
+// 取走打包结果，由调用者 skynet_free
+static void *
+wb_detach(struct write_block *wb) {
+	void * buffer = wb->buffer;
+	if (buffer == wb->init) {
+		buffer = skynet_malloc(wb->len);
+		memcpy(buffer, wb->init, wb->len);
+	}
+	wb->buffer = wb->init;
+	return buffer;
+}
+
 static void
-rball_init(struct read_block * rb, char * buffer, int size) {
+rball_init(struct read_block * rb, char * buffer, int size, struct key_ref *ref) {
 	rb->buffer = buffer;
 	rb->len = size;
 	rb->ptr = 0;
+	rb->nref = 0;
+	rb->maxref = MAX_REF;
+	rb->adopt = 1;
+	rb->local = 0;
+	rb->view = 0;
+	rb->nshare = 0;
+	rb->share = NULL;
+	rb->ref = ref;
 }
 
 static void *
@@ -187,6 +277,161 @@ wb_pointer(struct write_block *wb, void *v) {
 	wb_push(wb, &v, sizeof(v));
 }
 
+/**
+ * 消息里的 sharebuffer 是裸指针，解包时直接当作 struct sharebuffer * 使用
+ * 指针都放在消息开头的列表里，每个后面跟一个校验：以进程启动时的随机数为密钥对指针做 siphash-2-4
+ * 即使消息被原样转发到别的节点，也推不出密钥，其它节点发来的数据（经 cluster、harbor 转发）伪造不出指针
+*/
+static uint64_t SHARE_KEY[2];
+static pthread_once_t SHARE_KEY_ONCE = PTHREAD_ONCE_INIT;
+
+static void
+share_key_init(void) {
+	uint64_t key[2] = { 0, 0 };
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, key, sizeof(key)) != sizeof(key)) {
+			key[0] = key[1] = 0;
+		}
+		close(fd);
+	}
+	key[0] ^= (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid();
+	key[1] ^= (uint64_t)(uintptr_t)key;
+	SHARE_KEY[0] = key[0];
+	SHARE_KEY[1] = key[1];
+}
+
+#define SIP_ROTL(x,b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND do { \
+	v0 += v1; v1 = SIP_ROTL(v1,13); v1 ^= v0; v0 = SIP_ROTL(v0,32); \
+	v2 += v3; v3 = SIP_ROTL(v3,16); v3 ^= v2; \
+	v0 += v3; v3 = SIP_ROTL(v3,21); v3 ^= v0; \
+	v2 += v1; v1 = SIP_ROTL(v1,17); v1 ^= v2; v2 = SIP_ROTL(v2,32); \
+} while (0)
+
+static uint64_t
+share_seal(struct sharebuffer *sb) {
+	pthread_once(&SHARE_KEY_ONCE, share_key_init);
+	uint64_t m = (uint64_t)(uintptr_t)sb;
+	uint64_t v0 = SHARE_KEY[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = SHARE_KEY[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = SHARE_KEY[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = SHARE_KEY[1] ^ 0x7465646279746573ULL;
+	uint64_t b = (uint64_t)8 << 56;	// 只有一个 8 字节的分组，最后一组只有长度
+	v3 ^= m;
+	SIP_ROUND;
+	SIP_ROUND;
+	v0 ^= m;
+	v3 ^= b;
+	SIP_ROUND;
+	SIP_ROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIP_ROUND;
+	SIP_ROUND;
+	SIP_ROUND;
+	SIP_ROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#define SHARE_HEADER 5
+#define SHARE_ENTRY (sizeof(struct sharebuffer *) + sizeof(uint64_t))
+
+static inline struct sharebuffer *
+share_at(const char *list, int i) {
+	struct sharebuffer * sb;
+	memcpy(&sb, list + i * SHARE_ENTRY, sizeof(sb));
+	return sb;
+}
+
+/**
+ * 消息开头的 sharebuffer 列表：[2*8+3:1][n:4][n * (指针:8 校验:8)]
+ * 返回列表里 sharebuffer 的个数，没有列表返回 0，格式不对或者校验不过返回 -1
+ * 不需要 lua_State，框架丢弃消息时也能用，见 luaseri_drop
+*/
+static int
+share_header(const char *msg, int sz) {
+	if (sz < 1 || (uint8_t)msg[0] != COMBINE_TYPE(TYPE_USERDATA, TYPE_USERDATA_SHARELIST)) {
+		return 0;
+	}
+	uint32_t n;
+	if (sz < SHARE_HEADER) {
+		return -1;
+	}
+	memcpy(&n, msg + 1, sizeof(n));
+	if (n == 0 || n > (sz - SHARE_HEADER) / SHARE_ENTRY) {
+		return -1;
+	}
+	const char * list = msg + SHARE_HEADER;
+	uint32_t i;
+	for (i=0;i<n;i++) {
+		uint64_t seal;
+		memcpy(&seal, list + i * SHARE_ENTRY + sizeof(struct sharebuffer *), sizeof(seal));
+		if (seal != share_seal(share_at(list, i))) {
+			return -1;
+		}
+	}
+	return (int)n;
+}
+
+static void
+share_grab(const char *msg, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		sharebuffer_grab(share_at(msg + SHARE_HEADER, i));
+	}
+}
+
+static void
+share_release(const char *msg, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		sharebuffer_release(share_at(msg + SHARE_HEADER, i));
+	}
+}
+
+// 消息里只写 sharebuffer 在列表里的序号，列表在打包完成后插到开头
+static inline void
+wb_sharebuffer(struct write_block *wb, struct sharebuffer *sb) {
+	struct share_list * share = wb->share;
+	if (share->n >= share->cap) {
+		share->cap = share->cap ? share->cap * 2 : 4;
+		share->sb = skynet_realloc(share->sb, share->cap * sizeof(struct sharebuffer *));
+	}
+	uint32_t index = share->n;
+	share->sb[share->n++] = sb;
+	uint8_t n = COMBINE_TYPE(TYPE_USERDATA, TYPE_USERDATA_SHAREBUFFER);
+	wb_push(wb, &n, 1);
+	wb_push(wb, &index, sizeof(index));
+}
+
+// 打包成功，消息里的每个 sharebuffer 增加一个引用，在消息开头插入 sharebuffer 列表
+static void
+wb_sharelist(struct write_block *wb) {
+	struct share_list * share = wb->share;
+	if (share->n == 0) {
+		return;
+	}
+	int sz = SHARE_HEADER + share->n * SHARE_ENTRY;
+	wb_reserve(wb, sz);
+	char * p = wb->buffer;
+	memmove(p + sz, p, wb->len);
+	wb->len += sz;
+	*p = COMBINE_TYPE(TYPE_USERDATA, TYPE_USERDATA_SHARELIST);
+	uint32_t n = share->n;
+	memcpy(p + 1, &n, sizeof(n));
+	p += SHARE_HEADER;
+	int i;
+	for (i=0;i<share->n;i++) {
+		struct sharebuffer * sb = share->sb[i];
+		uint64_t seal = share_seal(sb);
+		sharebuffer_grab(sb);
+		memcpy(p, &sb, sizeof(sb));
+		memcpy(p + sizeof(sb), &seal, sizeof(seal));
+		p += SHARE_ENTRY;
+	}
+}
+
 /**
  * 序列化一个字符串
  * 第1个字节比较特殊，表示序列化的格式
@@ -225,11 +470,194 @@ wb_string(struct write_block *wb, const char *str, int len) {
 	}
 }
 
+static inline struct key_slot *
+key_find(struct key_table *keys, const char *key) {
+	uint32_t h = (uint32_t)((uintptr_t)key >> 3) * 2654435761u;
+	int mask = keys->size - 1;
+	struct key_slot * slot = &keys->slot[h & mask];
+	while (slot->key && slot->key != key) {
+		slot = &keys->slot[(slot - keys->slot + 1) & mask];
+	}
+	return slot;
+}
+
+static void
+key_rehash(struct key_table *keys) {
+	struct key_slot * old = keys->slot;
+	int size = keys->size;
+	if (size == 0) {
+		keys->slot = keys->init;
+		keys->size = INIT_SLOT;
+	} else {
+		keys->size = size * 2;
+		keys->slot = skynet_malloc(keys->size * sizeof(struct key_slot));
+	}
+	memset(keys->slot, 0, keys->size * sizeof(struct key_slot));
+	int i;
+	for (i=0;i<size;i++) {
+		if (old[i].key) {
+			*key_find(keys, old[i].key) = old[i];
+		}
+	}
+	if (old != keys->init) {
+		skynet_free(old);
+	}
+}
+
+/**
+ * 写一个 table 的 key，短字符串第一次出现时照常写出并编号，之后只写编号
+ * [30+n*8:1] n < 30
+ * [30*8+7:1][n-30:1]
+*/
+static void
+wb_key(struct write_block *wb, const char *str, int len) {
+	struct key_table * keys = &wb->keys;
+	if (len >= MAX_COOKIE) {
+		wb_string(wb, str, len);
+		return;
+	}
+	if (keys->n * 2 >= keys->size && keys->n < MAX_REF) {
+		key_rehash(keys);
+	}
+	struct key_slot * slot = key_find(keys, str);
+	if (slot->key == NULL) {
+		if (keys->n >= MAX_REF) {
+			wb_string(wb, str, len);
+			return;
+		}
+	} else if (slot->index >= 0 && slot->len == len && memcmp(wb->buffer + slot->pos, str, len) == 0) {
+		if (slot->index < EXTEND_REF_LONG) {
+			uint8_t n = COMBINE_TYPE(TYPE_EXTEND, slot->index);
+			wb_push(wb, &n, 1);
+		} else {
+			uint8_t n[2] = { COMBINE_TYPE(TYPE_EXTEND, EXTEND_REF_LONG), slot->index - EXTEND_REF_LONG };
+			wb_push(wb, n, 2);
+		}
+		return;
+	}
+	// 新的 key，或者地址相同但内容不同（原来的 key 已被回收），照常写出，解包时同样会给它编号
+	slot->key = str;
+	slot->index = keys->n < MAX_REF ? keys->n++ : -1;
+	slot->len = len;
+	slot->pos = wb->len + 1;
+	wb_string(wb, str, len);
+}
+
 static void pack_one(lua_State *L, struct write_block *b, int index, int depth);
 
+static inline void
+pack_key(lua_State *L, struct write_block *b, int index, int depth) {
+	if (b->compact && lua_type(L,index) == LUA_TSTRING) {
+		size_t sz = 0;
+		const char *str = lua_tolstring(L,index,&sz);
+		wb_key(b, str, (int)sz);
+	} else {
+		pack_one(L, b, index, depth);
+	}
+}
+
+/**
+ * 全是整数或全是浮点数的数组，不逐项写类型：
+ * [31*8+7:1][元素类型:1][个数:integer][定长的元素...]
+ * 元素类型同 TYPE_NUMBER 的 cookie，整数按取值范围用最窄的宽度
+ * 先把每一项按 8 字节写出，同时统计取值范围，最后原地压缩；遇到其它类型就回退，返回 0
+*/
+static int
+wb_dense_array(lua_State *L, struct write_block *wb, int index, int array_size) {
+	if (array_size > INT_MAX / 8 - 16) {
+		return 0;
+	}
+	int len = wb->len;
+	uint8_t n = COMBINE_TYPE(TYPE_EXTEND, EXTEND_ARRAY);
+	wb_push(wb, &n, 1);
+	int type_ptr = wb->len;
+	wb_push(wb, &n, 1);
+	wb_integer(wb, array_size);
+	char * ptr = wb_reserve(wb, array_size * 8);
+	int real = -1;
+	lua_Integer min = 0, max = 0;
+	int i;
+	for (i=0;i<array_size;i++) {
+		if (lua_rawgeti(L,index,i+1) != LUA_TNUMBER) {
+			lua_pop(L,1);
+			goto _fallback;
+		}
+		if (lua_isinteger(L,-1)) {
+			if (real == 1)
+				goto _pop_fallback;
+			real = 0;
+			lua_Integer v = lua_tointeger(L,-1);
+			if (v < min)
+				min = v;
+			if (v > max)
+				max = v;
+			memcpy(ptr + i * 8, &v, 8);
+		} else {
+			if (real == 0)
+				goto _pop_fallback;
+			real = 1;
+			double v = lua_tonumber(L,-1);
+			memcpy(ptr + i * 8, &v, 8);
+		}
+		lua_pop(L,1);
+	}
+	int cookie, width;
+	if (real) {
+		cookie = TYPE_NUMBER_REAL;
+		width = 8;
+	} else if (min >= 0 && max < 0x100) {
+		cookie = TYPE_NUMBER_BYTE;
+		width = 1;
+	} else if (min >= 0 && max < 0x10000) {
+		cookie = TYPE_NUMBER_WORD;
+		width = 2;
+	} else if (min >= INT32_MIN && max <= INT32_MAX) {
+		cookie = TYPE_NUMBER_DWORD;
+		width = 4;
+	} else {
+		cookie = TYPE_NUMBER_QWORD;
+		width = 8;
+	}
+	if (width < 8) {
+		// 第 i 项写到 i*width，不会覆盖还没读的第 i+1 项
+		for (i=0;i<array_size;i++) {
+			int64_t v;
+			memcpy(&v, ptr + i * 8, 8);
+			switch (width) {
+			case 1: {
+				uint8_t x = (uint8_t)v;
+				ptr[i] = x;
+				break;
+			}
+			case 2: {
+				uint16_t x = (uint16_t)v;
+				memcpy(ptr + i * 2, &x, 2);
+				break;
+			}
+			default: {
+				int32_t x = (int32_t)v;
+				memcpy(ptr + i * 4, &x, 4);
+				break;
+			}
+			}
+		}
+	}
+	wb->buffer[type_ptr] = COMBINE_TYPE(TYPE_NUMBER, cookie);
+	wb->len += array_size * width;
+	return 1;
+_pop_fallback:
+	lua_pop(L,1);
+_fallback:
+	wb->len = len;
+	return 0;
+}
+
 static int
 wb_table_array(lua_State *L, struct write_block * wb, int index, int depth) {
 	int array_size = lua_rawlen(L,index);
+	if (wb->compact && array_size >= DENSE_ARRAY && wb_dense_array(L, wb, index, array_size)) {
+		return array_size;
+	}
 	if (array_size >= MAX_COOKIE-1) {
 		uint8_t n = COMBINE_TYPE(TYPE_TABLE, MAX_COOKIE-1);
 		wb_push(wb, &n, 1);
@@ -262,7 +690,7 @@ wb_table_hash(lua_State *L, struct write_block * wb, int index, int depth, int a
 				}
 			}
 		}
-		pack_one(L,wb,-2,depth);
+		pack_key(L,wb,-2,depth);
 		pack_one(L,wb,-1,depth);
 		lua_pop(L, 1);
 	}
@@ -285,7 +713,7 @@ wb_table_metapairs(lua_State *L, struct write_block *wb, int index, int depth) {
 			lua_pop(L, 4);
 			break;
 		}
-		pack_one(L, wb, -2, depth);
+		pack_key(L, wb, -2, depth);
 		pack_one(L, wb, -1, depth);
 		lua_pop(L, 1);
 	}
@@ -339,6 +767,19 @@ pack_one(lua_State *L, struct write_block *b, int index, int depth) {
 	case LUA_TLIGHTUSERDATA:
 		wb_pointer(b, lua_touserdata(L,index));
 		break;
+	case LUA_TUSERDATA: {
+		struct sharebuffer * sb = lsharebuffer_test(L, index);
+		if (sb == NULL) {
+			wb_free(b);
+			luaL_error(L, "Unsupport type %s to serialize", lua_typename(L, type));
+		}
+		if (b->share == NULL) {
+			wb_free(b);
+			luaL_error(L, "sharebuffer can only be packed into local message");
+		}
+		wb_sharebuffer(b, sb);
+		break;
+	}
 	case LUA_TTABLE: {
 		if (index < 0) {
 			index = lua_gettop(L) + index + 1;
@@ -433,6 +874,114 @@ get_pointer(lua_State *L, struct read_block *rb) {
 	return userdata;
 }
 
+/**
+ * 正在分发的消息，由 lua-skynet.c 的回调设置，见 luaseri_dispatch
+ * 不在分发中的消息自己持有其中 sharebuffer 的引用；分发中第一次 unpack 把引用交给解出的 userdata，
+ * 记下 DISPATCH_ADOPTED，之后再 unpack 同一个消息都另外增加引用
+*/
+static __thread const void * DISPATCH_MSG = NULL;
+static __thread int DISPATCH_ADOPTED = 0;
+
+void
+luaseri_dispatch(const void *msg) {
+	DISPATCH_MSG = msg;
+	DISPATCH_ADOPTED = 0;
+}
+
+/**
+ * 分发结束
+ * reserve 为 0 时消息随后由框架释放，还没有被接管的引用一起释放；
+ * 为 1 时（forward 模式）消息留给服务自己处理，已经被接管的引用要补回来
+*/
+void
+luaseri_dispatch_end(const void *msg, size_t sz, int reserve) {
+	if (msg && msg == DISPATCH_MSG) {
+		int n = share_header(msg, (int)sz);
+		if (n > 0) {
+			if (reserve && DISPATCH_ADOPTED) {
+				share_grab(msg, n);
+			} else if (!reserve && !DISPATCH_ADOPTED) {
+				share_release(msg, n);
+			}
+		}
+	}
+	DISPATCH_MSG = NULL;
+	DISPATCH_ADOPTED = 0;
+}
+
+/**
+ * 消息离开当前的分发（发送、redirect、trash）
+ * 引用已经被接管时补回来，之后消息和其它不在分发中的消息一样持有自己的引用
+*/
+void
+luaseri_detach(const void *msg, size_t sz) {
+	if (msg && msg == DISPATCH_MSG) {
+		if (DISPATCH_ADOPTED) {
+			int n = share_header(msg, (int)sz);
+			if (n > 0) {
+				share_grab(msg, n);
+			}
+		}
+		DISPATCH_MSG = NULL;
+		DISPATCH_ADOPTED = 0;
+	}
+}
+
+/**
+ * 丢弃一个不在分发中的消息之前，释放它持有的引用，由调用者释放消息本身
+ * 框架在目标服务不存在、服务退出时丢弃消息也调用这里，见 skynet_drop_hook
+*/
+void
+luaseri_drop(void *msg, size_t sz) {
+	int n = share_header(msg, (int)sz);
+	if (n > 0) {
+		share_release(msg, n);
+	}
+}
+
+// 第一次 unpack 接管消息持有的引用，返回 1
+static inline int
+dispatch_adopt(void) {
+	int adopt = !DISPATCH_ADOPTED;
+	DISPATCH_ADOPTED = 1;
+	return adopt;
+}
+
+/**
+ * 读出消息开头的 sharebuffer 列表
+ * 字符串、sharebuffer 和其它来历不明的 msg,sz 都可能被解包多次，或者来自其它节点，不能带 sharebuffer
+*/
+static void
+rb_sharelist(lua_State *L, struct read_block *rb) {
+	if (rb->len < 1 || (uint8_t)rb->buffer[rb->ptr] != COMBINE_TYPE(TYPE_USERDATA, TYPE_USERDATA_SHARELIST)) {
+		return;
+	}
+	if (!rb->local) {
+		invalid_stream(L,rb);
+	}
+	int n = share_header(rb->buffer + rb->ptr, rb->len);
+	if (n <= 0) {
+		invalid_stream(L,rb);
+	}
+	rb->nshare = n;
+	rb->share = rb->buffer + rb->ptr + SHARE_HEADER;
+	rb_read(rb, SHARE_HEADER + n * SHARE_ENTRY);
+}
+
+static struct sharebuffer *
+get_sharebuffer(lua_State *L, struct read_block *rb) {
+	uint32_t index;
+	void * p = rb_read(rb,sizeof(index));
+	if (p == NULL) {
+		invalid_stream(L,rb);
+	}
+	memcpy(&index, p, sizeof(index));
+	if (index >= (uint32_t)rb->nshare) {
+		invalid_stream(L,rb);
+	}
+	return share_at(rb->share, index);
+}
+
 static void
 get_buffer(lua_State *L, struct read_block *rb, int len) {
 	char * p = rb_read(rb,len);
@@ -443,31 +992,57 @@ get_buffer(lua_State *L, struct read_block *rb, int len) {
 }
 
 static void unpack_one(lua_State *L, struct read_block *rb);
+static void push_value(lua_State *L, struct read_block *rb, int type, int cookie);
+
+static int
+get_size(lua_State *L, struct read_block *rb) {
+	uint8_t type;
+	uint8_t *t = rb_read(rb, sizeof(type));
+	if (t==NULL) {
+		invalid_stream(L,rb);
+	}
+	type = *t;
+	int cookie = type >> 3;
+	if ((type & 7) != TYPE_NUMBER || cookie == TYPE_NUMBER_REAL) {
+		invalid_stream(L,rb);
+	}
+	lua_Integer sz = get_integer(L,rb,cookie);
+	if (sz < 0 || sz > INT_MAX) {
+		invalid_stream(L,rb);
+	}
+	return (int)sz;
+}
 
+// table 的 key，短字符串按出现顺序记下位置，供后面的引用使用，见 wb_key
 static void
-unpack_table(lua_State *L, struct read_block *rb, int array_size) {
-	if (array_size == MAX_COOKIE-1) {
-		uint8_t type;
-		uint8_t *t = rb_read(rb, sizeof(type));
-		if (t==NULL) {
+unpack_key(lua_State *L, struct read_block *rb) {
+	uint8_t type;
+	uint8_t *t = rb_read(rb, sizeof(type));
+	if (t==NULL) {
+		invalid_stream(L, rb);
+	}
+	type = *t;
+	if ((type & 7) == TYPE_SHORT_STRING) {
+		int len = type >> 3;
+		char * p = rb_read(rb,len);
+		if (p == NULL) {
 			invalid_stream(L,rb);
 		}
-		type = *t;
-		int cookie = type >> 3;
-		if ((type & 7) != TYPE_NUMBER || cookie == TYPE_NUMBER_REAL) {
-			invalid_stream(L,rb);
+		if (rb->nref < rb->maxref) {
+			rb->ref[rb->nref].str = p;
+			rb->ref[rb->nref].sz = len;
+			++rb->nref;
 		}
-		array_size = get_integer(L,rb,cookie);
-	}
-	luaL_checkstack(L,LUA_MINSTACK,NULL);
-	lua_createtable(L,array_size,0);
-	int i;
-	for (i=1;i<=array_size;i++) {
-		unpack_one(L,rb);
-		lua_rawseti(L,-2,i);
+		lua_pushlstring(L,p,len);
+	} else {
+		push_value(L, rb, type & 0x7, type>>3);
 	}
+}
+
+static void
+unpack_hash(lua_State *L, struct read_block *rb) {
 	for (;;) {
-		unpack_one(L,rb);
+		unpack_key(L,rb);
 		if (lua_isnil(L,-1)) {
 			lua_pop(L,1);
 			return;
@@ -477,6 +1052,136 @@ unpack_table(lua_State *L, struct read_block *rb, int array_size) {
 	}
 }
 
+/**
+ * 读 table 的头（TYPE_TABLE 或纯数字数组），返回数组部分的大小
+ * 纯数字数组时 dense 是元素类型，data 指向元素；否则 dense 为 -1
+*/
+static int
+table_header(lua_State *L, struct read_block *rb, int type, int cookie, int *dense, const uint8_t **data) {
+	if (type == TYPE_TABLE) {
+		*dense = -1;
+		if (cookie == MAX_COOKIE-1) {
+			return get_size(L,rb);
+		}
+		return cookie;
+	}
+	// 纯数字数组，见 wb_dense_array
+	uint8_t *t = rb_read(rb, 1);
+	if (t==NULL || (*t & 7) != TYPE_NUMBER) {
+		invalid_stream(L,rb);
+	}
+	int width;
+	switch (*t >> 3) {
+	case TYPE_NUMBER_BYTE:
+		width = 1;
+		break;
+	case TYPE_NUMBER_WORD:
+		width = 2;
+		break;
+	case TYPE_NUMBER_DWORD:
+		width = 4;
+		break;
+	case TYPE_NUMBER_QWORD:
+	case TYPE_NUMBER_REAL:
+		width = 8;
+		break;
+	default:
+		invalid_stream(L,rb);
+		return 0;
+	}
+	*dense = *t >> 3;
+	int array_size = get_size(L,rb);
+	if (array_size > rb->len / width) {
+		invalid_stream(L,rb);
+	}
+	*data = rb_read(rb, array_size * width);
+	return array_size;
+}
+
+// 填充栈顶的 table：先数组部分，再 hash 部分
+static void
+table_fill(lua_State *L, struct read_block *rb, int array_size, int dense, const uint8_t *data) {
+	luaL_checkstack(L,LUA_MINSTACK,NULL);
+	int i;
+	switch (dense) {
+	case -1:
+		for (i=0;i<array_size;i++) {
+			unpack_one(L,rb);
+			lua_rawseti(L,-2,i+1);
+		}
+		break;
+	case TYPE_NUMBER_BYTE:
+		for (i=0;i<array_size;i++) {
+			lua_pushinteger(L, data[i]);
+			lua_rawseti(L,-2,i+1);
+		}
+		break;
+	case TYPE_NUMBER_WORD:
+		for (i=0;i<array_size;i++) {
+			uint16_t v;
+			memcpy(&v, data + i * 2, 2);
+			lua_pushinteger(L, v);
+			lua_rawseti(L,-2,i+1);
+		}
+		break;
+	case TYPE_NUMBER_DWORD:
+		for (i=0;i<array_size;i++) {
+			int32_t v;
+			memcpy(&v, data + i * 4, 4);
+			lua_pushinteger(L, v);
+			lua_rawseti(L,-2,i+1);
+		}
+		break;
+	case TYPE_NUMBER_QWORD:
+		for (i=0;i<array_size;i++) {
+			int64_t v;
+			memcpy(&v, data + i * 8, 8);
+			lua_pushinteger(L, v);
+			lua_rawseti(L,-2,i+1);
+		}
+		break;
+	default:
+		for (i=0;i<array_size;i++) {
+			double v;
+			memcpy(&v, data + i * 8, 8);
+			lua_pushnumber(L, v);
+			lua_rawseti(L,-2,i+1);
+		}
+		break;
+	}
+	unpack_hash(L,rb);
+}
+
+static void
+unpack_table(lua_State *L, struct read_block *rb, int type, int cookie) {
+	int dense;
+	const uint8_t *data = NULL;
+	int array_size = table_header(L, rb, type, cookie, &dense, &data);
+	luaL_checkstack(L,LUA_MINSTACK,NULL);
+	lua_createtable(L,array_size,0);
+	table_fill(L, rb, array_size, dense, data);
+}
+
+static void
+unpack_extend(lua_State *L, struct read_block *rb, int cookie) {
+	int index = cookie;
+	if (cookie == EXTEND_ARRAY) {
+		unpack_table(L,rb,TYPE_EXTEND,cookie);
+		return;
+	}
+	if (cookie == EXTEND_REF_LONG) {
+		uint8_t *n = rb_read(rb, 1);
+		if (n == NULL) {
+			invalid_stream(L,rb);
+		}
+		index = EXTEND_REF_LONG + *n;
+	}
+	if (index >= rb->nref) {
+		invalid_stream(L,rb);
+	}
+	lua_pushlstring(L, rb->ref[index].str, rb->ref[index].sz);
+}
+
 static void
 push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 	switch(type) {
@@ -494,7 +1199,16 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 		}
 		break;
 	case TYPE_USERDATA:
-		lua_pushlightuserdata(L,get_pointer(L,rb));
+		if (cookie == TYPE_USERDATA_SHAREBUFFER) {
+			// 第一次 unpack 接管消息持有的引用，之后另外增加引用
+			struct sharebuffer * sb = get_sharebuffer(L,rb);
+			if (!rb->adopt) {
+				sharebuffer_grab(sb);
+			}
+			lsharebuffer_push(L, sb);
+		} else {
+			lua_pushlightuserdata(L,get_pointer(L,rb));
+		}
 		break;
 	case TYPE_SHORT_STRING:
 		get_buffer(L,rb,cookie);
@@ -523,9 +1237,12 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 		break;
 	}
 	case TYPE_TABLE: {
-		unpack_table(L,rb,cookie);
+		unpack_table(L,rb,type,cookie);
 		break;
 	}
+	case TYPE_EXTEND:
+		unpack_extend(L,rb,cookie);
+		break;
 	default: {
 		invalid_stream(L,rb);
 		break;
@@ -533,40 +1250,169 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 	}
 }
 
+static int skip_one(lua_State *L, struct read_block *rb, int key, int depth);
+
 static void
-unpack_one(lua_State *L, struct read_block *rb) {
-	uint8_t type;
-	uint8_t *t = rb_read(rb, sizeof(type));
-	if (t==NULL) {
-		invalid_stream(L, rb);
+skip_bytes(lua_State *L, struct read_block *rb, int sz) {
+	if (rb_read(rb, sz) == NULL) {
+		invalid_stream(L,rb);
+	}
+}
+
+static void
+skip_table(lua_State *L, struct read_block *rb, int type, int cookie, int depth) {
+	if (depth > MAX_DEPTH) {
+		invalid_stream(L,rb);
+	}
+	int dense;
+	const uint8_t *data;
+	int array_size = table_header(L, rb, type, cookie, &dense, &data);
+	if (dense < 0) {
+		int i;
+		for (i=0;i<array_size;i++) {
+			skip_one(L, rb, 0, depth);
+		}
+	}
+	while (skip_one(L, rb, 1, depth) != TYPE_NIL) {
+		skip_one(L, rb, 0, depth);
 	}
-	type = *t;
-	push_value(L, rb, type & 0x7, type>>3);
 }
 
 /**
- * 将block链表的数据，移到一个连续的内存单元buffer
- * 然后将buffer压栈
+ * 跳过一个值，不创建 lua 对象，返回它的类型
+ * key 为 1 时按 unpack_key 的规则记下短字符串 key，消息里的 sharebuffer 记到 rb->share
 */
-static void
-seri(lua_State *L, struct block *b, int len) {
-	uint8_t * buffer = skynet_malloc(len);
-	uint8_t * ptr = buffer;
-	int sz = len;
-	while(len>0) {
-		if (len >= BLOCK_SIZE) {
-			memcpy(ptr, b->buffer, BLOCK_SIZE);
-			ptr += BLOCK_SIZE;
-			len -= BLOCK_SIZE;
-			b = b->next;
+static int
+skip_one(lua_State *L, struct read_block *rb, int key, int depth) {
+	uint8_t *t = rb_read(rb, 1);
+	if (t == NULL) {
+		invalid_stream(L,rb);
+	}
+	int type = *t & 7;
+	int cookie = *t >> 3;
+	switch (type) {
+	case TYPE_NIL:
+	case TYPE_BOOLEAN:
+		break;
+	case TYPE_NUMBER:
+		switch (cookie) {
+		case TYPE_NUMBER_ZERO:
+			break;
+		case TYPE_NUMBER_BYTE:
+			skip_bytes(L, rb, 1);
+			break;
+		case TYPE_NUMBER_WORD:
+			skip_bytes(L, rb, 2);
+			break;
+		case TYPE_NUMBER_DWORD:
+			skip_bytes(L, rb, 4);
+			break;
+		case TYPE_NUMBER_QWORD:
+		case TYPE_NUMBER_REAL:
+			skip_bytes(L, rb, 8);
+			break;
+		default:
+			invalid_stream(L,rb);
+		}
+		break;
+	case TYPE_USERDATA: {
+		if (cookie != TYPE_USERDATA_SHAREBUFFER) {
+			get_pointer(L,rb);
+			break;
+		}
+		get_sharebuffer(L,rb);
+		break;
+	}
+	case TYPE_SHORT_STRING: {
+		char * p = rb_read(rb, cookie);
+		if (p == NULL) {
+			invalid_stream(L,rb);
+		}
+		if (key && rb->nref < rb->maxref) {
+			rb->ref[rb->nref].str = p;
+			rb->ref[rb->nref].sz = cookie;
+			++rb->nref;
+		}
+		break;
+	}
+	case TYPE_LONG_STRING: {
+		uint32_t len;
+		if (cookie == 2) {
+			uint16_t n;
+			uint16_t *plen = rb_read(rb, 2);
+			if (plen == NULL) {
+				invalid_stream(L,rb);
+			}
+			memcpy(&n, plen, sizeof(n));
+			len = n;
 		} else {
-			memcpy(ptr, b->buffer, len);
+			uint32_t *plen;
+			if (cookie != 4 || (plen = rb_read(rb, 4)) == NULL) {
+				invalid_stream(L,rb);
+			}
+			memcpy(&len, plen, sizeof(len));
+		}
+		if (len > (uint32_t)rb->len) {
+			invalid_stream(L,rb);
+		}
+		skip_bytes(L, rb, (int)len);
+		break;
+	}
+	case TYPE_TABLE:
+		skip_table(L, rb, type, cookie, depth+1);
+		break;
+	case TYPE_EXTEND: {
+		int index = cookie;
+		if (cookie == EXTEND_ARRAY) {
+			skip_table(L, rb, type, cookie, depth+1);
 			break;
 		}
+		if (cookie == EXTEND_REF_LONG) {
+			uint8_t *n = rb_read(rb, 1);
+			if (n == NULL) {
+				invalid_stream(L,rb);
+			}
+			index = EXTEND_REF_LONG + *n;
+		}
+		if (index >= rb->nref) {
+			invalid_stream(L,rb);
+		}
+		break;
+	}
+	}
+	return type;
+}
+
+/**
+ * 按需解包：table 先不解开，只压一个空的视图 table，记下它在消息里的位置
+ * 第一次访问时才解开一层，见 view_fill
+*/
+static void
+view_table(lua_State *L, struct read_block *rb, int type, int cookie) {
+	int offset = rb->ptr - 1;
+	skip_table(L, rb, type, cookie, 1);
+	luaL_checkstack(L,LUA_MINSTACK,NULL);
+	lua_newtable(L);
+	lua_pushvalue(L, rb->view);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_pushinteger(L, offset);
+	lua_rawset(L, rb->view + 1);
+}
+
+static void
+unpack_one(lua_State *L, struct read_block *rb) {
+	uint8_t type;
+	uint8_t *t = rb_read(rb, sizeof(type));
+	if (t==NULL) {
+		invalid_stream(L, rb);
+	}
+	type = *t;
+	if (rb->view && ((type & 7) == TYPE_TABLE || type == COMBINE_TYPE(TYPE_EXTEND, EXTEND_ARRAY))) {
+		view_table(L, rb, type & 0x7, type>>3);
+	} else {
+		push_value(L, rb, type & 0x7, type>>3);
 	}
-	
-	lua_pushlightuserdata(L, buffer);
-	lua_pushinteger(L, sz);
 }
 
 int
@@ -576,13 +1422,20 @@ luaseri_unpack(lua_State *L) {
 	}
 	void * buffer;
 	int len;
+	int local = 0;
+	struct sharebuffer * sb;
 	if (lua_type(L,1) == LUA_TSTRING) {
 		size_t sz;
 		 buffer = (void *)lua_tolstring(L,1,&sz);
 		len = (int)sz;
+	} else if ((sb = lsharebuffer_test(L, 1))) {
+		// 直接在共享的内容上解包，userdata 留在栈上保证解包期间不被释放
+		buffer = sb->msg;
+		len = sb->sz;
 	} else {
 		buffer = lua_touserdata(L,1);
 		len = luaL_checkinteger(L,2);
+		local = buffer == DISPATCH_MSG;
 	}
 	if (len == 0) {
 		return 0;
@@ -593,7 +1446,13 @@ luaseri_unpack(lua_State *L) {
 
 	lua_settop(L,1);
 	struct read_block rb;
-	rball_init(&rb, buffer, len);
+	struct key_ref ref[MAX_REF];
+	rball_init(&rb, buffer, len, ref);
+	rb.local = local;
+	rb_sharelist(L, &rb);
+	if (rb.nshare > 0) {
+		rb.adopt = dispatch_adopt();
+	}
 
 	int i;
 	for (i=0;;i++) {
@@ -615,24 +1474,349 @@ luaseri_unpack(lua_State *L) {
 
 /**
  * luaseri_pack 是对 ... 的序列化，调用方式为 p.pack(...)
- * 一番操作后，栈中留下两个返回值(见seri)：
+ * 一番操作后，栈中留下两个返回值(见wb_detach)：
  * 1. ... 整理成的 buffer，作为 lightuserdata
  * 2. buffer的内存大小
  * 
  * 经测试：若 ... 中只有单个字符串 "abc"
  * pack得到的buffer长度是4，即头部会多一个字节
 */
+static int
+pack_message(lua_State *L, int local, int compact) {
+	struct write_block wb;
+	struct share_list share = { 0, 0, NULL };
+	wb_init(&wb);
+	wb.share = local ? &share : NULL;
+	wb.compact = compact;
+	pack_from(L,&wb,0);
+	if (wb.share) {
+		wb_sharelist(&wb);
+	}
+	int sz = wb.len;
+	lua_pushlightuserdata(L, wb_detach(&wb));
+	lua_pushinteger(L, sz);
+
+	wb_free(&wb);
+
+	return 2;
+}
+
 LUAMOD_API int
 luaseri_pack(lua_State *L) {
-	struct block temp;
-	temp.next = NULL;
+	return pack_message(L, 1, 0);
+}
+
+/**
+ * 打包发给其它节点（cluster）的消息，格式和 luaseri_pack 相同，但不允许 sharebuffer
+*/
+LUAMOD_API int
+luaseri_packremote(lua_State *L) {
+	return pack_message(L, 0, 0);
+}
+
+/**
+ * 和 luaseri_pack 一样，但重复的字符串 key 只写编号、纯数字数组不逐项写类型（TYPE_EXTEND）
+ * 新版本的 unpack 两种格式都能读，老版本只能读 luaseri_pack 的格式，
+ * 所以只在确定接收方都是新版本时使用，要持久化或发给其它节点的数据用 luaseri_pack / luaseri_packstring
+*/
+LUAMOD_API int
+luaseri_packcompact(lua_State *L) {
+	return pack_message(L, 1, 1);
+}
+
+/**
+ * 消息里有多少个 sharebuffer，发给其它 harbor 或者 sendbatch 之前检查，见 lua-skynet.c
+ * 只看开头的列表，不用扫描整个消息
+*/
+int
+luaseri_hasbuffer(const void *msg, size_t sz) {
+	int n = share_header(msg, (int)sz);
+	return n > 0 ? n : 0;
+}
+
+/**
+ * 打包成 sharebuffer，打包一次就可以发给多个服务、多个 socket，接收方可以直接在上面 unpack
+ * sharebuffer 可以被 unpack 任意次，所以里面不能再嵌套 sharebuffer
+*/
+LUAMOD_API int
+luaseri_packbuffer(lua_State *L) {
 	struct write_block wb;
-	wb_init(&wb, &temp);
+	wb_init(&wb);
 	pack_from(L,&wb,0);
-	assert(wb.head == &temp);
-	seri(L, &temp, wb.len);
+	int sz = wb.len;
+	void * buffer = wb_detach(&wb);
+	if (wb.cap > sz * 2) {
+		// sharebuffer 可能存活很久，还回多余的空间
+		buffer = skynet_realloc(buffer, sz);
+	}
+	lsharebuffer_push(L, sharebuffer_new(buffer, sz));
 
 	wb_free(&wb);
 
+	return 1;
+}
+
+/**
+ * 打包成字符串，直接从打包的 buffer 拷贝进 lua 字符串
+ * 字符串可能被 unpack 任意次，所以同样不能打包 sharebuffer
+*/
+LUAMOD_API int
+luaseri_packstring(lua_State *L) {
+	struct write_block wb;
+	wb_init(&wb);
+	pack_from(L,&wb,0);
+	lua_pushlstring(L, wb.buffer, wb.len);
+	wb_free(&wb);
+
+	return 1;
+}
+
+/**
+ * 按需解包（unpackview）：先扫描一遍校验整个消息、记下所有 key 的位置，table 只压一个空的视图
+ * 视图第一次被访问（取值、赋值、pairs、#）时才解开这一层，子 table 仍然是视图
+ * 视图共用一个元表，upvalue 是 seri_view 和 offsets（视图 -> 在消息里的位置，弱 key）
+ * seri_view 的 uservalue 持有消息的内容，所以只要还有视图活着，内容就不会被释放
+*/
+struct seri_view {
+	const char * msg;
+	int sz;
+	int nref;
+	int nbuffer;	// 消息开头列表里的 sharebuffer，seri_view 各持有一个引用
+	struct key_ref * ref;
+};
+
+#define SERIVIEW_METATABLE "skynet.seriview"
+#define SERIVIEW_OFFSETS "skynet.seriview.offsets"
+
+static int
+lview_release(lua_State *L) {
+	struct seri_view * root = lua_touserdata(L, 1);
+	share_release(root->msg, root->nbuffer);
+	root->nbuffer = 0;
+	return 0;
+}
+
+// 栈上 1 的视图还没有解开时，解开这一层
+static void
+view_fill(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int top = lua_gettop(L);
+	lua_pushvalue(L, 1);
+	if (lua_rawget(L, lua_upvalueindex(2)) == LUA_TNIL) {
+		lua_settop(L, top);
+		return;
+	}
+	int offset = (int)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, lua_upvalueindex(2));
+
+	struct seri_view * root = lua_touserdata(L, lua_upvalueindex(1));
+	struct read_block rb;
+	rball_init(&rb, (char *)root->msg, root->sz, root->ref);
+	// 子 table 的位置都相对整个消息
+	rb.ptr = offset;
+	rb.len -= offset;
+	rb.nref = root->nref;
+	rb.maxref = 0;
+	rb.adopt = 0;
+	// 创建视图时已经校验过整个消息
+	rb.nshare = root->nbuffer;
+	rb.share = root->msg + SHARE_HEADER;
+	lua_getmetatable(L, 1);
+	rb.view = lua_gettop(L);
+	lua_pushvalue(L, lua_upvalueindex(2));
+
+	uint8_t *t = rb_read(&rb, 1);
+	if (t == NULL) {
+		invalid_stream(L,&rb);
+	}
+	int dense;
+	const uint8_t *data = NULL;
+	int array_size = table_header(L, &rb, *t & 7, *t >> 3, &dense, &data);
+	lua_pushvalue(L, 1);
+	table_fill(L, &rb, array_size, dense, data);
+	lua_settop(L, top);
+}
+
+static int
+lview_index(lua_State *L) {
+	view_fill(L);
+	lua_settop(L, 2);
+	lua_rawget(L, 1);
+	return 1;
+}
+
+static int
+lview_newindex(lua_State *L) {
+	view_fill(L);
+	lua_settop(L, 3);
+	lua_rawset(L, 1);
+	return 0;
+}
+
+static int
+lview_len(lua_State *L) {
+	view_fill(L);
+	lua_pushinteger(L, lua_rawlen(L, 1));
+	return 1;
+}
+
+static int
+lview_next(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 2);
+	if (lua_next(L, 1)) {
+		return 2;
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static int
+lview_pairs(lua_State *L) {
+	view_fill(L);
+	lua_pushcfunction(L, lview_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+/**
+ * 和 unpack 参数相同：string、sharebuffer，或消息的 msg,sz
+ * msg,sz 在回调返回后就被框架释放，所以复制一份到 sharebuffer 里；string、sharebuffer 直接引用，不复制
+*/
+LUAMOD_API int
+luaseri_unpackview(lua_State *L) {
+	if (lua_isnoneornil(L,1)) {
+		return 0;
+	}
+	char * buffer;
+	int len;
+	int local = 0;
+	struct sharebuffer * sb;
+	lua_settop(L, 2);
+	if (lua_type(L,1) == LUA_TSTRING) {
+		size_t sz;
+		buffer = (char *)lua_tolstring(L,1,&sz);
+		len = (int)sz;
+		lua_pushvalue(L, 1);
+	} else if ((sb = lsharebuffer_test(L, 1))) {
+		buffer = sb->msg;
+		len = sb->sz;
+		lua_pushvalue(L, 1);
+	} else {
+		void * msg = lua_touserdata(L,1);
+		len = luaL_checkinteger(L,2);
+		if (len == 0) {
+			return 0;
+		}
+		if (msg == NULL) {
+			return luaL_error(L, "deserialize null pointer");
+		}
+		buffer = skynet_malloc(len);
+		memcpy(buffer, msg, len);
+		lsharebuffer_push(L, sharebuffer_new(buffer, len));
+		local = msg == DISPATCH_MSG;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	// 扫描：校验、记下 key 的位置
+	struct read_block rb;
+	struct key_ref ref[MAX_REF];
+	rball_init(&rb, buffer, len, ref);
+	rb.local = local;
+	rb_sharelist(L, &rb);
+	int nshare = rb.nshare;
+	int body = rb.ptr;
+	while (rb.len > 0) {
+		skip_one(L, &rb, 0, 0);
+	}
+	int nref = rb.nref;
+	struct seri_view * root = lua_newuserdata(L, sizeof(*root) + nref * sizeof(struct key_ref));
+	root->msg = buffer;
+	root->sz = len;
+	root->nref = nref;
+	root->nbuffer = 0;
+	root->ref = (struct key_ref *)(root + 1);
+	memcpy(root->ref, ref, nref * sizeof(struct key_ref));
+	if (luaL_newmetatable(L, SERIVIEW_METATABLE)) {
+		lua_pushcfunction(L, lview_release);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 3);
+	lua_setuservalue(L, -2);
+	if (nshare > 0) {
+		// 第一次解包接管消息持有的引用，否则另外增加引用
+		if (!dispatch_adopt()) {
+			share_grab(buffer, nshare);
+		}
+		root->nbuffer = nshare;
+	}
+
+	// 视图的元表
+	lua_createtable(L, 0, 5);
+	lua_newtable(L);
+	if (luaL_newmetatable(L, SERIVIEW_OFFSETS)) {
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+	}
+	lua_setmetatable(L, -2);
+	luaL_Reg l[] = {
+		{ "__index", lview_index },
+		{ "__newindex", lview_newindex },
+		{ "__len", lview_len },
+		{ "__pairs", lview_pairs },
+		{ NULL, NULL },
+	};
+	lua_pushvalue(L, 5);
+	lua_pushvalue(L, 4);
+	lua_pushvalue(L, 6);
+	luaL_setfuncs(L, l, 2);
+	lua_pushvalue(L, 4);
+	lua_setfield(L, -2, "__view");
+	lua_pop(L, 1);
+
+	rball_init(&rb, buffer, len, root->ref);
+	rb.ptr = body;
+	rb.len -= body;
+	rb.nref = nref;
+	rb.maxref = 0;
+	rb.adopt = 0;
+	rb.nshare = nshare;
+	rb.share = buffer + SHARE_HEADER;
+	rb.view = 5;
+	int i;
+	for (i=0;rb.len > 0;i++) {
+		if (i%8==7) {
+			luaL_checkstack(L,LUA_MINSTACK,NULL);
+		}
+		unpack_one(L, &rb);
+	}
+
+	return lua_gettop(L) - 6;
+}
+
+/**
+ * 把视图所在的整个消息原样复制成新的 msg,sz，可以直接 rawsend 给别的服务
+ * key 的编号是整个消息统一的，所以只能转发整个消息，不能单独转发其中的子 table
+*/
+LUAMOD_API int
+luaseri_viewmessage(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (luaL_getmetafield(L, 1, "__view") == LUA_TNIL) {
+		return luaL_argerror(L, 1, "need a table from unpackview");
+	}
+	struct seri_view * root = luaL_checkudata(L, -1, SERIVIEW_METATABLE);
+	void * msg = skynet_malloc(root->sz);
+	memcpy(msg, root->msg, root->sz);
+	// 新消息的每个 sharebuffer 各持有一个引用
+	share_grab(root->msg, root->nbuffer);
+	lua_pushlightuserdata(L, msg);
+	lua_pushinteger(L, root->sz);
 	return 2;
 }
@@ -2,8 +2,20 @@
 #define LUA_SERIALIZE_H
 
 #include <lua.h>
+#include <stddef.h>
 
 int luaseri_pack(lua_State *L);
+int luaseri_packcompact(lua_State *L);
+int luaseri_packremote(lua_State *L);
 int luaseri_unpack(lua_State *L);
+int luaseri_packbuffer(lua_State *L);
+int luaseri_packstring(lua_State *L);
+int luaseri_unpackview(lua_State *L);
+int luaseri_viewmessage(lua_State *L);
+void luaseri_dispatch(const void *msg);
+void luaseri_dispatch_end(const void *msg, size_t sz, int reserve);
+void luaseri_detach(const void *msg, size_t sz);
+void luaseri_drop(void *msg, size_t sz);
+int luaseri_hasbuffer(const void *msg, size_t sz);
 
 #endif
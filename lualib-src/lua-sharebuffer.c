@@ -0,0 +1,66 @@
+#define LUA_LIB
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "sharebuffer.h"
+#include "lua-sharebuffer.h"
+
+#define SHAREBUFFER_METATABLE "skynet.sharebuffer"
+
+/**
+ * lua 里的 sharebuffer 是一个只放指针的 userdata，每个 userdata 持有一个引用
+ * 同一块内容在多个服务里各有各的 userdata，由各自的 gc 释放引用
+*/
+
+static int
+lrelease(lua_State *L) {
+	struct sharebuffer ** box = lua_touserdata(L, 1);
+	if (*box) {
+		sharebuffer_release(*box);
+		*box = NULL;
+	}
+	return 0;
+}
+
+static int
+llen(lua_State *L) {
+	struct sharebuffer ** box = lua_touserdata(L, 1);
+	lua_pushinteger(L, *box ? (*box)->sz : 0);
+	return 1;
+}
+
+static int
+ltostring(lua_State *L) {
+	struct sharebuffer ** box = lua_touserdata(L, 1);
+	lua_pushfstring(L, "sharebuffer: %p (%d)", *box, *box ? (*box)->sz : 0);
+	return 1;
+}
+
+struct sharebuffer *
+lsharebuffer_test(lua_State *L, int index) {
+	struct sharebuffer ** box = luaL_testudata(L, index, SHAREBUFFER_METATABLE);
+	if (box == NULL) {
+		return NULL;
+	}
+	if (*box == NULL) {
+		luaL_error(L, "sharebuffer is released");
+	}
+	return *box;
+}
+
+void
+lsharebuffer_push(lua_State *L, struct sharebuffer *sb) {
+	struct sharebuffer ** box = lua_newuserdata(L, sizeof(*box));
+	*box = sb;
+	if (luaL_newmetatable(L, SHAREBUFFER_METATABLE)) {
+		luaL_Reg l[] = {
+			{ "__gc", lrelease },
+			{ "__len", llen },
+			{ "__tostring", ltostring },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+}
@@ -0,0 +1,13 @@
+#ifndef LUA_SHAREBUFFER_H
+#define LUA_SHAREBUFFER_H
+
+#include <lua.h>
+
+struct sharebuffer;
+
+// 栈上 index 处是 sharebuffer 时返回它，否则返回 NULL
+struct sharebuffer * lsharebuffer_test(lua_State *L, int index);
+// 把 sb 包成 userdata 压栈，userdata 接管 sb 的一个引用，被回收时释放
+void lsharebuffer_push(lua_State *L, struct sharebuffer *sb);
+
+#endif
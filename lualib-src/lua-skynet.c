@@ -1,7 +1,10 @@
 #define LUA_LIB
+#define _GNU_SOURCE
 
 #include "skynet.h"
 #include "lua-seri.h"
+#include "lua-sharebuffer.h"
+#include "sharebuffer.h"
 
 #define KNRM  "\x1B[0m"
 #define KRED  "\x1B[31m"
@@ -12,6 +15,9 @@
 #include <string.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <pthread.h>
 
 #include <time.h>
 
@@ -53,7 +59,7 @@ traceback (lua_State *L) {
 }
 
 static int
-_cb(struct skynet_context * context, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+_cb(struct skynet_context * context, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz, int forward) {
 	lua_State *L = ud;
 	int trace = 1;
 	int r;
@@ -75,7 +81,11 @@ _cb(struct skynet_context * context, void * ud, int type, int session, uint32_t
 	lua_pushinteger(L, source);
 
 	// callback(type, msg, sz, session, source)
+	// 分发期间 unpack 这个 msg 才认其中的 sharebuffer
+	luaseri_dispatch(msg);
 	r = lua_pcall(L, 5, 0 , trace);
+	// 非 forward 模式消息随后由框架释放，forward 模式留给服务自己处理
+	luaseri_dispatch_end(msg, sz, forward);
 
 	if (r == LUA_OK) {
 		return 0;
@@ -101,9 +111,26 @@ _cb(struct skynet_context * context, void * ud, int type, int session, uint32_t
 	return 0;
 }
 
+/**
+ * 非 forward 模式的回调
+ * 同一个 tick 到期的多个定时器会合并成一个消息（见 skynet_callback_timerbatch），在这里拆开逐个交给 lua
+*/
+static int
+timerbatch_cb(struct skynet_context * context, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	if (type == PTYPE_RESPONSE && session == 0 && source == 0 && msg) {
+		const int * s = msg;
+		int i, n = sz / sizeof(int);
+		for (i=0;i<n;i++) {
+			_cb(context, ud, PTYPE_RESPONSE, s[i], 0, NULL, 0, 0);
+		}
+		return 0;
+	}
+	return _cb(context, ud, type, session, source, msg, sz, 0);
+}
+
 static int
 forward_cb(struct skynet_context * context, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
-	_cb(context, ud, type, session, source, msg, sz);
+	_cb(context, ud, type, session, source, msg, sz, 1);
 	// don't delete msg in forward mode.
 	return 1;
 }
@@ -128,7 +155,10 @@ lcallback(lua_State *L) {
 	if (forward) {
 		skynet_callback(context, gL, forward_cb);
 	} else {
-		skynet_callback(context, gL, _cb);
+		skynet_callback(context, gL, timerbatch_cb);
+		// _cb 从不保留消息，可以直接接收 sendbatch 共享的数据
+		skynet_callback_shared(context, 1);
+		skynet_callback_timerbatch(context, 1);
 	}
 
 	return 0;
@@ -247,6 +277,54 @@ get_dest_string(lua_State *L, int index) {
 	return dest_string;
 }
 
+/**
+ * 查询 .name 别名对应的句柄，结果缓存在 upvalue 2 的表中：[name] = version << 32 | handle
+ * 别名有增删时 version 会变，缓存随之失效。查不到返回0
+*/
+static uint32_t
+query_localname(lua_State *L, struct skynet_context * context, int index) {
+	unsigned int version = skynet_queryname_version();
+	lua_pushvalue(L, index);
+	if (lua_rawget(L, lua_upvalueindex(2)) == LUA_TNUMBER) {
+		lua_Integer v = lua_tointeger(L, -1);
+		if ((unsigned int)((uint64_t)v >> 32) == version) {
+			lua_pop(L, 1);
+			return (uint32_t)v;
+		}
+	}
+	lua_pop(L, 1);
+	// 先取 version 再查询，查询期间别名有变化的话下次会重新查询
+	uint32_t handle = skynet_queryname(context, lua_tostring(L, index));
+	if (handle != 0) {
+		lua_pushvalue(L, index);
+		lua_pushinteger(L, (lua_Integer)((uint64_t)version << 32 | handle));
+		lua_rawset(L, lua_upvalueindex(2));
+	}
+	return handle;
+}
+
+/**
+ * 框架丢弃消息时释放其中 sharebuffer 的引用，见 skynet_drop_hook
+ * 回调在这个动态库里，lua 服务都退出后库会被 dlclose，框架还可能在丢弃消息，所以先让库常驻
+*/
+static pthread_once_t DROP_HOOK_ONCE = PTHREAD_ONCE_INIT;
+
+static void
+drop_hook_init(void) {
+	Dl_info info;
+	if (dladdr((void *)luaseri_drop, &info) && info.dli_fname
+		&& dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE)) {
+		skynet_drop_hook(luaseri_drop);
+	}
+}
+
+// 丢弃一个自己持有的消息，连同其中 sharebuffer 的引用
+static void
+drop_message(void *msg, size_t sz) {
+	luaseri_drop(msg, sz);
+	skynet_free(msg);
+}
+
 /**
  * 向某个服务发送消息
 */
@@ -256,7 +334,7 @@ send_message(lua_State *L, int source, int idx_type) {
 
 	// 第一个参数：目标服务实例信息，分两种情况
 	// 数字xxx 句柄			dest
-	// 字符串.xxx 别名		dest_string
+	// 字符串.xxx 别名		dest_string，本地别名查到句柄后缓存起来
 	uint32_t dest = (uint32_t)lua_tointeger(L, 1);
 	const char * dest_string = NULL;
 	if (dest == 0) {
@@ -264,6 +342,12 @@ send_message(lua_State *L, int source, int idx_type) {
 			return luaL_error(L, "Invalid service address 0");
 		}
 		dest_string = get_dest_string(L, 1);
+		if (dest_string[0] == '.') {
+			dest = query_localname(L, context, 1);
+			if (dest != 0) {
+				dest_string = NULL;
+			}
+		}
 	}
 
 	// 第二个参数：消息类型
@@ -297,6 +381,14 @@ send_message(lua_State *L, int source, int idx_type) {
 		void * msg = lua_touserdata(L,idx_type+2);
 		// 第五个参数：消息数据的大小
 		int size = luaL_checkinteger(L,idx_type+3);
+		// 正在分发的消息被转走（redirect），之后由接收方处理
+		luaseri_detach(msg, size);
+		// sharebuffer 只在本进程内有效，不能经 harbor 发给其它节点
+		if ((dest_string ? dest_string[0] != '.' : skynet_isremote(context, dest, NULL))
+			&& luaseri_hasbuffer(msg, size)) {
+			drop_message(msg, size);
+			return luaL_error(L, "sharebuffer can't be sent to remote service");
+		}
 		if (dest_string) {
 			session = skynet_sendname(context, source, dest_string, type | PTYPE_TAG_DONTCOPY, session, msg, size);
 		} else {
@@ -321,6 +413,84 @@ send_message(lua_State *L, int source, int idx_type) {
 	return 1;
 }
 
+#define BATCH_STACK 64
+
+/*
+	table addresses (uint32 address / string address)
+	integer type
+	integer session
+	string message
+	 lightuserdata message_ptr
+	 integer len
+
+	return the number of messages sent
+ */
+static int
+lsendbatch(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int type = luaL_checkinteger(L, 2);
+	int session = luaL_optinteger(L, 3, 0);
+	int n = lua_rawlen(L, 1);
+	uint32_t tmp[BATCH_STACK];
+	uint32_t *dest = tmp;
+	if (n > BATCH_STACK) {
+		dest = lua_newuserdata(L, n * sizeof(uint32_t));
+	}
+	int i;
+	for (i=0;i<n;i++) {
+		lua_rawgeti(L, 1, i+1);
+		uint32_t addr = (uint32_t)lua_tointeger(L, -1);
+		if (addr == 0) {
+			if (lua_type(L, -1) == LUA_TNUMBER) {
+				return luaL_error(L, "Invalid service address 0");
+			}
+			const char * name = get_dest_string(L, -1);
+			if (name[0] == '.') {
+				addr = query_localname(L, context, lua_gettop(L));
+			} else {
+				addr = skynet_queryname(context, name);
+			}
+		}
+		dest[i] = addr;
+		lua_pop(L, 1);
+	}
+
+	int r;
+	switch (lua_type(L, 4)) {
+	case LUA_TSTRING: {
+		size_t len = 0;
+		void * msg = (void *)lua_tolstring(L, 4, &len);
+		if (len == 0) {
+			msg = NULL;
+		}
+		r = skynet_sendbatch(context, 0, dest, n, type, session, msg, len);
+		break;
+	}
+	case LUA_TLIGHTUSERDATA: {
+		void * msg = lua_touserdata(L, 4);
+		int size = luaL_checkinteger(L, 5);
+		// 消息里的每个 sharebuffer 只有一个引用，不能交给多个接收者
+		luaseri_detach(msg, size);
+		if (luaseri_hasbuffer(msg, size)) {
+			drop_message(msg, size);
+			return luaL_error(L, "sharebuffer can't be sent by sendbatch");
+		}
+		r = skynet_sendbatch(context, 0, dest, n, type | PTYPE_TAG_DONTCOPY, session, msg, size);
+		break;
+	}
+	default:
+		return luaL_error(L, "invalid param %s", lua_typename(L, lua_type(L,4)));
+	}
+	if (r < 0) {
+		// package is too large
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushinteger(L, r);
+	return 1;
+}
+
 /*
 	uint32 address
 	 string address
@@ -381,12 +551,43 @@ ltostring(lua_State *L) {
 	if (lua_isnoneornil(L,1)) {
 		return 0;
 	}
+	struct sharebuffer * sb = lsharebuffer_test(L,1);
+	if (sb) {
+		lua_pushlstring(L,sb->msg,sb->sz);
+		return 1;
+	}
 	char * msg = lua_touserdata(L,1);
 	int sz = luaL_checkinteger(L,2);
 	lua_pushlstring(L,msg,sz);
 	return 1;
 }
 
+/**
+ * tobuffer(string) 或 tobuffer(msg, sz)
+ * 把内容复制一份做成 sharebuffer，之后发给多个服务、多个 socket 都不再复制
+*/
+static int
+ltobuffer(lua_State *L) {
+	const char * msg;
+	size_t sz;
+	if (lua_type(L,1) == LUA_TSTRING) {
+		msg = lua_tolstring(L,1,&sz);
+	} else {
+		msg = lua_touserdata(L,1);
+		sz = (size_t)luaL_checkinteger(L,2);
+		if (msg == NULL && sz > 0) {
+			return luaL_error(L, "Invalid message");
+		}
+	}
+	if (sz > INT_MAX) {
+		return luaL_error(L, "sharebuffer is too large");
+	}
+	void * buffer = skynet_malloc(sz);
+	memcpy(buffer, msg, sz);
+	lsharebuffer_push(L, sharebuffer_new(buffer, (int)sz));
+	return 1;
+}
+
 static int
 lharbor(lua_State *L) {
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
@@ -399,20 +600,6 @@ lharbor(lua_State *L) {
 	return 2;
 }
 
-/**
- * packstring 调用了 luaseri_pack
- * 但它只有一个返回值：将 lightuserdata 作为 string 返回
-*/
-static int
-lpackstring(lua_State *L) {
-	luaseri_pack(L);
-	char * str = (char *)lua_touserdata(L, -2);			// 这个 userdata 是序列化之后的结果，强制转换成 char* 的话其实是不可读的
-	int sz = lua_tointeger(L, -1);
-	lua_pushlstring(L, str, sz);
-	skynet_free(str);	// luaseri_pack push了2个值在栈里，这里不要pop么？？？函数返回时，会根据栈帧清栈，而不是返回值数量，这个大可放心好了。
-	return 1;
-}
-
 static int
 ltrash(lua_State *L) {
 	int t = lua_type(L,1);
@@ -422,8 +609,9 @@ ltrash(lua_State *L) {
 	}
 	case LUA_TLIGHTUSERDATA: {
 		void * msg = lua_touserdata(L,1);
-		luaL_checkinteger(L,2);
-		skynet_free(msg);
+		size_t sz = luaL_checkinteger(L,2);
+		luaseri_detach(msg, sz);
+		drop_message(msg, sz);
 		break;
 	}
 	default:
@@ -519,6 +707,7 @@ luaopen_skynet_core(lua_State *L) {
 
 	luaL_Reg l[] = {
 		{ "send" , lsend },
+		{ "sendbatch" , lsendbatch },
 		{ "genid", lgenid },
 		{ "redirect", lredirect },
 		{ "command" , lcommand },
@@ -536,7 +725,13 @@ luaopen_skynet_core(lua_State *L) {
 		{ "tostring", ltostring },
 		{ "pack", luaseri_pack },
 		{ "unpack", luaseri_unpack },
-		{ "packstring", lpackstring },
+		{ "packcompact", luaseri_packcompact },	// 更紧凑的格式，只有新版本能解包
+		{ "packremote", luaseri_packremote },	// 发给其它节点的消息，不允许 sharebuffer
+		{ "packstring", luaseri_packstring },	// 直接打包成 string，不经过 lightuserdata
+		{ "packbuffer", luaseri_packbuffer },
+		{ "unpackview", luaseri_unpackview },	// 按需解包，table 在第一次访问时才解开
+		{ "viewmessage", luaseri_viewmessage },
+		{ "tobuffer", ltobuffer },
 		{ "trash" , ltrash },
 		{ "now", lnow },
 		{ "hpc", lhpc },	// getHPCounter
@@ -552,8 +747,12 @@ luaopen_skynet_core(lua_State *L) {
 	if (ctx == NULL) {
 		return luaL_error(L, "Init skynet context first");
 	}
+	pthread_once(&DROP_HOOK_ONCE, drop_hook_init);
+
+	// upvalue 2: .name 别名的缓存，见 query_localname
+	lua_newtable(L);
 
-	luaL_setfuncs(L,l,1);
+	luaL_setfuncs(L,l,2);
 	luaL_setfuncs(L,l2,0);
 
 	return 1;
@@ -12,9 +12,16 @@
 #include <lauxlib.h>
 
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "skynet_socket.h"
+#include "sharebuffer.h"
+#include "lua-sharebuffer.h"
 
 #define BACKLOG 32
 // 2 ** 12 == 4096
@@ -289,6 +296,84 @@ lreadall(lua_State *L) {
 	return 1;
 }
 
+/**
+ * 从 socket_buffer 取出 sz 字节做成 sharebuffer 压栈，调用者保证 0 < sz <= sb->size
+ * 头节点正好是要取的内容时直接接管节点的内存，否则拷贝到一块新内存里
+*/
+static void
+pop_sharebuffer(lua_State *L, struct socket_buffer *sb, int sz) {
+	struct buffer_node * current = sb->head;
+	char * msg;
+	if (sb->offset == 0 && current->sz == sz) {
+		msg = current->msg;
+		current->msg = NULL;
+		return_free_node(L,2,sb);
+	} else {
+		msg = skynet_malloc(sz);
+		int ptr = 0;
+		while (ptr < sz) {
+			current = sb->head;
+			int bytes = current->sz - sb->offset;
+			if (bytes > sz - ptr) {
+				memcpy(msg + ptr, current->msg + sb->offset, sz - ptr);
+				sb->offset += sz - ptr;
+				break;
+			}
+			memcpy(msg + ptr, current->msg + sb->offset, bytes);
+			ptr += bytes;
+			return_free_node(L,2,sb);
+		}
+	}
+	sb->size -= sz;
+	lsharebuffer_push(L, sharebuffer_new(msg, sz));
+}
+
+/*
+	userdata send_buffer
+	table pool
+	integer sz
+
+	和 pop 一样，只是返回 sharebuffer
+ */
+static int
+lpopsharebuffer(lua_State *L) {
+	struct socket_buffer * sb = lua_touserdata(L, 1);
+	if (sb == NULL) {
+		return luaL_error(L, "Need buffer object at param 1");
+	}
+	luaL_checktype(L,2,LUA_TTABLE);
+	int sz = luaL_checkinteger(L,3);
+	if (sb->size < sz || sz == 0) {
+		lua_pushnil(L);
+	} else {
+		pop_sharebuffer(L,sb,sz);
+	}
+	lua_pushinteger(L, sb->size);
+
+	return 2;
+}
+
+/*
+	userdata send_buffer
+	table pool
+
+	取出全部内容做成 sharebuffer，没有内容时返回 nil
+ */
+static int
+lreadallsharebuffer(lua_State *L) {
+	struct socket_buffer * sb = lua_touserdata(L, 1);
+	if (sb == NULL) {
+		return luaL_error(L, "Need buffer object at param 1");
+	}
+	luaL_checktype(L,2,LUA_TTABLE);
+	if (sb->size == 0) {
+		lua_pushnil(L);
+	} else {
+		pop_sharebuffer(L,sb,sb->size);
+	}
+	return 1;
+}
+
 static int
 ldrop(lua_State *L) {
 	void * msg = lua_touserdata(L,1);
@@ -403,6 +488,40 @@ lunpack(lua_State *L) {
 	return 4;
 }
 
+/*
+	lightuserdata buffer, integer size
+	return table { data1, address1, data2, address2, ... }
+	buffer is a SKYNET_SOCKET_TYPE_UDPBATCH message, caller should free it.
+ */
+static int
+lunpackudp(lua_State *L) {
+	const uint8_t * ptr = lua_touserdata(L,1);
+	int size = luaL_checkinteger(L,2);
+	if (ptr == NULL) {
+		return luaL_error(L, "Need udp batch buffer");
+	}
+	const uint8_t * end = ptr + size;
+	lua_newtable(L);
+	int n = 0;
+	while (ptr < end) {
+		int len;
+		memcpy(&len, ptr, sizeof(len));
+		ptr += sizeof(len);
+		int addrsz = *ptr++;
+		const uint8_t * addr = ptr;
+		ptr += addrsz;
+		if (len < 0 || ptr + len > end) {
+			return luaL_error(L, "Invalid udp batch");
+		}
+		lua_pushlstring(L, (const char *)ptr, len);
+		lua_rawseti(L, -2, ++n);
+		lua_pushlstring(L, (const char *)addr, addrsz);
+		lua_rawseti(L, -2, ++n);
+		ptr += len;
+	}
+	return 1;
+}
+
 static const char *
 address_port(lua_State *L, char *tmp, const char * addr, int port_index, int *port) {
 	const char * host;
@@ -532,7 +651,16 @@ get_buffer(lua_State *L, int index, int *sz) {
 	switch(lua_type(L, index)) {
 		const char * str;
 		size_t len;
-	case LUA_TUSERDATA:
+	case LUA_TUSERDATA: {
+		struct sharebuffer * sb = lsharebuffer_test(L, index);
+		if (sb) {
+			// 不复制内容，交给 socket 线程一个引用，发完后释放
+			sharebuffer_grab(sb);
+			*sz = -1;
+			return sb;
+		}
+	}
+	// fall through
 	case LUA_TLIGHTUSERDATA:
 		buffer = lua_touserdata(L,index);
 		*sz = luaL_checkinteger(L,index+1);
@@ -554,10 +682,43 @@ get_buffer(lua_State *L, int index, int *sz) {
 	return buffer;
 }
 
+#define MAX_SENDV 64
+
+/**
+ * 字符串表不超过 MAX_SENDV 项时不拼接，交给 skynet_socket_sendv 直接 writev
+ * 发送期间字符串都留在栈上；项数太多时返回 0，由调用者照旧拼接
+*/
+static int
+sendv(lua_State *L, struct skynet_context *ctx, int id, int index) {
+	struct socket_iovec v[MAX_SENDV];
+	int top = lua_gettop(L);
+	luaL_checkstack(L, MAX_SENDV + 1, NULL);
+	int n;
+	for (n=0;lua_geti(L, index, n+1) != LUA_TNIL; ++n) {
+		if (n >= MAX_SENDV) {
+			lua_settop(L, top);
+			return 0;
+		}
+		size_t len;
+		v[n].buffer = luaL_checklstring(L, -1, &len);
+		if (len > INT_MAX) {
+			return luaL_error(L, "Invalid strings table");
+		}
+		v[n].sz = (int)len;
+	}
+	int err = skynet_socket_sendv(ctx, id, v, n);
+	lua_settop(L, top);
+	lua_pushboolean(L, !err);
+	return 1;
+}
+
 static int
 lsend(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
 	int id = luaL_checkinteger(L, 1);
+	if (lua_type(L, 2) == LUA_TTABLE && sendv(L, ctx, id, 2)) {
+		return 1;
+	}
 	int sz = 0;
 	void *buffer = get_buffer(L, 2, &sz);
 	int err = skynet_socket_send(ctx, id, buffer, sz);
@@ -576,6 +737,57 @@ lsendlow(lua_State *L) {
 	return 1;
 }
 
+/**
+ * sendfile(id, file [, offset, len])
+ * file 可以是文件名或者 io.open 得到的文件句柄（dup 一份交给 socket 线程，原句柄照常可用）
+ * len 默认发到文件末尾；文件内容由 socket 线程用 sendfile 直接发出，不经过 lua 内存
+*/
+static int
+lsendfile(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, offset >= 0, 3, "invalid offset");
+	int fd;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		const char * filename = lua_tostring(L, 2);
+		fd = open(filename, O_RDONLY);
+	} else {
+		luaL_Stream *p = (luaL_Stream *)luaL_checkudata(L, 2, LUA_FILEHANDLE);
+		if (p->closef == NULL) {
+			return luaL_argerror(L, 2, "attempt to use a closed file");
+		}
+		fflush(p->f);
+		fd = dup(fileno(p->f));
+	}
+	if (fd < 0) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_Integer len;
+	if (lua_isnoneornil(L, 4)) {
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			int err = errno;
+			close(fd);
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, strerror(err));
+			return 2;
+		}
+		len = st.st_size > offset ? st.st_size - offset : 0;
+	} else {
+		len = luaL_checkinteger(L, 4);
+		if (len < 0) {
+			close(fd);
+			return luaL_argerror(L, 4, "invalid len");
+		}
+	}
+	int err = skynet_socket_sendfile(ctx, id, fd, offset, len);
+	lua_pushboolean(L, !err);
+	return 1;
+}
+
 static int
 lbind(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -601,6 +813,27 @@ lnodelay(lua_State *L) {
 	return 0;
 }
 
+/**
+ * watermark(id, high, low, limit, policy)
+ * 写缓冲超过 high 时收到 SOCKET_WARNING（积压的 K 字节数），之后降到 low 以下时再收到一次 0
+ * limit 为写缓冲的硬上限，超过时按 policy 处理："drop" 丢弃低优先级数据，"close" 关闭连接
+*/
+static int
+lwatermark(lua_State *L) {
+	static const char * const policy[] = { "drop", "close", NULL };
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	lua_Integer high = luaL_optinteger(L, 2, 0);
+	lua_Integer low = luaL_optinteger(L, 3, 0);
+	lua_Integer limit = luaL_optinteger(L, 4, 0);
+	int p = luaL_checkoption(L, 5, "drop", policy);
+	luaL_argcheck(L, high >= 0, 2, "invalid high watermark");
+	luaL_argcheck(L, low >= 0 && (high == 0 || low < high), 3, "invalid low watermark");
+	luaL_argcheck(L, limit >= 0, 4, "invalid limit");
+	skynet_socket_watermark(ctx, id, high, low, limit, p == 0 ? SOCKET_LIMIT_DROP : SOCKET_LIMIT_CLOSE);
+	return 0;
+}
+
 static int
 ludp(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -621,6 +854,19 @@ ludp(lua_State *L) {
 	return 1;
 }
 
+/**
+ * udpbatch(id [, enable])
+ * 打开后多个同时到达的包合并成一条 SKYNET_SOCKET_TYPE_UDPBATCH，用 unpackudp 拆开
+*/
+static int
+ludpbatch(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	int enable = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
+	skynet_socket_udpbatch(ctx, id, enable);
+	return 0;
+}
+
 static int
 ludp_connect(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -722,6 +968,13 @@ getinfo(lua_State *L, struct socket_info *si) {
 	lua_setfield(L, -2, "write");
 	lua_pushinteger(L, si->wbuffer);
 	lua_setfield(L, -2, "wbuffer");
+	if (si->rbuffer) {
+		// 读缓冲复用率 = rreuse / rbuffer
+		lua_pushinteger(L, si->rbuffer);
+		lua_setfield(L, -2, "rbuffer");
+		lua_pushinteger(L, si->rreuse);
+		lua_setfield(L, -2, "rreuse");
+	}
 	lua_pushinteger(L, si->rtime);
 	lua_setfield(L, -2, "rtime");
 	lua_pushinteger(L, si->wtime);
@@ -756,6 +1009,8 @@ luaopen_skynet_socketdriver(lua_State *L) {
 		{ "pop", lpopbuffer },
 		{ "drop", ldrop },
 		{ "readall", lreadall },
+		{ "popbuffer", lpopsharebuffer },
+		{ "readallbuffer", lreadallsharebuffer },
 		{ "clear", lclearbuffer },
 		{ "readline", lreadline },
 		{ "str2p", lstr2p },
@@ -763,6 +1018,7 @@ luaopen_skynet_socketdriver(lua_State *L) {
 		{ "info", linfo },
 
 		{ "unpack", lunpack },
+		{ "unpackudp", lunpackudp },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
@@ -773,11 +1029,14 @@ luaopen_skynet_socketdriver(lua_State *L) {
 		{ "listen", llisten },
 		{ "send", lsend },
 		{ "lsend", lsendlow },
+		{ "sendfile", lsendfile },
 		{ "bind", lbind },
 		{ "start", lstart },
 		{ "nodelay", lnodelay },
+		{ "watermark", lwatermark },
 		{ "udp", ludp },
 		{ "udp_connect", ludp_connect },
+		{ "udpbatch", ludpbatch },
 		{ "udp_send", ludp_send },
 		{ "udp_address", ludp_address },
 		{ NULL, NULL },
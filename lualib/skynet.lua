@@ -54,6 +54,8 @@ function skynet.register_protocol(class)
 end
 
 local session_id_coroutine = {}
+local session_count = 0		-- session_id_coroutine 里的项数
+local session_peak = 0		-- session_count 的峰值
 local session_coroutine_id = {}
 local session_coroutine_address = {}
 local session_coroutine_tracetag = {}
@@ -64,11 +66,28 @@ local sleep_session = {}
 
 local watching_session = {}
 local error_queue = {}
-local fork_queue = {}
+local fork_queue = { h = 1, t = 0 }	-- h 是队头，t 是队尾，避免从数组头部删除时移动整个队列
 
 -- suspend is function
 local suspend
 
+-- 等待中的 session，同时维护数量和峰值，skynet.task() 不需要遍历
+local function session_add(session, co)
+	session_id_coroutine[session] = co
+	local n = session_count + 1
+	session_count = n
+	if n > session_peak then
+		session_peak = n
+	end
+end
+
+local function session_remove(session)
+	if session_id_coroutine[session] ~= nil then
+		session_id_coroutine[session] = nil
+		session_count = session_count - 1
+	end
+end
+
 
 ----- monitor exit
 
@@ -76,7 +95,7 @@ local function dispatch_error_queue()
 	local session = tremove(error_queue,1)
 	if session then
 		local co = session_id_coroutine[session]
-		session_id_coroutine[session] = nil
+		session_remove(session)
 		return suspend(co, coroutine_resume(co, false))
 	end
 end
@@ -105,11 +124,36 @@ end
 
 -- coroutine reuse
 
-local coroutine_pool = setmetatable({}, { __mode = "kv" })
+-- 空闲的协程：coroutine_floor 个以内强引用保留，不会被 gc 清空；超出的部分放在弱表里，gc 时回收
+-- 弱表被 gc 清掉的位置留下空洞，取出时跳过
+local coroutine_pool = {}
+local coroutine_spare = setmetatable({}, { __mode = "v" })
+local coroutine_spare_n = 0
+local coroutine_floor = tonumber((c.command("GETENV", "coroutine_floor"))) or 32
+local coroutine_new = 0		-- 新建协程的次数
+local coroutine_reuse = 0	-- 复用协程的次数
+
+local function co_recycle(co)
+	local n = #coroutine_pool
+	if n < coroutine_floor then
+		coroutine_pool[n+1] = co
+	else
+		n = coroutine_spare_n + 1
+		coroutine_spare_n = n
+		coroutine_spare[n] = co
+	end
+end
 
 local function co_create(f)
 	local co = tremove(coroutine_pool)		-- 尾删除
+	while co == nil and coroutine_spare_n > 0 do
+		local n = coroutine_spare_n
+		co = coroutine_spare[n]
+		coroutine_spare[n] = nil
+		coroutine_spare_n = n - 1
+	end
 	if co == nil then
+		coroutine_new = coroutine_new + 1
 		co = coroutine_create(function(...)
 			f(...)		-- dispatch函数是个upvalue
 			-- f执行完，这个协程的使命就结束了
@@ -138,7 +182,7 @@ local function co_create(f)
 
 				-- recycle co into pool
 				f = nil		-- 清空upvalue的f函数
-				coroutine_pool[#coroutine_pool+1] = co
+				co_recycle(co)
 				-- recv new main function f
 				f = coroutine_yield "SUSPEND"
 
@@ -151,6 +195,7 @@ local function co_create(f)
 			end
 		end)
 	else
+		coroutine_reuse = coroutine_reuse + 1
 		-- pass the main function f to coroutine, and restore running thread
 		local running = running_thread
 		coroutine_resume(co, f)
@@ -159,6 +204,15 @@ local function co_create(f)
 	return co
 end
 
+-- 取消定时器。没取消成功的话 RESPONSE 消息可能已经在路上了，标记为 BREAK 收到后丢弃
+local function cancel_timeout(session)
+	if c.intcommand("CANCELTIMEOUT", session) then
+		session_remove(session)
+	else
+		session_id_coroutine[session] = "BREAK"
+	end
+end
+
 local function dispatch_wakeup()
 	local token = tremove(wakeup_queue,1)
 	if token then
@@ -167,7 +221,7 @@ local function dispatch_wakeup()
 			local co = session_id_coroutine[session]
 			local tag = session_coroutine_tracetag[co]
 			if tag then c.trace(tag, "resume") end
-			session_id_coroutine[session] = "BREAK"
+			cancel_timeout(session)
 			return suspend(co, coroutine_resume(co, false, "BREAK"))
 		end
 	end
@@ -213,10 +267,28 @@ end
 local co_create_for_timeout
 local timeout_traceback
 
+-- 定时器协程 -> 回调函数。到期时以 true 唤醒协程执行回调；取消时以 false 唤醒，协程不执行回调直接回到协程池
+local timeout_func = {}
+
+local function timeout_main(fire)
+	local co = coroutine.running()
+	local func = timeout_func[co]
+	timeout_func[co] = nil
+	if fire then
+		func()
+	end
+end
+
+local function timeout_coroutine(func)
+	local co = co_create(timeout_main)
+	timeout_func[co] = func
+	return co
+end
+
 function skynet.trace_timeout(on)
 	local function trace_coroutine(func, ti)
 		local co
-		co = co_create(function()
+		co = timeout_coroutine(function()
 			timeout_traceback[co] = nil
 			func()
 		end)
@@ -229,33 +301,60 @@ function skynet.trace_timeout(on)
 		co_create_for_timeout = trace_coroutine
 	else
 		timeout_traceback = nil
-		co_create_for_timeout = co_create
+		co_create_for_timeout = timeout_coroutine
 	end
 end
 
 skynet.trace_timeout(false)	-- turn off by default
 
-function skynet.timeout(ti, func)
-	local session = c.intcommand("TIMEOUT",ti)
+local function timeout(session, ti, func)
 	assert(session)
 	local co = co_create_for_timeout(func, ti)
 	assert(session_id_coroutine[session] == nil)
-	session_id_coroutine[session] = co
-	return co	-- for debug
+	session_add(session, co)
+	return co, session	-- co for debug, session for skynet.cancel_timeout
+end
+
+function skynet.timeout(ti, func)
+	return timeout(c.intcommand("TIMEOUT",ti), ti, func)
+end
+
+-- 毫秒为单位，精度取决于配置项 timer_resolution
+function skynet.mtimeout(ms, func)
+	return timeout(c.intcommand("MTIMEOUT",ms), ms, func)
 end
 
 local function suspend_sleep(session, token)
 	local tag = session_coroutine_tracetag[running_thread]
 	if tag then c.trace(tag, "sleep", 2) end
-	session_id_coroutine[session] = running_thread
+	session_add(session, running_thread)
 	assert(sleep_session[token] == nil, "token duplicative")
 	sleep_session[token] = session
 
 	return coroutine_yield "SUSPEND"
 end
 
-function skynet.sleep(ti, token)
-	local session = c.intcommand("TIMEOUT",ti)
+-- session 是 skynet.timeout 的第二个返回值
+-- 定时器还没到期则取消并返回 true；已经到期的话回调函数仍会执行，返回 false
+function skynet.cancel_timeout(session)
+	if c.intcommand("CANCELTIMEOUT", session) then
+		local co = session_id_coroutine[session]
+		session_remove(session)
+		if timeout_traceback then
+			timeout_traceback[co] = nil
+		end
+		if timeout_func[co] then
+			-- 协程还没有执行回调，唤醒它直接结束，回到协程池
+			local running = running_thread
+			coroutine_resume(co, false)
+			running_thread = running
+		end
+		return true
+	end
+	return false
+end
+
+local function sleep(session, token)
 	assert(session)
 	token = token or coroutine.running()
 	local succ, ret = suspend_sleep(session, token)
@@ -270,6 +369,15 @@ function skynet.sleep(ti, token)
 	end
 end
 
+function skynet.sleep(ti, token)
+	return sleep(c.intcommand("TIMEOUT",ti), token)
+end
+
+-- 毫秒为单位，精度取决于配置项 timer_resolution
+function skynet.msleep(ms, token)
+	return sleep(c.intcommand("MTIMEOUT",ms), token)
+end
+
 function skynet.yield()
 	return skynet.sleep(0)
 end
@@ -279,7 +387,7 @@ function skynet.wait(token)
 	token = token or coroutine.running()
 	local ret, msg = suspend_sleep(session, token)
 	sleep_session[token] = nil
-	session_id_coroutine[session] = nil
+	session_remove(session)
 end
 
 function skynet.self()
@@ -333,7 +441,7 @@ function skynet.timestamp()
 end
 
 function skynet.exit()
-	fork_queue = {}	-- no fork coroutine can be execute after skynet.exit
+	fork_queue = { h = 1, t = 0 }	-- no fork coroutine can be execute after skynet.exit
 	skynet.send(".launcher","lua","REMOVE",skynet.self(), false)
 	-- report the sources that call me
 	for co, session in pairs(session_coroutine_id) do
@@ -383,6 +491,13 @@ end
 	碰到 lua服务 向 C服务 发消息的情况，C服务的callback函数需要考虑反序列化显得很多余
 	所以这种情况建议用 skynet.rawsend
 ]]
+-- 向一组服务发送同一个消息：只打包一次，本地的接收者共享同一份消息数据
+-- 返回成功发出的消息数量
+function skynet.sendbatch(addrs, typename, ...)
+	local p = proto[typename]
+	return c.sendbatch(addrs, p.id, 0, p.pack(...))
+end
+
 function skynet.rawsend(addr, typename, msg, sz)
 	local p = proto[typename]
 	return c.send(addr, p.id, 0, msg, sz)
@@ -395,14 +510,35 @@ skynet.redirect = function(dest,source,typename,...)
 end
 
 skynet.pack = assert(c.pack)
+-- packcompact 和 pack 一样返回 msg, sz，重复的 key 和纯数字数组打包得更小更快，但老版本的 unpack 不认识，
+-- 只在接收方都是新版本时使用（比如本进程内的服务之间），cluster 滚动升级期间和持久化的数据不要用
+skynet.packcompact = assert(c.packcompact)
+-- packremote 和 pack 相同，但不允许 sharebuffer，用于发给其它节点的消息（见 skynet.cluster）
+skynet.packremote = assert(c.packremote)
 skynet.packstring = assert(c.packstring)
 skynet.unpack = assert(c.unpack)
 skynet.tostring = assert(c.tostring)
 skynet.trash = assert(c.trash)
 
+-- sharebuffer：引用计数的只读缓冲，在本进程的服务之间、服务与 socket 之间传递不复制内容
+-- packbuffer(...) 打包一次，可以发给多个服务、socket.write 到多个连接，接收方 skynet.unpack(buf) 直接在上面解包
+-- tobuffer(str) / tobuffer(msg, sz) 复制一份内容做成 sharebuffer，skynet.tostring(buf) 复制回字符串
+-- 作为 skynet.pack 的参数时消息只带指针和一个引用，由接收方 unpack 时接管，所以这样的消息只能 unpack 一次，
+-- 消息没有被 unpack（比如目标服务已经退出）引用就不会释放；也不能发给其它节点
+-- 接收方只在 dispatch 这个消息期间 unpack(msg, sz) 才认其中的 sharebuffer，字符串和其它 msg,sz 里出现会报错
+skynet.packbuffer = assert(c.packbuffer)
+skynet.tobuffer = assert(c.tobuffer)
+
+-- unpackview 和 unpack 参数相同，解出的 table 是视图：第一次访问时才解开这一层，没访问到的子 table 不占 lua 内存
+-- 只读几个字段就转发的服务用 skynet.unpacker("lua", skynet.unpackview) 让 dispatch 收到视图，
+-- 再用 skynet.rawsend(addr, "lua", skynet.viewmessage(view)) 把整个原消息转发出去，不需要重新打包
+-- 注意 unpacker 对同类型 call 的回应同样生效
+skynet.unpackview = assert(c.unpackview)
+skynet.viewmessage = assert(c.viewmessage)
+
 local function yield_call(service, session)
 	watching_session[session] = service
-	session_id_coroutine[session] = running_thread
+	session_add(session, running_thread)
 	local succ, msg, sz = coroutine_yield "SUSPEND"
 	watching_session[session] = nil
 	if not succ then
@@ -559,6 +695,14 @@ function skynet.dispatch(typename, func)
 	end
 end
 
+-- 替换消息类型的 unpack，返回原来的
+function skynet.unpacker(typename, unpack)
+	local p = proto[typename]
+	local ret = p.unpack
+	p.unpack = unpack
+	return ret
+end
+
 local function unknown_request(session, address, msg, sz, prototype)
 	skynet.error(string.format("Unknown request (%s): %s", prototype, c.tostring(msg,sz)))
 	error(string.format("Unknown session : %d from %x", session, address))
@@ -590,7 +734,9 @@ function skynet.fork(func,...)
 		local args = { ... }
 		co = co_create(function() func(table.unpack(args,1,n)) end)
 	end
-	tinsert(fork_queue, co)
+	local t = fork_queue.t + 1
+	fork_queue.t = t
+	fork_queue[t] = co
 	return co
 end
 
@@ -601,13 +747,13 @@ local function raw_dispatch_message(prototype, msg, sz, session, source)
 	if prototype == 1 then
 		local co = session_id_coroutine[session]
 		if co == "BREAK" then
-			session_id_coroutine[session] = nil
+			session_remove(session)
 		elseif co == nil then
 			unknown_response(session, source, msg, sz)
 		else
 			local tag = session_coroutine_tracetag[co]
 			if tag then c.trace(tag, "resume") end
-			session_id_coroutine[session] = nil
+			session_remove(session)
 			suspend(co, coroutine_resume(co, true, msg, sz))
 		end
 	else
@@ -666,10 +812,15 @@ end
 function skynet.dispatch_message(...)
 	local succ, err = pcall(raw_dispatch_message,...)
 	while true do
-		local co = tremove(fork_queue,1)
+		local h = fork_queue.h
+		local co = fork_queue[h]
 		if co == nil then
+			fork_queue.h = 1
+			fork_queue.t = 0
 			break
 		end
+		fork_queue[h] = nil
+		fork_queue.h = h + 1
 		local fork_succ, fork_err = pcall(suspend,co,coroutine_resume(co))
 		if not fork_succ then
 			if succ then
@@ -843,17 +994,45 @@ function skynet.mqlen()
 	return c.intcommand("STAT", "mqlen")
 end
 
+-- lua 层的统计，其余的交给 C 层的 STAT 命令
+local lua_stat = {
+	cocreate = function() return coroutine_new end,	-- 新建协程的次数
+	coreuse = function() return coroutine_reuse end,	-- 复用协程的次数
+	copool = function() return #coroutine_pool end,	-- 强引用保留的空闲协程数
+	sessionpeak = function() return session_peak end,	-- 同时等待的 session 峰值
+}
+
 function skynet.stat(what)
+	local f = lua_stat[what]
+	if f then
+		return f()
+	end
 	return c.intcommand("STAT", what)
 end
 
+-- 空闲协程池强引用保留的数量，默认取配置项 coroutine_floor，没有配置时为 32
+-- 不传参数时返回当前值
+function skynet.coroutine_floor(n)
+	if n then
+		local prev = coroutine_floor
+		coroutine_floor = n
+		return prev
+	end
+	return coroutine_floor
+end
+
+-- 每轮调度处理的消息数量：n>0 最多n个，0 处理整个队列，-1 使用工作线程的权重
+-- 不传参数时返回当前值
+function skynet.quantum(n)
+	if n then
+		return c.intcommand("QUANTUM", n)
+	end
+	return c.intcommand("QUANTUM")
+end
+
 function skynet.task(ret)
 	if ret == nil then
-		local t = 0
-		for session,co in pairs(session_id_coroutine) do
-			t = t + 1
-		end
-		return t
+		return session_count
 	end
 	if ret == "init" then
 		if init_thread then
@@ -18,7 +18,7 @@ local function request_sender(q, node)
 	for _, task in ipairs(q) do
 		if type(task) == "table" then
 			if c then
-				skynet.send(c, "lua", "push", task[1], skynet.pack(table.unpack(task,2,task.n)))
+				skynet.send(c, "lua", "push", task[1], skynet.packremote(table.unpack(task,2,task.n)))
 			end
 		else
 			skynet.wakeup(task)
@@ -52,8 +52,8 @@ local function get_sender(node)
 end
 
 function cluster.call(node, address, ...)
-	-- skynet.pack(...) will free by cluster.core.packrequest
-	return skynet.call(get_sender(node), "lua", "req",  address, skynet.pack(...))
+	-- skynet.packremote(...) will free by cluster.core.packrequest
+	return skynet.call(get_sender(node), "lua", "req",  address, skynet.packremote(...))
 end
 
 function cluster.send(node, address, ...)
@@ -62,7 +62,7 @@ function cluster.send(node, address, ...)
 	if not s then
 		table.insert(task_queue[node], table.pack(address, ...))
 	else
-		skynet.send(sender[node], "lua", "push", address, skynet.pack(...))
+		skynet.send(sender[node], "lua", "push", address, skynet.packremote(...))
 	end
 end
 
@@ -98,7 +98,7 @@ function cluster.register(name, addr)
 end
 
 function cluster.query(node, name)
-	return skynet.call(get_sender(node), "lua", "req", 0, skynet.pack(name))
+	return skynet.call(get_sender(node), "lua", "req", 0, skynet.packremote(name))
 end
 
 skynet.init(function()
@@ -30,6 +30,12 @@ local function init(skynet, export)
 			stat.mqlen = skynet.stat "mqlen"
 			stat.cpu = skynet.stat "cpu"
 			stat.message = skynet.stat "message"
+			stat.round = skynet.stat "round"
+			stat.batch = skynet.stat "batch"
+			stat.cocreate = skynet.stat "cocreate"
+			stat.coreuse = skynet.stat "coreuse"
+			stat.copool = skynet.stat "copool"
+			stat.sessionpeak = skynet.stat "sessionpeak"
 			skynet.ret(skynet.pack(stat))
 		end
 
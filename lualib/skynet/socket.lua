@@ -136,6 +136,22 @@ socket_message[6] = function(id, size, data, address)
 	s.callback(str, address)
 end
 
+-- SKYNET_SOCKET_TYPE_UDPBATCH = 8
+socket_message[8] = function(id, size, data)
+	local s = socket_pool[id]
+	if s == nil or s.callback == nil then
+		skynet.error("socket: drop udp package from " .. id)
+		driver.drop(data, size)
+		return
+	end
+	local pkgs = driver.unpackudp(data, size)
+	skynet_core.trash(data, size)
+	local callback = s.callback
+	for i = 1, #pkgs, 2 do
+		callback(pkgs[i], pkgs[i+1])
+	end
+end
+
 local function default_warning(id, size)
 	local s = socket_pool[id]
 	if not s then
@@ -148,6 +164,7 @@ end
 socket_message[7] = function(id, size)
 	local s = socket_pool[id]
 	if s then
+		s.overload = size > 0
 		local warning = s.on_warning or default_warning
 		warning(id, size)
 	end
@@ -291,6 +308,51 @@ function socket.read(id, sz)
 	end
 end
 
+-- 和 socket.read 一样，只是读到的内容是 sharebuffer 而不是字符串
+-- 可以直接 socket.write 转发到别的连接、或作为消息参数发给别的服务，内容不再复制
+function socket.readbuffer(id, sz)
+	local s = socket_pool[id]
+	assert(s)
+	if sz == nil then
+		-- read some bytes
+		local ret = driver.readallbuffer(s.buffer, buffer_pool)
+		if ret then
+			return ret
+		end
+
+		if not s.connected then
+			return false
+		end
+		assert(not s.read_required)
+		s.read_required = 0
+		suspend(s)
+		ret = driver.readallbuffer(s.buffer, buffer_pool)
+		if ret then
+			return ret
+		else
+			return false
+		end
+	end
+
+	local ret = driver.popbuffer(s.buffer, buffer_pool, sz)
+	if ret then
+		return ret
+	end
+	if not s.connected then
+		return false, driver.readallbuffer(s.buffer, buffer_pool)
+	end
+
+	assert(not s.read_required)
+	s.read_required = sz
+	suspend(s)
+	ret = driver.popbuffer(s.buffer, buffer_pool, sz)
+	if ret then
+		return ret
+	else
+		return false, driver.readallbuffer(s.buffer, buffer_pool)
+	end
+end
+
 function socket.readall(id)
 	local s = socket_pool[id]
 	assert(s)
@@ -339,6 +401,7 @@ end
 
 socket.write = assert(driver.send)
 socket.lwrite = assert(driver.lsend)
+socket.sendfile = assert(driver.sendfile)
 socket.header = assert(driver.header)
 
 function socket.invalid(id)
@@ -415,6 +478,8 @@ local function create_udp_object(id, cb)
 		protocol = "UDP",
 		callback = cb,
 	}
+	-- 这里会把 UDPBATCH 拆开逐个回调，可以接收合并的包
+	driver.udpbatch(id)
 end
 
 function socket.udp(callback, host, port)
@@ -446,4 +511,17 @@ function socket.warning(id, callback)
 	obj.on_warning = callback
 end
 
+-- 写缓冲超过 high 字节时 warning 回调收到积压的 K 字节数，之后降到 low 以下时收到 0
+-- 网关可以据此暂停、恢复读上游的数据；high 为 nil 或 0 时用默认的 1M，low 默认 0（发空）
+-- limit 为写缓冲的硬上限（默认不限），超过时 policy 为 "drop" 丢弃 lwrite 的低优先级数据，"close" 关闭连接
+function socket.watermark(id, high, low, limit, policy)
+	driver.watermark(id, high, low, limit, policy)
+end
+
+-- 写缓冲是否在高水位之上（收到了 size > 0 的 warning，还没收到 0）
+function socket.overload(id)
+	local s = socket_pool[id]
+	return s ~= nil and s.overload == true
+end
+
 return socket
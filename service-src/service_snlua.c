@@ -86,15 +86,10 @@ optstring(struct skynet_context *ctx, const char *key, const char * str) {
 }
 
 /**
- * snlua服务的核心功能
+ * 设置lua环境，服务与服务模板都一样
 */
-static int
-init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t sz) {
-	lua_State *L = l->L;
-	l->ctx = ctx;
-
-	lua_gc(L, LUA_GCSTOP, 0);		// 停掉lua gc，后面会开
-
+static void
+init_env(lua_State *L, struct skynet_context *ctx) {
 	// 设置lua环境
 	// registry["LUA_NOENV"] = 1
 	lua_pushboolean(L, 1);  /* signal for libraries to ignore env. vars. */
@@ -124,6 +119,667 @@ init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t s
 	const char *preload = skynet_command(ctx, "GETENV", "preload");
 	lua_pushstring(L, preload);
 	lua_setglobal(L, "LUA_PRELOAD");
+}
+
+/**
+ * 服务模板（配置项 lua_template，如 "skynet skynet.socket skynet.queue"）
+ * 第一个 snlua 服务启动时，另建一个模板虚拟机加载好这些模块，然后把模块用到的对象（表、闭包，以及它们引用的对象）
+ * 编译成一串创建指令，之后模板不再改动。
+ * 之后每个 snlua 服务在运行 loader 之前执行这串指令，在自己的虚拟机里重建这些模块，
+ * 服务里的 require 直接命中 package.loaded，不用再查找文件、执行模块代码。
+ * lua 函数用 lua_clonefunction 创建，函数原型与模板共享（和代码缓存一样），upvalue 的共享关系用 lua_upvaluejoin 保持；
+ * 模块的 C 函数 upvalue 里的 skynet_context 换成新服务的。
+ * 标准库、注册表、全局表这些两边都有的对象，按所在位置对应到新服务里的对象，不重建。
+ * 执行指令只读模板，不需要加锁。
+ * 模板里的模块不能在加载时保存 userdata、协程，或者服务相关的值（比如自己的地址、skynet.init 注册的初始化函数），否则模板创建失败或者行为不对；
+ * 创建失败时打印原因，之后所有服务照常加载。
+*/
+
+#define TEMPLATE_DEPTH 128
+
+// 创建对象的指令，按顺序执行，每个对象依次放到栈上，栈的位置就是对象的编号
+#define OP_CONTAINER 0		// 新服务的 package.loaded / 注册表 / 全局表
+#define OP_FIELD 1			// 两边都有的对象：已有对象里的某个键
+#define OP_STRINGMETA 2		// 字符串的元表
+#define OP_TABLE 3
+#define OP_LCLOSURE 4
+#define OP_PUSH 5			// C 闭包的 upvalue，先压栈，不占编号
+#define OP_CCLOSURE 6
+// 填充对象的指令，对象都创建好以后执行
+#define OP_SET 7
+#define OP_SETMETA 8
+#define OP_SETUPVALUE 9
+#define OP_JOINUPVALUE 10
+#define OP_COPY 11			// 把模块复制到新服务的 package.loaded 等处，已有的键不覆盖
+
+// 值的类型，除了 lua 的基本类型以外
+#define TEMPLATE_INTEGER (LUA_NUMTAGS + 0)
+#define TEMPLATE_CONTEXT (LUA_NUMTAGS + 1)		// 模板的 skynet_context，换成新服务的
+#define TEMPLATE_CFUNCTION (LUA_NUMTAGS + 2)		// 没有 upvalue 的 C 函数
+#define TEMPLATE_OBJECT (LUA_NUMTAGS + 3)		// 之前创建的对象
+
+#define TEMPLATE_LOADED 1
+#define TEMPLATE_REGISTRY 2
+#define TEMPLATE_GLOBAL 3
+
+struct template_value {
+	int type;
+	union {
+		int boolean;
+		lua_Integer integer;
+		lua_Number number;
+		const char *str;	// 模板里的共享字符串，模板不会释放
+		void *p;
+		lua_CFunction f;
+		int object;
+	} u;
+};
+
+struct template_op {
+	int op;
+	int object;				// 操作的对象，OP_TABLE 为数组部分的大小，OP_CONTAINER 为容器的位置
+	int n;					// upvalue 序号，OP_TABLE 为哈希部分的大小，OP_CCLOSURE 为 upvalue 个数
+	int n2;					// OP_JOINUPVALUE 为另一个闭包的 upvalue 序号
+	const void *p;			// OP_LCLOSURE 为模板里的闭包，OP_CCLOSURE 为 C 函数
+	struct template_value k;
+	struct template_value v;
+};
+
+struct template_ops {
+	int n;
+	int cap;
+	struct template_op *op;
+};
+
+struct template {
+	int state;					// TEMPLATE_*
+	int slots;					// 对象个数
+	lua_State *L;				// 模板虚拟机，指令引用的函数原型和字符串都在里面，不会关闭
+	void *ctx;					// 创建模板的服务，重建时换成新服务的 skynet_context
+	struct template_ops create;
+	struct template_ops fill;
+};
+
+#define TEMPLATE_NONE 0
+#define TEMPLATE_BUILDING 1
+#define TEMPLATE_READY 2
+#define TEMPLATE_FAILED 3
+
+static struct template T;
+
+struct template_builder {
+	struct template *t;
+	lua_State *L;			// 模板虚拟机
+	int index;				// L 上的表：模板对象 -> 编号，C 闭包创建完以前为 false
+	int uvindex;			// L 上的表：upvalue id -> 第一个用到它的闭包的编号 * 256 + 序号
+	const char *name;		// 正在编译的模块，用于报错
+};
+
+static struct template_op *
+template_emit(struct template_ops *ops, int op) {
+	if (ops->n >= ops->cap) {
+		ops->cap = ops->cap ? ops->cap * 2 : 256;
+		ops->op = skynet_realloc(ops->op, ops->cap * sizeof(struct template_op));
+	}
+	struct template_op *o = &ops->op[ops->n++];
+	memset(o, 0, sizeof(*o));
+	o->op = op;
+	return o;
+}
+
+// 栈顶的对象记为下一个编号
+static int
+template_slot(struct template_builder *b) {
+	int slot = ++b->t->slots;
+	lua_pushvalue(b->L, -1);
+	lua_pushinteger(b->L, slot);
+	lua_rawset(b->L, b->index);
+	return slot;
+}
+
+static int template_object(struct template_builder *b, int *slot, int depth);
+
+// 把栈顶的值编译成 template_value，值留在栈上
+static int
+template_value(struct template_builder *b, struct template_value *v, int depth) {
+	lua_State *L = b->L;
+	int t = lua_type(L, -1);
+	v->type = t;
+	switch (t) {
+	case LUA_TNIL:
+		return 1;
+	case LUA_TBOOLEAN:
+		v->u.boolean = lua_toboolean(L, -1);
+		return 1;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, -1)) {
+			v->type = TEMPLATE_INTEGER;
+			v->u.integer = lua_tointeger(L, -1);
+		} else {
+			v->u.number = lua_tonumber(L, -1);
+		}
+		return 1;
+	case LUA_TSTRING:
+		// 标记为共享，新服务直接引用模板里的字符串
+		lua_sharestring(L, -1);
+		v->u.str = lua_tostring(L, -1);
+		return 1;
+	case LUA_TLIGHTUSERDATA:
+		v->u.p = lua_touserdata(L, -1);
+		if (v->u.p == b->t->ctx) {
+			v->type = TEMPLATE_CONTEXT;
+		}
+		return 1;
+	case LUA_TFUNCTION:
+		if (lua_iscfunction(L, -1)) {
+			if (lua_getupvalue(L, -1, 1) == NULL) {
+				v->type = TEMPLATE_CFUNCTION;
+				v->u.f = lua_tocfunction(L, -1);
+				return 1;
+			}
+			lua_pop(L, 1);
+		}
+		// fall through
+	case LUA_TTABLE:
+		v->type = TEMPLATE_OBJECT;
+		return template_object(b, &v->u.object, depth);
+	default:
+		skynet_error(b->t->ctx, "Template %s has %s", b->name, lua_typename(L, t));
+		return 0;
+	}
+}
+
+static int
+template_table(struct template_builder *b, int depth) {
+	lua_State *L = b->L;
+	struct template_ops *create = &b->t->create;
+	int slot = template_slot(b);
+	int op = create->n;
+	template_emit(create, OP_TABLE)->object = (int)lua_rawlen(L, -1);
+	int n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		struct template_op o;
+		memset(&o, 0, sizeof(o));
+		if (!template_value(b, &o.v, depth)) {
+			return 0;
+		}
+		lua_pop(L, 1);
+		if (!template_value(b, &o.k, depth)) {
+			return 0;
+		}
+		o.op = OP_SET;
+		o.object = slot;
+		*template_emit(&b->t->fill, OP_SET) = o;
+		++n;
+	}
+	n -= create->op[op].object;
+	create->op[op].n = n > 0 ? n : 0;
+	if (lua_getmetatable(L, -1)) {
+		struct template_op o;
+		memset(&o, 0, sizeof(o));
+		if (!template_value(b, &o.v, depth)) {
+			return 0;
+		}
+		lua_pop(L, 1);
+		o.op = OP_SETMETA;
+		o.object = slot;
+		*template_emit(&b->t->fill, OP_SETMETA) = o;
+	}
+	return slot;
+}
+
+static int
+template_lclosure(struct template_builder *b, int depth) {
+	lua_State *L = b->L;
+	lua_sharefunction(L, -1);
+	int slot = template_slot(b);
+	template_emit(&b->t->create, OP_LCLOSURE)->p = lua_topointer(L, -1);
+	int i;
+	for (i=1;lua_getupvalue(L, -1, i) != NULL;i++) {
+		void *id = lua_upvalueid(L, -2, i);
+		if (lua_rawgetp(L, b->uvindex, id) == LUA_TNUMBER) {
+			// 和之前的闭包共用这个 upvalue
+			int uv = (int)lua_tointeger(L, -1);
+			lua_pop(L, 2);
+			struct template_op *o = template_emit(&b->t->fill, OP_JOINUPVALUE);
+			o->object = slot;
+			o->n = i;
+			o->k.type = TEMPLATE_OBJECT;
+			o->k.u.object = uv >> 8;
+			o->n2 = uv & 0xff;
+			continue;
+		}
+		lua_pop(L, 1);
+		lua_pushinteger(L, slot << 8 | i);
+		lua_rawsetp(L, b->uvindex, id);
+		struct template_op o;
+		memset(&o, 0, sizeof(o));
+		if (!template_value(b, &o.v, depth)) {
+			return 0;
+		}
+		lua_pop(L, 1);
+		o.op = OP_SETUPVALUE;
+		o.object = slot;
+		o.n = i;
+		*template_emit(&b->t->fill, OP_SETUPVALUE) = o;
+	}
+	return slot;
+}
+
+// C 闭包创建时就要有 upvalue，所以先编译 upvalue，再创建闭包
+static int
+template_cclosure(struct template_builder *b, int depth) {
+	lua_State *L = b->L;
+	int f = lua_gettop(L);
+	lua_pushvalue(L, f);
+	lua_pushboolean(L, 0);
+	lua_rawset(L, b->index);
+	int n = 0;
+	while (lua_getupvalue(L, f, n + 1) != NULL) {
+		lua_pop(L, 1);
+		++n;
+	}
+	struct template_value *uv = lua_newuserdata(L, n * sizeof(*uv));
+	int i;
+	for (i=0;i<n;i++) {
+		lua_getupvalue(L, f, i + 1);
+		if (!template_value(b, &uv[i], depth)) {
+			return 0;
+		}
+		lua_pop(L, 1);
+	}
+	for (i=0;i<n;i++) {
+		template_emit(&b->t->create, OP_PUSH)->v = uv[i];
+	}
+	lua_pop(L, 1);
+	struct template_op *o = template_emit(&b->t->create, OP_CCLOSURE);
+	o->n = n;
+	o->p = (const void *)lua_tocfunction(L, -1);
+	return template_slot(b);
+}
+
+// 栈顶的表或者函数：已经编译过的直接取编号，否则编译它和它引用的对象
+static int
+template_object(struct template_builder *b, int *slot, int depth) {
+	lua_State *L = b->L;
+	lua_pushvalue(L, -1);
+	int t = lua_rawget(L, b->index);
+	if (t != LUA_TNIL) {
+		*slot = (int)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (t != LUA_TNUMBER) {
+			skynet_error(b->t->ctx, "Template %s has C closure loop", b->name);
+			return 0;
+		}
+		return 1;
+	}
+	lua_pop(L, 1);
+	if (depth > TEMPLATE_DEPTH) {
+		skynet_error(b->t->ctx, "Template %s is too deep", b->name);
+		return 0;
+	}
+	if (!lua_checkstack(L, 8)) {
+		skynet_error(b->t->ctx, "Template %s : stack overflow", b->name);
+		return 0;
+	}
+	if (lua_type(L, -1) == LUA_TTABLE) {
+		*slot = template_table(b, depth + 1);
+	} else if (lua_iscfunction(L, -1)) {
+		*slot = template_cclosure(b, depth + 1);
+	} else {
+		*slot = template_lclosure(b, depth + 1);
+	}
+	return *slot != 0;
+}
+
+// 把模板或者新服务的 package.loaded / 注册表 / 全局表压栈
+static void
+template_container(lua_State *L, int where) {
+	switch (where) {
+	case TEMPLATE_LOADED:
+		lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+		break;
+	case TEMPLATE_REGISTRY:
+		lua_pushvalue(L, LUA_REGISTRYINDEX);
+		break;
+	default:
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+		break;
+	}
+}
+
+// 记下栈顶表里的表和函数（两边都有的对象），只看字符串和 lightuserdata 键
+static void
+template_field(struct template_builder *b, int parent, int level) {
+	lua_State *L = b->L;
+	int t = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, t) != 0) {
+		int kt = lua_type(L, -2);
+		int vt = lua_type(L, -1);
+		if (vt == LUA_TFUNCTION && lua_iscfunction(L, -1)) {
+			// 没有 upvalue 的 C 函数不用对应
+			if (lua_getupvalue(L, -1, 1) == NULL) {
+				vt = LUA_TNIL;
+			} else {
+				lua_pop(L, 1);
+			}
+		}
+		if ((kt == LUA_TSTRING || kt == LUA_TLIGHTUSERDATA) && (vt == LUA_TTABLE || vt == LUA_TFUNCTION)) {
+			lua_pushvalue(L, -1);
+			if (lua_rawget(L, b->index) == LUA_TNIL) {
+				lua_pop(L, 1);
+				int slot = template_slot(b);
+				struct template_op *o = template_emit(&b->t->create, OP_FIELD);
+				o->object = parent;
+				lua_pushvalue(L, -2);
+				template_value(b, &o->k, 0);
+				lua_pop(L, 1);
+				if (level > 1 && vt == LUA_TTABLE) {
+					template_field(b, slot, level - 1);
+				}
+			} else {
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+}
+
+// 记下 where 里现有的键，压一个集合到栈上
+static void
+template_keys(lua_State *L, int where) {
+	template_container(L, where);
+	lua_newtable(L);
+	lua_pushnil(L);
+	while (lua_next(L, -3) != 0) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -4);
+	}
+	lua_remove(L, -2);
+}
+
+static int
+template_build(lua_State *L, struct template *t, const char *modules) {
+	// 加载模块前就有的键
+	int where;
+	for (where = TEMPLATE_LOADED; where <= TEMPLATE_GLOBAL; where++) {
+		template_keys(L, where);
+	}
+	int keys = lua_gettop(L) - TEMPLATE_GLOBAL + 1;
+
+	// 加载模块
+	lua_getglobal(L, "package");
+	lua_getglobal(L, "LUA_PATH");
+	lua_setfield(L, -2, "path");
+	lua_getglobal(L, "LUA_CPATH");
+	lua_setfield(L, -2, "cpath");
+	lua_pop(L, 1);
+	const char *p = modules;
+	for (;;) {
+		p += strspn(p, " \t,;");
+		size_t sz = strcspn(p, " \t,;");
+		if (sz == 0)
+			break;
+		lua_getglobal(L, "require");
+		lua_pushlstring(L, p, sz);
+		if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+			skynet_error(t->ctx, "Template require error : %s", lua_tostring(L, -1));
+			return 0;
+		}
+		p += sz;
+	}
+
+	struct template_builder b;
+	b.t = t;
+	b.L = L;
+	b.name = "?";
+	lua_newtable(L);
+	b.index = lua_gettop(L);
+	lua_newtable(L);
+	b.uvindex = lua_gettop(L);
+
+	// 两边都有的对象：容器，容器里的表和函数（再往下一层，比如 package.loaded、string.format），字符串的元表
+	for (where = TEMPLATE_LOADED; where <= TEMPLATE_GLOBAL; where++) {
+		template_container(L, where);
+		template_slot(&b);
+		template_emit(&t->create, OP_CONTAINER)->object = where;
+		lua_pop(L, 1);
+	}
+	for (where = TEMPLATE_LOADED; where <= TEMPLATE_GLOBAL; where++) {
+		template_container(L, where);
+		// 只看加载模块前就有的键
+		lua_newtable(L);
+		lua_pushnil(L);
+		while (lua_next(L, keys + where - 1) != 0) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, -5);
+			lua_rawset(L, -4);
+		}
+		template_field(&b, where, 2);
+		lua_pop(L, 2);
+	}
+	lua_pushstring(L, "");
+	if (lua_getmetatable(L, -1)) {
+		lua_pushvalue(L, -1);
+		if (lua_rawget(L, b.index) == LUA_TNIL) {
+			lua_pop(L, 1);
+			template_slot(&b);
+			template_emit(&t->create, OP_STRINGMETA);
+		} else {
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	// 加载模块后新增的键，以及它们引用的对象
+	for (where = TEMPLATE_LOADED; where <= TEMPLATE_GLOBAL; where++) {
+		template_container(L, where);
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			int kt = lua_type(L, -2);
+			if (kt != LUA_TSTRING && kt != LUA_TLIGHTUSERDATA) {
+				lua_pop(L, 1);
+				continue;
+			}
+			lua_pushvalue(L, -2);
+			if (lua_rawget(L, keys + where - 1) != LUA_TNIL) {
+				lua_pop(L, 2);
+				continue;
+			}
+			lua_pop(L, 1);
+			b.name = kt == LUA_TSTRING ? lua_tostring(L, -2) : "?";
+			struct template_op o;
+			memset(&o, 0, sizeof(o));
+			if (!template_value(&b, &o.v, 0)) {
+				return 0;
+			}
+			lua_pop(L, 1);
+			template_value(&b, &o.k, 0);
+			o.op = OP_COPY;
+			o.object = where;
+			*template_emit(&t->fill, OP_COPY) = o;
+		}
+		lua_pop(L, 1);
+	}
+	lua_settop(L, keys - 1);
+	lua_gc(L, LUA_GCCOLLECT, 0);	// 编译用的临时表不再需要，模块都还在 package.loaded 里
+	return 1;
+}
+
+static void
+template_push(lua_State *L, const struct template_value *v, void *ctx) {
+	switch (v->type) {
+	case LUA_TBOOLEAN:
+		lua_pushboolean(L, v->u.boolean);
+		break;
+	case LUA_TNUMBER:
+		lua_pushnumber(L, v->u.number);
+		break;
+	case TEMPLATE_INTEGER:
+		lua_pushinteger(L, v->u.integer);
+		break;
+	case LUA_TSTRING:
+		lua_clonestring(L, v->u.str);
+		break;
+	case LUA_TLIGHTUSERDATA:
+		lua_pushlightuserdata(L, v->u.p);
+		break;
+	case TEMPLATE_CONTEXT:
+		lua_pushlightuserdata(L, ctx);
+		break;
+	case TEMPLATE_CFUNCTION:
+		lua_pushcfunction(L, v->u.f);
+		break;
+	case TEMPLATE_OBJECT:
+		lua_pushvalue(L, v->u.object);
+		break;
+	default:
+		lua_pushnil(L);
+		break;
+	}
+}
+
+// 执行模板的指令，参数是新服务的 skynet_context；对象 i 在栈的第 i 个位置
+static int
+lclone(lua_State *L) {
+	void *ctx = lua_touserdata(L, 1);
+	lua_settop(L, 0);
+	luaL_checkstack(L, T.slots + LUA_MINSTACK, NULL);
+	int i;
+	for (i=0;i<T.create.n;i++) {
+		const struct template_op *o = &T.create.op[i];
+		switch (o->op) {
+		case OP_CONTAINER:
+			template_container(L, o->object);
+			break;
+		case OP_FIELD:
+			template_push(L, &o->k, ctx);
+			lua_rawget(L, o->object);
+			break;
+		case OP_STRINGMETA:
+			lua_pushstring(L, "");
+			if (!lua_getmetatable(L, -1)) {
+				lua_pushnil(L);
+			}
+			lua_remove(L, -2);
+			break;
+		case OP_TABLE:
+			lua_createtable(L, o->object, o->n);
+			break;
+		case OP_LCLOSURE:
+			lua_clonefunction(L, o->p);
+			break;
+		case OP_PUSH:
+			template_push(L, &o->v, ctx);
+			break;
+		case OP_CCLOSURE:
+			lua_pushcclosure(L, (lua_CFunction)o->p, o->n);
+			break;
+		}
+	}
+	for (i=0;i<T.fill.n;i++) {
+		const struct template_op *o = &T.fill.op[i];
+		switch (o->op) {
+		case OP_SET:
+			template_push(L, &o->k, ctx);
+			template_push(L, &o->v, ctx);
+			lua_rawset(L, o->object);
+			break;
+		case OP_SETMETA:
+			template_push(L, &o->v, ctx);
+			lua_setmetatable(L, o->object);
+			break;
+		case OP_SETUPVALUE:
+			template_push(L, &o->v, ctx);
+			lua_setupvalue(L, o->object, o->n);
+			break;
+		case OP_JOINUPVALUE:
+			lua_upvaluejoin(L, o->object, o->n, o->k.u.object, o->n2);
+			break;
+		case OP_COPY:
+			template_push(L, &o->k, ctx);
+			if (lua_rawget(L, o->object) == LUA_TNIL) {
+				lua_pop(L, 1);
+				template_push(L, &o->k, ctx);
+				template_push(L, &o->v, ctx);
+				lua_rawset(L, o->object);
+			} else {
+				lua_pop(L, 1);
+			}
+			break;
+		}
+	}
+	lua_settop(L, 0);
+	return 0;
+}
+
+/**
+ * 配置了 lua_template 时从模板重建模块；模板由第一个启动的服务创建，
+ * 创建期间同时启动的服务、以及模板创建失败后，都照常加载
+*/
+static int
+template_load(lua_State *L, struct skynet_context *ctx) {
+	const char * modules = skynet_command(ctx, "GETENV", "lua_template");
+	if (modules == NULL) {
+		return LUA_OK;
+	}
+	int state = T.state;
+	if (state == TEMPLATE_NONE && __sync_bool_compare_and_swap(&T.state, TEMPLATE_NONE, TEMPLATE_BUILDING)) {
+		lua_State *tl = luaL_newstate();
+		lua_gc(tl, LUA_GCSTOP, 0);	// 模板建好后只读，不再回收
+		init_env(tl, ctx);
+		T.ctx = ctx;
+		if (template_build(tl, &T, modules)) {
+			T.L = tl;
+			__sync_synchronize();
+			T.state = TEMPLATE_READY;
+			skynet_error(ctx, "Template ready : %s (%d objects)", modules, T.slots);
+		} else {
+			lua_close(tl);
+			skynet_free(T.create.op);
+			skynet_free(T.fill.op);
+			memset(&T.create, 0, sizeof(T.create));
+			memset(&T.fill, 0, sizeof(T.fill));
+			T.state = TEMPLATE_FAILED;
+		}
+		return LUA_OK;	// 创建模板的服务自己照常加载
+	}
+	if (state != TEMPLATE_READY) {
+		return LUA_OK;
+	}
+	__sync_synchronize();
+	lua_pushcfunction(L, lclone);
+	lua_pushlightuserdata(L, ctx);
+	int r = lua_pcall(L, 1, 0, 0);
+	if (r != LUA_OK) {
+		skynet_error(ctx, "Template clone error : %s", lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	return r;
+}
+
+/**
+ * snlua服务的核心功能
+*/
+static int
+init_cb(struct snlua *l, struct skynet_context *ctx, const char * args, size_t sz) {
+	lua_State *L = l->L;
+	l->ctx = ctx;
+
+	lua_gc(L, LUA_GCSTOP, 0);		// 停掉lua gc，后面会开
+
+	init_env(L, ctx);
+	if (template_load(L, ctx) != LUA_OK) {
+		report_launcher_error(ctx);
+		return 1;
+	}
 
 	lua_pushcfunction(L, traceback);
 	assert(lua_gettop(L) == 1);
@@ -81,7 +81,7 @@ local function dispatch_request(_,_,addr, session, msg, sz, padding, is_push)
 		local addr = register_name["@" .. name]
 		if addr then
 			ok = true
-			msg, sz = skynet.pack(addr)
+			msg, sz = skynet.packremote(addr)
 		else
 			ok = false
 			msg = "name not found"
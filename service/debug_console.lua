@@ -482,6 +482,9 @@ local function convert_stat(info)
 	info.wbuffer = bytes(info.wbuffer)
 	info.rtime = time(info.rtime)
 	info.wtime = time(info.wtime)
+	if info.rbuffer then
+		info.rreuse = string.format("%d (%.1f%%)", info.rreuse, info.rreuse * 100 / info.rbuffer)
+	end
 end
 
 -- netstat 列出网络连接的概况。
@@ -12,5 +12,11 @@
 #define ATOM_ADD(ptr,n) __sync_add_and_fetch(ptr, n)
 #define ATOM_SUB(ptr,n) __sync_sub_and_fetch(ptr, n)
 #define ATOM_AND(ptr,n) __sync_and_and_fetch(ptr, n)
+#define ATOM_SYNC() __sync_synchronize()
+
+// acquire/release 语义的读写，用于无锁结构中发布数据
+#define ATOM_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOM_STORE(ptr,v) __atomic_store_n(ptr, v, __ATOMIC_RELEASE)
+#define ATOM_EXCHANGE(ptr,v) __atomic_exchange_n(ptr, v, __ATOMIC_ACQ_REL)
 
 #endif
@@ -40,10 +40,18 @@ struct mem_cookie
 static struct mem_data mem_stats[SLOT_SIZE];
 //////////////////////////////////////////
 
+static __thread int THREAD_HOME = -1;	// 工作线程自己的arena（所在节点的），-1表示没有
+
+// 可回收内存块的释放回调，见 skynet_malloc_pool
+static void (* volatile POOL_RELEASE)(void *ud, void *ptr) = NULL;
+
 #ifndef NOUSE_JEMALLOC
 
 #include "jemalloc.h"
 
+static __thread int THREAD_ARENA = -1;	// 当前线程绑定的jemalloc arena，-1表示默认
+static __thread int THREAD_ORIGIN = -1;	// 第一次绑定之前 jemalloc 给线程分配的arena，用于恢复
+
 // for skynet_lalloc use
 #define raw_realloc je_realloc
 #define raw_free je_free
@@ -109,11 +117,13 @@ update_xmalloc_stat_free(uint32_t handle, size_t __n)
 	}
 }
 
-// malloc -> fill_prefix
+// 可回收内存块的 cookie 里记的 handle，cookie 前面再放一个 ud 指针
+#define POOL_HANDLE 0xfffffff0
+#define POOL_UD_SIZE sizeof(void *)
+
 inline static void *
-fill_prefix(char *ptr)
+fill_cookie(char *ptr, uint32_t handle)
 {
-	uint32_t handle = skynet_current_handle();
 	size_t size = je_malloc_usable_size(ptr); // 内存块的实际大小
 
 	// 在内存尾部添加 mem_cookie信息
@@ -127,15 +137,34 @@ fill_prefix(char *ptr)
 	return ptr;
 }
 
+// malloc -> fill_prefix
+inline static void *
+fill_prefix(char *ptr)
+{
+	return fill_cookie(ptr, skynet_current_handle());
+}
+
 // free -> clean_prefix
+// pool 为 true 时，可回收内存块交给 POOL_RELEASE 放回所属的池，返回 NULL
 inline static void *
-clean_prefix(char *ptr)
+clean_prefix(char *ptr, bool pool)
 {
 	size_t size = je_malloc_usable_size(ptr);
 	struct mem_cookie *p = (struct mem_cookie *)(ptr + size - sizeof(struct mem_cookie));
 	// 取出 handle，更新统计信息
 	uint32_t handle;
 	memcpy(&handle, &p->handle, sizeof(handle));
+	if (pool && handle == POOL_HANDLE)
+	{
+		void (*release)(void *, void *) = POOL_RELEASE;
+		if (release)
+		{
+			void *ud;
+			memcpy(&ud, ptr + size - PREFIX_SIZE - POOL_UD_SIZE, sizeof(ud));
+			release(ud, ptr);
+			return NULL;
+		}
+	}
 #ifdef MEMORY_CHECK
 	uint32_t dogtag;
 	memcpy(&dogtag, &p->dogtag, sizeof(dogtag));
@@ -250,6 +279,58 @@ int mallctl_opt(const char *name, int *newval)
 	return v;
 }
 
+/**
+ * 创建一个新的arena（jemalloc 5: arenas.create），失败返回-1
+ * numa模式下每个节点一个arena，内存页由第一次写入它的线程所在的节点分配（first touch）
+*/
+int
+skynet_arena_create(void)
+{
+	unsigned arena = 0;
+	size_t len = sizeof(arena);
+	if (je_mallctl("arenas.create", &arena, &len, NULL, 0))
+	{
+		return -1;
+	}
+	return (int)arena;
+}
+
+/**
+ * 当前线程之后的内存分配都从arena中取
+*/
+void
+skynet_arena_bind(int arena)
+{
+	if (arena == THREAD_ARENA)
+	{
+		return;
+	}
+	unsigned a = (unsigned)arena;
+	unsigned old = 0;
+	size_t len = sizeof(old);
+	if (je_mallctl("thread.arena", &old, &len, &a, sizeof(a)) == 0)
+	{
+		if (THREAD_ARENA < 0)
+		{
+			THREAD_ORIGIN = (int)old;
+		}
+		THREAD_ARENA = arena;
+	}
+}
+
+/**
+ * 运行完别的节点上的服务后，绑定回线程自己的arena
+*/
+void
+skynet_arena_restore(void)
+{
+	int arena = THREAD_HOME >= 0 ? THREAD_HOME : THREAD_ORIGIN;
+	if (arena >= 0)
+	{
+		skynet_arena_bind(arena);
+	}
+}
+
 // hook : malloc, realloc, free, calloc
 
 void *
@@ -267,8 +348,24 @@ skynet_realloc(void *ptr, size_t size)
 {
 	if (ptr == NULL)
 		return skynet_malloc(size);
+	if (POOL_RELEASE)
+	{
+		// 可回收内存块不能原地 realloc，复制一份后放回池里
+		size_t usable = je_malloc_usable_size(ptr);
+		struct mem_cookie *p = (struct mem_cookie *)((char *)ptr + usable - sizeof(struct mem_cookie));
+		uint32_t handle;
+		memcpy(&handle, &p->handle, sizeof(handle));
+		if (handle == POOL_HANDLE)
+		{
+			size_t cap = usable - PREFIX_SIZE - POOL_UD_SIZE;
+			void *newptr = skynet_malloc(size);
+			memcpy(newptr, ptr, cap < size ? cap : size);
+			skynet_free(ptr);
+			return newptr;
+		}
+	}
 	// realloc 没有考虑原先这块内存是属于哪个服务的，而是直接将 handle 更新为当前服务
-	void *rawptr = clean_prefix(ptr);
+	void *rawptr = clean_prefix(ptr, false);
 	void *newptr = je_realloc(rawptr, size + PREFIX_SIZE);
 	if (!newptr)
 		malloc_oom(size);
@@ -279,7 +376,28 @@ void skynet_free(void *ptr)
 {
 	if (ptr == NULL)
 		return;
-	void *rawptr = clean_prefix(ptr);
+	void *rawptr = clean_prefix(ptr, true);
+	if (rawptr)
+		je_free(rawptr);
+}
+
+void *
+skynet_malloc_pool(size_t size, void *ud)
+{
+	char *ptr = je_malloc(size + POOL_UD_SIZE + PREFIX_SIZE);
+	if (!ptr)
+		malloc_oom(size);
+	fill_cookie(ptr, POOL_HANDLE);
+	memcpy(ptr + je_malloc_usable_size(ptr) - PREFIX_SIZE - POOL_UD_SIZE, &ud, sizeof(ud));
+	return ptr;
+}
+
+void
+skynet_free_pool(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	void *rawptr = clean_prefix(ptr, false);
 	je_free(rawptr);
 }
 
@@ -355,8 +473,65 @@ int mallctl_cmd(const char *name)
 	return 0;
 }
 
+int
+skynet_arena_create(void)
+{
+	return -1;
+}
+
+// 没有 cookie 就认不出可回收内存块，不支持内存池
+void *
+skynet_malloc_pool(size_t size, void *ud)
+{
+	return NULL;
+}
+
+void
+skynet_free_pool(void *ptr)
+{
+	free(ptr);
+}
+
+void
+skynet_arena_bind(int arena)
+{
+}
+
+void
+skynet_arena_restore(void)
+{
+}
+
 #endif
 
+/**
+ * 工作线程启动时记下自己的arena（-1表示没有）并绑定
+ * 服务第一次运行时记住的是这个arena，而不是线程当前临时绑定的
+*/
+void
+skynet_arena_sethome(int arena)
+{
+	THREAD_HOME = arena;
+	if (arena >= 0)
+	{
+		skynet_arena_bind(arena);
+	}
+}
+
+int
+skynet_arena_home(void)
+{
+	return THREAD_HOME;
+}
+
+
+void
+skynet_pool_hook(void (*release)(void *ud, void *ptr))
+{
+	POOL_RELEASE = release;
+	ATOM_SYNC();
+}
+
 size_t
 malloc_used_memory(void)
 {
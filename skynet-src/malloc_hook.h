@@ -16,5 +16,18 @@ extern void   dump_c_mem(void);
 extern int    dump_mem_lua(lua_State *L);
 extern size_t malloc_current_memory(void);
 
+// numa : one jemalloc arena per node, the thread allocates from the arena it binds
+extern int    skynet_arena_create(void);
+extern void   skynet_arena_bind(int arena);
+extern void   skynet_arena_sethome(int arena);	// worker thread's own arena, -1 for none
+extern int    skynet_arena_home(void);
+extern void   skynet_arena_restore(void);	// bind back to the thread's own arena after running a service of another node
+
+// pool : skynet_free on a block from skynet_malloc_pool calls release(ud, ptr) instead of freeing it,
+// skynet_free_pool really frees it. skynet_malloc_pool returns NULL if the allocator can't support it.
+extern void * skynet_malloc_pool(size_t size, void *ud);
+extern void   skynet_free_pool(void *ptr);
+extern void   skynet_pool_hook(void (*release)(void *ud, void *ptr));
+
 #endif /* SKYNET_MALLOC_HOOK_H */
 
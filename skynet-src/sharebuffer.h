@@ -0,0 +1,41 @@
+#ifndef SKYNET_SHAREBUFFER_H
+#define SKYNET_SHAREBUFFER_H
+
+#include "skynet_malloc.h"
+#include "atomic.h"
+
+/**
+ * 引用计数的只读缓冲：创建后内容不再修改，可以同时被多个服务、socket 线程持有
+ * 在服务之间、服务与 socket 之间传递时只传指针和一个引用，不复制内容
+ * 只在本进程内有效，不能发给 harbor/cluster 的远端节点
+*/
+struct sharebuffer {
+	int reference;
+	int sz;
+	void * msg;
+};
+
+// msg 由 skynet_malloc 分配，之后归 sharebuffer 所有；创建者持有第一个引用
+static inline struct sharebuffer *
+sharebuffer_new(void *msg, int sz) {
+	struct sharebuffer * sb = skynet_malloc(sizeof(*sb));
+	sb->reference = 1;
+	sb->sz = sz;
+	sb->msg = msg;
+	return sb;
+}
+
+static inline void
+sharebuffer_grab(struct sharebuffer *sb) {
+	ATOM_INC(&sb->reference);
+}
+
+static inline void
+sharebuffer_release(struct sharebuffer *sb) {
+	if (ATOM_DEC(&sb->reference) == 0) {
+		skynet_free(sb->msg);
+		skynet_free(sb);
+	}
+}
+
+#endif
@@ -29,10 +29,16 @@ struct skynet_context;
 void skynet_error(struct skynet_context * context, const char *msg, ...);
 const char * skynet_command(struct skynet_context * context, const char * cmd , const char * parm);
 uint32_t skynet_queryname(struct skynet_context * context, const char * name);
+// changes whenever a local name is registered or removed, so the result of skynet_queryname(".name") can be cached
+unsigned int skynet_queryname_version(void);
 int skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * msg, size_t sz);
 int skynet_sendname(struct skynet_context * context, uint32_t source, const char * destination , int type, int session, void * msg, size_t sz);
+// send one msg to n services, the local receivers share one payload. return the number of messages sent
+int skynet_sendbatch(struct skynet_context * context, uint32_t source, const uint32_t destination[], int n, int type, int session, void * msg, size_t sz);
 
 int skynet_isremote(struct skynet_context *, uint32_t handle, int * harbor);
+// called before the framework frees a message nobody received (dead destination, exiting service), to release what the message holds
+void skynet_drop_hook(void (*release)(void * msg, size_t sz));
 
 /**
  * callback具有统一的格式
@@ -41,6 +47,10 @@ int skynet_isremote(struct skynet_context *, uint32_t handle, int * harbor);
 */
 typedef int (*skynet_cb)(struct skynet_context * context, void *ud, int type, int session, uint32_t source , const void * msg, size_t sz);
 void skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb);
+// the callback never reserves msg, so it can receive the shared payload of skynet_sendbatch. reset by skynet_callback
+void skynet_callback_shared(struct skynet_context * context, int enable);
+// the callback accepts timeouts coalesced into one message: PTYPE_RESPONSE, source 0, session 0, msg is an int array of sessions. reset by skynet_callback
+void skynet_callback_timerbatch(struct skynet_context * context, int enable);
 
 uint32_t skynet_current_handle(void);
 uint64_t skynet_now(void);
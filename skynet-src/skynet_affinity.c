@@ -0,0 +1,102 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "skynet_affinity.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+/**
+ * 解析CPU列表，格式与 taskset -c 相同，如 "0-3,8,10-11"
+*/
+int
+skynet_cpuset_parse(const char *str, int cpus[], int max) {
+	int n = 0;
+	while (*str && n < max) {
+		char *endptr = NULL;
+		while (*str == ',' || *str == ' ' || *str == '\t') {
+			++str;
+		}
+		if (*str == '\0')
+			break;
+		long from = strtol(str, &endptr, 10);
+		if (endptr == str || from < 0) {
+			fprintf(stderr, "Invalid cpu list : %s\n", str);
+			break;
+		}
+		long to = from;
+		str = endptr;
+		if (*str == '-') {
+			++str;
+			to = strtol(str, &endptr, 10);
+			if (endptr == str || to < from) {
+				fprintf(stderr, "Invalid cpu list : %s\n", str);
+				break;
+			}
+			str = endptr;
+		}
+		for (;from <= to && n < max; from++) {
+			cpus[n++] = (int)from;
+		}
+	}
+	return n;
+}
+
+/**
+ * 将当前线程绑定到指定的CPU集合上
+ * 只支持linux，其它平台返回-1
+*/
+int
+skynet_affinity_bind(const int cpus[], int n) {
+#ifdef __linux__
+	cpu_set_t set;
+	int i;
+	CPU_ZERO(&set);
+	for (i=0;i<n;i++) {
+		if (cpus[i] < CPU_SETSIZE) {
+			CPU_SET(cpus[i], &set);
+		}
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)cpus;
+	(void)n;
+	return -1;
+#endif
+}
+
+/**
+ * CPU所在的NUMA节点
+ * 读 /sys/devices/system/cpu/cpuN/ 下的 nodeM 目录，读不到时返回0
+*/
+int
+skynet_cpu_node(int cpu) {
+#ifdef __linux__
+	char path[64];
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	int node = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+			node = strtol(ent->d_name + 4, NULL, 10);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+#else
+	(void)cpu;
+	return 0;
+#endif
+}
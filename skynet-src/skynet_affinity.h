@@ -0,0 +1,11 @@
+#ifndef skynet_affinity_h
+#define skynet_affinity_h
+
+// parse a cpu list such as "0-3,8,10-11", return the number of cpus
+int skynet_cpuset_parse(const char *str, int cpus[], int max);
+// bind the calling thread to cpus, 0 for success
+int skynet_affinity_bind(const int cpus[], int n);
+// numa node of the cpu, 0 if unknown
+int skynet_cpu_node(int cpu);
+
+#endif
@@ -3,36 +3,174 @@
 #include "skynet_handle.h"
 #include "skynet_server.h"
 #include "rwlock.h"
+#include "atomic.h"
 
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdbool.h>
+#include <sched.h>
 
 #define DEFAULT_SLOT_SIZE 4
+#define DEFAULT_NAME_SIZE 16
 #define MAX_SLOT_SIZE 0x40000000
 
+/**
+ * 别名，挂在别名哈希表的桶上
+ * 节点从链表摘下后，要等读者离开才释放
+*/
 struct handle_name {
-	char * name;
+	struct handle_name * next;
+	struct handle_name * free_next;	// 摘下后等待释放的链表，不能复用 next
+	uint32_t hash;
 	uint32_t handle;
+	char name[1];
+};
+
+/**
+ * 别名哈希表，扩容时连同节点整体替换
+*/
+struct handle_namehash {
+	int size;						// 桶的数量，永远是2的幂级数
+	struct handle_name * bucket[1];
+};
+
+/**
+ * 读者记录，每个调用过 skynet_handle_grab 的线程一个
+ * seq 只由所属线程修改，奇数表示正在读服务表。
+ * 写者在释放旧的服务表或服务实例之前，等待所有正在读的线程离开（见 skynet_handle_sync）
+ * 这样 skynet_handle_grab 不需要写任何共享的数据
+*/
+struct handle_reader {
+	unsigned int seq;
+	struct handle_reader * next;
+	char padding[64];				// 各线程的 seq 不在同一个 cache line
+};
+
+/**
+ * 全局的服务表。[hash] = context
+ * 扩容时整体替换，旧表要等读者离开后才释放
+*/
+struct handle_slot {
+	int size;						// 长度，永远是2的幂级数，且不超过HANDLE_MASK
+	struct skynet_context * ctx[1];
 };
 
 ////////////////////////////////////////////////// 全局服务实例存储
 struct handle_storage {
-	struct rwlock lock;				// 读写锁
+	struct rwlock lock;				// 读写锁，保护写服务表和别名数组。skynet_handle_grab 不加锁
 
 	uint32_t harbor;				// 服务器ID，配置项. 又称为节点ID, 它会在服务标识的高8位显示.
 	uint32_t handle_index;			// 服务实例句柄，保证每个服务都是唯一标识的。每次创建新的服务实例时，该值会递增
-	int slot_size;					// 全局服务表的长度，永远是2的幂级数，且不超过HANDLE_MASK
-	struct skynet_context ** slot;	// 全局的服务表。[hash] = context
+	struct handle_slot * slot;		// 全局的服务表
+	struct handle_reader * reader;	// 所有的读者记录，只增不减
 	
-	int name_cap;					// 别名数组容量
-	int name_count;					// 别名数组的有效数据量
-	struct handle_name *name;		// 别名数组
+	int name_count;					// 别名数量
+	unsigned int name_version;		// 每次增删别名加1，用于调用方缓存查询结果
+	struct handle_namehash * name;	// 别名哈希表，读不加锁
 };
 
 static struct handle_storage *H = NULL;
+static __thread struct handle_reader * READER = NULL;
 //////////////////////////////////////////////////
 
+static struct handle_slot *
+slot_new(int size) {
+	struct handle_slot * slot = skynet_malloc(sizeof(*slot) + (size - 1) * sizeof(struct skynet_context *));
+	slot->size = size;
+	memset(slot->ctx, 0, size * sizeof(struct skynet_context *));
+	return slot;
+}
+
+static struct handle_reader *
+reader_new(struct handle_storage *s) {
+	struct handle_reader * r = skynet_malloc(sizeof(*r));
+	r->seq = 0;
+	do {
+		r->next = s->reader;
+	} while (!ATOM_CAS_POINTER(&s->reader, r->next, r));
+	return r;
+}
+
+static inline struct handle_reader *
+read_begin(struct handle_storage *s) {
+	struct handle_reader * r = READER;
+	if (r == NULL) {
+		r = READER = reader_new(s);
+	}
+	ATOM_STORE(&r->seq, r->seq + 1);
+	// 写者要么看到我们在读，要么我们看到写者摘掉之后的数据
+	ATOM_SYNC();
+	return r;
+}
+
+static inline void
+read_end(struct handle_reader *r) {
+	ATOM_STORE(&r->seq, r->seq + 1);
+}
+
+static uint32_t
+name_hash(const char * name) {
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	const unsigned char * p = (const unsigned char *)name;
+	while (*p) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct handle_namehash *
+namehash_new(int size) {
+	struct handle_namehash * nh = skynet_malloc(sizeof(*nh) + (size - 1) * sizeof(struct handle_name *));
+	nh->size = size;
+	memset(nh->bucket, 0, size * sizeof(struct handle_name *));
+	return nh;
+}
+
+static struct handle_name *
+name_new(const char * name, uint32_t hash, uint32_t handle) {
+	size_t sz = strlen(name);
+	struct handle_name * n = skynet_malloc(sizeof(*n) + sz);
+	n->next = NULL;
+	n->free_next = NULL;
+	n->hash = hash;
+	n->handle = handle;
+	memcpy(n->name, name, sz + 1);
+	return n;
+}
+
+static void
+name_freelist(struct handle_name * n) {
+	while (n) {
+		struct handle_name * next = n->free_next;
+		skynet_free(n);
+		n = next;
+	}
+}
+
+/**
+ * 等待正在读服务表的线程离开
+ * 在此之前从服务表摘下的服务表或服务实例，调用之后就不会再有读者访问了
+*/
+void
+skynet_handle_sync() {
+	struct handle_storage *s = H;
+	// 和 skynet_handle_grab 中的 ATOM_SYNC 配对
+	ATOM_SYNC();
+	struct handle_reader * r = ATOM_LOAD(&s->reader);
+	while (r) {
+		unsigned int seq = ATOM_LOAD(&r->seq);
+		if (seq & 1) {
+			while (ATOM_LOAD(&r->seq) == seq) {
+				sched_yield();
+			}
+		}
+		r = r->next;
+	}
+}
+
 uint32_t
 skynet_handle_register(struct skynet_context *ctx) {
 	struct handle_storage *s = H;
@@ -42,16 +180,17 @@ skynet_handle_register(struct skynet_context *ctx) {
 	for (;;) {
 		int i;
 		uint32_t handle = s->handle_index;
+		struct handle_slot * slot = s->slot;
 		//寻找是否有已经释放（处理完）的服务留出的空位NULL
-		for (i=0;i<s->slot_size;i++,handle++) {
+		for (i=0;i<slot->size;i++,handle++) {
 			if (handle > HANDLE_MASK) {
 				// 0 is reserved
 				handle = 1;
 			}
-			// 因为s->slot_size是2的幂级数，所以这里显然成了MASK操作
-			int hash = handle & (s->slot_size-1);
-			if (s->slot[hash] == NULL) {
-				s->slot[hash] = ctx;
+			// 因为slot->size是2的幂级数，所以这里显然成了MASK操作
+			int hash = handle & (slot->size-1);
+			if (slot->ctx[hash] == NULL) {
+				ATOM_STORE(&slot->ctx[hash], ctx);
 				s->handle_index = handle + 1;
 
 				rwlock_wunlock(&s->lock);
@@ -61,24 +200,24 @@ skynet_handle_register(struct skynet_context *ctx) {
 			}
 		}
 		// 如果服务列表没有空位，则申请2倍内存并进行内存拷贝。
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
-		for (i=0;i<s->slot_size;i++) {
-			int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-			assert(new_slot[hash] == NULL);
-			new_slot[hash] = s->slot[i];
+		assert((slot->size*2 - 1) <= HANDLE_MASK);
+		struct handle_slot * new_slot = slot_new(slot->size * 2);
+		for (i=0;i<slot->size;i++) {
+			int hash = skynet_context_handle(slot->ctx[i]) & (new_slot->size - 1);
+			assert(new_slot->ctx[hash] == NULL);
+			new_slot->ctx[hash] = slot->ctx[i];
 		}
-		skynet_free(s->slot);
-		s->slot = new_slot;
-		s->slot_size *= 2;
+		ATOM_STORE(&s->slot, new_slot);
+		// 可能还有线程在读旧表
+		skynet_handle_sync();
+		skynet_free(slot);
 	}
 }
 
 /**
  * 下线指定句柄的服务：
  * 1. s->slot[hash]：清空引用关系
- * 2. s->name[i]：若有别名，清理数组项并移动内存
+ * 2. s->name：若有别名，从哈希表摘下，等读者离开后释放
  * 3. 修改服务的引用计数，触发release
 */
 
@@ -86,33 +225,50 @@ int
 skynet_handle_retire(uint32_t handle) {
 	int ret = 0;
 	struct handle_storage *s = H;
+	struct handle_name * removed = NULL;
 
 	rwlock_wlock(&s->lock);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_slot * slot = s->slot;
+	uint32_t hash = handle & (slot->size-1);
+	struct skynet_context * ctx = slot->ctx[hash];
 
 	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
-		s->slot[hash] = NULL;
+		ATOM_STORE(&slot->ctx[hash], NULL);
 		ret = 1;
+		struct handle_namehash * nh = s->name;
 		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			if (s->name[i].handle == handle) {
-				skynet_free(s->name[i].name);
-				continue;
-			} else if (i!=j) {
-				s->name[j] = s->name[i];
+		for (i=0; s->name_count > 0 && i<nh->size; ++i) {
+			struct handle_name ** prev = &nh->bucket[i];
+			struct handle_name * n = *prev;
+			while (n) {
+				struct handle_name * next = n->next;
+				if (n->handle == handle) {
+					// 正在读的线程仍可以顺着 n->next 走下去
+					ATOM_STORE(prev, next);
+					n->free_next = removed;
+					removed = n;
+					--s->name_count;
+				} else {
+					prev = &n->next;
+				}
+				n = next;
 			}
-			++j;
 		}
-		s->name_count = j;
+		if (removed) {
+			ATOM_INC(&s->name_version);
+		}
 	} else {
 		ctx = NULL;
 	}
 
 	rwlock_wunlock(&s->lock);
 
+	if (removed) {
+		skynet_handle_sync();
+		name_freelist(removed);
+	}
+
 	if (ctx) {
 		// release ctx may call skynet_handle_* , so wunlock first.
 		skynet_context_release(ctx);
@@ -130,9 +286,9 @@ skynet_handle_retireall() {
 	for (;;) {
 		int n=0;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
+		for (i=0;i<s->slot->size;i++) {
 			rwlock_rlock(&s->lock);
-			struct skynet_context * ctx = s->slot[i];
+			struct skynet_context * ctx = s->slot->ctx[i];
 			uint32_t handle = 0;
 			if (ctx)
 				handle = skynet_context_handle(ctx);
@@ -150,151 +306,149 @@ skynet_handle_retireall() {
 
 /**
  * 通过句柄找到服务实例skynet_context
+ * 不加锁，只修改本线程的读者记录。
+ * 服务实例可能正在被释放，所以只在引用计数不为0时增加引用
 */
 struct skynet_context * 
 skynet_handle_grab(uint32_t handle) {
 	struct handle_storage *s = H;
 	struct skynet_context * result = NULL;
 
-	rwlock_rlock(&s->lock);
-
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
-	if (ctx && skynet_context_handle(ctx) == handle) {
+	struct handle_reader * r = read_begin(s);
+	struct handle_slot * slot = ATOM_LOAD(&s->slot);
+	uint32_t hash = handle & (slot->size-1);
+	struct skynet_context * ctx = ATOM_LOAD(&slot->ctx[hash]);
+	if (ctx && skynet_context_handle(ctx) == handle && skynet_context_trygrab(ctx)) {
 		result = ctx;
-		skynet_context_grab(result);
 	}
 
-	rwlock_runlock(&s->lock);
+	read_end(r);
 
 	return result;
 }
 
 /**
  * 通过别名找到服务句柄
- * 用的二分查找法
+ * 查哈希表，不加锁
 */
 uint32_t 
 skynet_handle_findname(const char * name) {
 	struct handle_storage *s = H;
-
-	rwlock_rlock(&s->lock);
-
+	uint32_t hash = name_hash(name);
 	uint32_t handle = 0;
 
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
+	struct handle_reader * r = read_begin(s);
+
+	struct handle_namehash * nh = ATOM_LOAD(&s->name);
+	struct handle_name * n = ATOM_LOAD(&nh->bucket[hash & (nh->size-1)]);
+	while (n) {
+		if (n->hash == hash && strcmp(n->name, name) == 0) {
 			handle = n->handle;
 			break;
 		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+		n = ATOM_LOAD(&n->next);
 	}
 
-	rwlock_runlock(&s->lock);
+	read_end(r);
 
 	return handle;
 }
 
+/**
+ * 别名哈希表扩容：
+ * 读者可能正在旧表的链表上，所以不能修改旧节点，拷贝所有节点到新表
+*/
 static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	/**
-	 * 如果名字空间满了，就申请2倍内存并拷贝数据
-	*/
-	if (s->name_count >= s->name_cap) {
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		struct handle_name * n = skynet_malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
+_expand_name(struct handle_storage *s) {
+	struct handle_namehash * old = s->name;
+	assert(old->size * 2 <= MAX_SLOT_SIZE);
+	struct handle_namehash * nh = namehash_new(old->size * 2);
+	int i;
+	for (i=0;i<old->size;i++) {
+		struct handle_name * n;
+		for (n = old->bucket[i]; n; n = n->next) {
+			struct handle_name * c = name_new(n->name, n->hash, n->handle);
+			int b = c->hash & (nh->size-1);
+			c->next = nh->bucket[b];
+			nh->bucket[b] = c;
 		}
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
-		}
-		skynet_free(s->name);
-		s->name = n;
-	} else {
-		int i;
-		for (i=s->name_count;i>before;i--) {
-			s->name[i] = s->name[i-1];
+	}
+	ATOM_STORE(&s->name, nh);
+	skynet_handle_sync();
+	for (i=0;i<old->size;i++) {
+		struct handle_name * n = old->bucket[i];
+		while (n) {
+			struct handle_name * next = n->next;
+			skynet_free(n);
+			n = next;
 		}
 	}
-	/**
-	 * 从尾部开始拷贝内存腾出空间
-	 * 并赋值
-	*/
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+	skynet_free(old);
 }
 
-static const char *
+static bool
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
 	/**
 	 * 判断名字是否已存在，如果存在则取消插入
-	 * 在s->name中进行二分查找（s->name是有序的数组）
 	*/
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			return NULL;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
+	uint32_t hash = name_hash(name);
+	struct handle_namehash * nh = s->name;
+	struct handle_name * n;
+	for (n = nh->bucket[hash & (nh->size-1)]; n; n = n->next) {
+		if (n->hash == hash && strcmp(n->name, name) == 0) {
+			return false;
 		}
 	}
-	char * result = skynet_strdup(name);
-	//插入位置为begin
-	_insert_name_before(s, result, handle, begin);
+	if (s->name_count >= nh->size) {
+		_expand_name(s);
+		nh = s->name;
+	}
+	n = name_new(name, hash, handle);
+	int b = hash & (nh->size-1);
+	n->next = nh->bucket[b];
+	// 节点初始化完成后才挂到桶上
+	ATOM_STORE(&nh->bucket[b], n);
+	s->name_count ++;
+	ATOM_INC(&s->name_version);
 
-	return result;
+	return true;
 }
 
 /**
  * 给指定句柄的服务，起一个别名
- * skynet_handle_namehandle -> _insert_name -> _insert_name_before
+ * skynet_handle_namehandle -> _insert_name
+ * 成功时返回调用者传入的 name：表里的节点在扩容时会被释放，不能把它交给不在读者登记里的调用者
 */
 const char * 
 skynet_handle_namehandle(uint32_t handle, const char *name) {
 	rwlock_wlock(&H->lock);
 
-	const char * ret = _insert_name(H, name, handle);
+	bool ret = _insert_name(H, name, handle);
 
 	rwlock_wunlock(&H->lock);
 
-	return ret;
+	return ret ? name : NULL;
+}
+
+unsigned int
+skynet_handle_nameversion() {
+	return ATOM_LOAD(&H->name_version);
 }
 
 void 
 skynet_handle_init(int harbor) {
 	assert(H==NULL);
 	struct handle_storage * s = skynet_malloc(sizeof(*H));
-	s->slot_size = DEFAULT_SLOT_SIZE;
-	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *));
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));
+	s->slot = slot_new(DEFAULT_SLOT_SIZE);
+	s->reader = NULL;
 
 	rwlock_init(&s->lock);
 	// reserve 0 for system
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;
-	s->name_cap = 2;
 	s->name_count = 0;
-	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name));
+	s->name_version = 0;
+	s->name = namehash_new(DEFAULT_NAME_SIZE);
 
 	H = s;
 
@@ -14,9 +14,11 @@ uint32_t skynet_handle_register(struct skynet_context *);
 int skynet_handle_retire(uint32_t handle);
 struct skynet_context * skynet_handle_grab(uint32_t handle);
 void skynet_handle_retireall();
+void skynet_handle_sync();	// wait for the lock-free readers of skynet_handle_grab
 
 uint32_t skynet_handle_findname(const char * name);
 const char * skynet_handle_namehandle(uint32_t handle, const char *name);
+unsigned int skynet_handle_nameversion();	// changes whenever a name is added or removed
 
 void skynet_handle_init(int harbor);
 
@@ -3,6 +3,15 @@
 
 struct skynet_config {
 	int thread;							// 线程数量是配置的(没有调用系统ABI获取芯片的内核数量的骚操作)
+	int worker_spin;					// 工作线程休眠前空转检查消息队列的次数
+	int worker_wakeup;					// push 使全局消息队列非空时立即唤醒一个休眠的工作线程
+	const char * weight;				// 工作线程的权重表，逗号分隔，按线程序号依次对应，NULL使用内置的表
+	const char * worker_cpu;			// 工作线程绑定的CPU列表（如 "0-15"），第i个工作线程绑定列表中第i个CPU
+	int socket_thread;					// socket线程数量，每个线程独占一个 socket_server 分片，默认1
+	const char * socket_backend;		// socket线程的事件后端：epoll(默认) 或 io_uring，io_uring 不可用时退回 epoll
+	const char * socket_cpu;			// socket线程绑定的CPU集合
+	const char * timer_cpu;				// 计时器线程绑定的CPU集合
+	int numa;							// numa模式：每个节点一个jemalloc arena，需要配置 worker_cpu
 	int harbor;							// 服务器ID. 也就是分布式结构中的节点值. 0表示这个服务器架构是单节点的
 	int profile;
 	const char * daemon;
@@ -10,6 +19,8 @@ struct skynet_config {
 	const char * bootstrap;				// bootstrap: 自举命令 snlua bootstrap
 	const char * logger;				// 日志服务的名称, 通常为 logger, 对应 cserver/logger.so
 	const char * logservice;			// 日志文件名, 日志服务实例初始化时传入的参数, 默认打到stdout
+	const char * scheduler;				// 调度模式: global 单一全局消息队列(默认), steal 工作线程本地队列+窃取
+	int timer_resolution;				// 计时器精度，单位：毫秒，1~10，默认10
 };
 
 // 线程分类，私有数据根据该值与key关联
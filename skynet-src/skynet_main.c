@@ -161,6 +161,16 @@ main(int argc, char *argv[]) {
 
 	// 从环境变量中读出相应值，并指定默认值
 	config.thread =  optint("thread",8);
+	config.worker_spin = optint("worker_spin", 0);
+	config.worker_wakeup = optboolean("worker_wakeup", 1);
+	config.weight = optstring("weight", NULL);
+	config.worker_cpu = optstring("worker_cpu", NULL);
+	config.socket_thread = optint("socket_thread", 1);
+	config.socket_backend = optstring("socket_backend", "epoll");
+	config.socket_cpu = optstring("socket_cpu", NULL);
+	config.timer_cpu = optstring("timer_cpu", NULL);
+	config.numa = optboolean("numa", 0);
+	config.timer_resolution = optint("timer_resolution", 10);
 	config.module_path = optstring("cpath","./cservice/?.so");
 	config.harbor = optint("harbor", 1);
 	config.bootstrap = optstring("bootstrap","snlua bootstrap");
@@ -168,6 +178,7 @@ main(int argc, char *argv[]) {
 	config.logger = optstring("logger", NULL);
 	config.logservice = optstring("logservice", "logger");
 	config.profile = optboolean("profile", 1);
+	config.scheduler = optstring("scheduler", "global");
 
 	lua_close(L);
 
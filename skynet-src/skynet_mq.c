@@ -2,6 +2,7 @@
 #include "skynet_mq.h"
 #include "skynet_handle.h"
 #include "spinlock.h"
+#include "atomic.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +11,7 @@
 #include <stdbool.h>
 
 #define DEFAULT_QUEUE_SIZE 64
+#define MAX_SEGMENT_SIZE 4096
 #define MAX_GLOBAL_MQ 0x10000
 
 // 0 means mq is not in global mq.
@@ -18,20 +20,42 @@
 #define MQ_IN_GLOBAL 1
 #define MQ_OVERLOAD 1024
 
+/**
+ * 次级消息队列由若干段（segment）链接而成，多生产者/单消费者，无锁：
+ * 生产者原子自增段的 tail 预定槽位，写入消息后置 ready；段写满后链接下一个新段。
+ * 消费者（持有该队列的工作线程）按顺序读 ready 的槽位，读完一段后将其回收。
+ * 原来 expand_queue 的扩容，变成按积压情况决定下一个新段的容量。
+*/
+struct mq_slot {
+	int ready;							// 消息已写入，消费者可读
+	struct skynet_message msg;
+};
+
+struct mq_segment {
+	struct mq_segment *next;			// 下一个段，由写满该段的生产者链接
+	struct mq_segment *free_next;		// 回收链表（不能复用next，生产者可能还在读它）
+	unsigned base;						// 该段第一个槽位在整个队列中的序号，用于O(1)计算长度
+	int cap;							// 段的容量
+	int tail;							// 生产者预定的位置，可能超过cap
+	int head;							// 消费者读取的位置，只有消费者访问
+	struct mq_slot slot[1];
+};
+
 /**
  * 一个服务（Actor）对应的消息队列
 */
 struct message_queue {
-	struct spinlock lock;				// 自旋锁
 	uint32_t handle;					// 所属的服务句柄
-	int cap;							// 消息队列的容量(capacity)
-	int head;
-	int tail;
+	int segment_size;					// 下一个新段的容量，由消费者根据积压长度调整
 	int release;						// 释放标记
-	int in_global;						// 属于全局消息队列的标记
+	int in_global;						// 属于全局消息队列的标记，CAS切换
 	int overload;						// 消息超载标记
 	int overload_threshold;				// 消息超载阈值
-	struct skynet_message *queue;		// 次级消息队列，循环队列（head、tail假溢出操作）
+	int pushing;						// 正在push的生产者数量，为0时才能安全回收旧段
+	struct mq_segment *head;			// 消费者所在的段
+	struct mq_segment *tail;			// 生产者所在的段
+	struct mq_segment *retired;			// 已读完、等待回收的段
+	struct mq_segment *spare;			// 回收后留给生产者复用的段
 	struct message_queue *next;
 };
 
@@ -54,13 +78,35 @@ struct global_queue {
 static struct global_queue *Q = NULL;
 //////////////////////////////////////////////////
 
+////////////////////////////////////////////////// 工作线程本地队列（steal 模式）
+/*****************************************************************************
+ * 每个工作线程持有一个本地队列，由工作线程放回的次级消息队列进入本地队列，
+ * 非工作线程（socket/timer/main）产生的就绪队列仍进入全局消息队列。
+ * pop 顺序：本地队列 -> 全局消息队列 -> 依次从其它工作线程的本地队列窃取。
+ * 每个本地队列有自己的锁，工作线程之间不再争抢同一个自旋锁。
+******************************************************************************/
+#define STEAL_GLOBAL_INTERVAL 61		// 每隔若干次 pop 优先检查一次全局消息队列，避免其中的队列饿死
+
+struct worker_queue {
+	struct global_queue q;
+	char padding[64];					// 避免相邻工作线程的本地队列共享缓存行
+};
+
+static struct worker_queue *W = NULL;	// 本地队列数组，global 模式下为 NULL
+static int WORKER_COUNT = 0;
+static __thread int WORKER_ID = -1;		// 当前线程的工作线程序号，非工作线程为 -1
+static __thread unsigned WORKER_TICK = 0;
+//////////////////////////////////////////////////
+
+static globalmq_wakeup WAKEUP = NULL;	// 队列由空变为非空时，唤醒一个休眠中的工作线程
+static void *WAKEUP_UD = NULL;
+
 /**
- * 向全局消息队列尾部加入一个消息队列
+ * 返回1表示队列原本是空的
 */
-void 
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q = Q;
-
+static inline int
+queue_push(struct global_queue *q, struct message_queue *queue) {
+	int empty = 0;
 	SPIN_LOCK(q)
 	assert(queue->next == NULL);
 	if(q->tail) {
@@ -68,18 +114,14 @@ skynet_globalmq_push(struct message_queue * queue) {
 		q->tail = queue;
 	} else {
 		q->head = q->tail = queue;
+		empty = 1;
 	}
 	SPIN_UNLOCK(q)
+	return empty;
 }
 
-
-/**
- * 向全局消息队列头部取出一个消息队列
-*/
-struct message_queue * 
-skynet_globalmq_pop() {
-	struct global_queue *q = Q;
-
+static inline struct message_queue *
+queue_pop(struct global_queue *q) {
 	SPIN_LOCK(q)
 	struct message_queue *mq = q->head;
 	if(mq) {
@@ -95,6 +137,118 @@ skynet_globalmq_pop() {
 	return mq;
 }
 
+/**
+ * 从其它工作线程的本地队列窃取一个次级消息队列
+ * 先不加锁地看一眼 head，空队列直接跳过
+*/
+static struct message_queue *
+queue_steal(int id) {
+	int i;
+	for (i=1;i<WORKER_COUNT;i++) {
+		struct global_queue *victim = &W[(id + i) % WORKER_COUNT].q;
+		if (victim->head == NULL)
+			continue;
+		struct message_queue *mq = queue_pop(victim);
+		if (mq)
+			return mq;
+	}
+	return NULL;
+}
+
+/**
+ * 向全局消息队列尾部加入一个消息队列
+ * steal 模式下，工作线程放回的队列进入自己的本地队列
+*/
+void 
+skynet_globalmq_push(struct message_queue * queue) {
+	int id = WORKER_ID;
+	int empty;
+	if (W && id >= 0) {
+		empty = queue_push(&W[id].q, queue);
+	} else {
+		empty = queue_push(Q, queue);
+	}
+	if (empty && WAKEUP) {
+		WAKEUP(WAKEUP_UD);
+	}
+}
+
+
+/**
+ * 向全局消息队列头部取出一个消息队列
+ * steal 模式下依次尝试：本地队列、全局消息队列、其它工作线程的本地队列
+*/
+struct message_queue * 
+skynet_globalmq_pop() {
+	int id = WORKER_ID;
+	if (W == NULL || id < 0) {
+		return queue_pop(Q);
+	}
+	struct message_queue *mq;
+	if (++WORKER_TICK % STEAL_GLOBAL_INTERVAL == 0) {
+		mq = queue_pop(Q);
+		if (mq)
+			return mq;
+	}
+	mq = queue_pop(&W[id].q);
+	if (mq)
+		return mq;
+	if (Q->head) {
+		mq = queue_pop(Q);
+		if (mq)
+			return mq;
+	}
+	return queue_steal(id);
+}
+
+/**
+ * 工作线程启动时登记自己的序号，steal 模式据此找到本地队列
+*/
+void
+skynet_globalmq_bind(int worker) {
+	WORKER_ID = worker;
+}
+
+/**
+ * 设置唤醒回调：push 使全局消息队列（或本地队列）由空变为非空时调用
+*/
+void
+skynet_globalmq_wakeup(globalmq_wakeup func, void *ud) {
+	WAKEUP_UD = ud;
+	WAKEUP = func;
+}
+
+/**
+ * 全局消息队列以及所有本地队列是否都为空
+ * 不加锁，只用于工作线程决定是否休眠
+*/
+int
+skynet_globalmq_empty(void) {
+	if (Q->head)
+		return 0;
+	if (W) {
+		int i;
+		for (i=0;i<WORKER_COUNT;i++) {
+			if (W[i].q.head)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static struct mq_segment *
+segment_new(int cap) {
+	struct mq_segment *seg = skynet_malloc(sizeof(*seg) + sizeof(struct mq_slot) * (cap - 1));
+	seg->base = 0;
+	seg->next = NULL;
+	seg->free_next = NULL;
+	seg->cap = cap;
+	seg->tail = 0;
+	seg->head = 0;
+	memset(seg->slot, 0, sizeof(struct mq_slot) * cap);
+	return seg;
+}
+
 /**
  * 为指定句柄的服务创建一个消息队列
 */
@@ -102,10 +256,7 @@ struct message_queue *
 skynet_mq_create(uint32_t handle) {
 	struct message_queue *q = skynet_malloc(sizeof(*q));
 	q->handle = handle;
-	q->cap = DEFAULT_QUEUE_SIZE;
-	q->head = 0;
-	q->tail = 0;
-	SPIN_INIT(q)
+	q->segment_size = DEFAULT_QUEUE_SIZE;
 	// When the queue is create (always between service create and service init),
 	// set in_global flag to avoid push it to global queue.
 	// If the service init success, skynet_context_new will call skynet_mq_push to push it to global queue.
@@ -113,17 +264,35 @@ skynet_mq_create(uint32_t handle) {
 	q->release = 0;
 	q->overload = 0;
 	q->overload_threshold = MQ_OVERLOAD;
-	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap);
+	q->pushing = 0;
+	q->head = q->tail = segment_new(DEFAULT_QUEUE_SIZE);
+	q->retired = NULL;
+	q->spare = NULL;
 	q->next = NULL;
 
 	return q;
 }
 
+static void
+free_retired(struct mq_segment *seg) {
+	while (seg) {
+		struct mq_segment *next = seg->free_next;
+		skynet_free(seg);
+		seg = next;
+	}
+}
+
 static void 
 _release(struct message_queue *q) {
 	assert(q->next == NULL);
-	SPIN_DESTROY(q)
-	skynet_free(q->queue);
+	struct mq_segment *seg = q->head;
+	while (seg) {
+		struct mq_segment *next = seg->next;
+		skynet_free(seg);
+		seg = next;
+	}
+	free_retired(q->retired);
+	skynet_free(q->spare);
 	skynet_free(q);
 }
 
@@ -137,21 +306,23 @@ skynet_mq_handle(struct message_queue *q) {
 
 /**
  * 获取消息队列的有效长度
+ * 只能由消费者调用：旧段只有消费者回收，读取时不会被释放
+ * 用段的序号相减，生产者预定了但还没写完的槽位也计算在内
 */
 int
 skynet_mq_length(struct message_queue *q) {
-	int head, tail,cap;
-
-	SPIN_LOCK(q)
-	head = q->head;
-	tail = q->tail;
-	cap = q->cap;
-	SPIN_UNLOCK(q)
-	
-	if (head <= tail) {
-		return tail - head;
+	struct mq_segment *head = q->head;
+	struct mq_segment *tail = ATOM_LOAD(&q->tail);
+	int n = ATOM_LOAD(&tail->tail);
+	if (n > tail->cap) {
+		n = tail->cap;
 	}
-	return tail + cap - head;
+	int length = (int)((tail->base + n) - (head->base + head->head));
+	if (length < 0) {
+		// q->tail 还没跟上（写满旧段的生产者尚未更新它）
+		length = 0;
+	}
+	return length;
 }
 
 /**
@@ -169,33 +340,102 @@ skynet_mq_overload(struct message_queue *q) {
 }
 
 /**
- * 从次级消息队列中取出头部的消息
+ * 回收已读完的段
+ * 段被读完时，写满它的生产者可能还没离开 push，
+ * 只有观察到 pushing 为 0 时，才能确认没有生产者还持有这些段的指针
 */
-int
-skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
-	int ret = 1;			// errno，异常标记，若成功pop，返回0
-	SPIN_LOCK(q)
-
-	if (q->head != q->tail) {
-		*message = q->queue[q->head++];			// 内存拷贝
-		ret = 0;
-		int head = q->head;
-		int tail = q->tail;
-		int cap = q->cap;
+static void
+reclaim_segment(struct message_queue *q) {
+	ATOM_SYNC();
+	if (q->pushing != 0)
+		return;
+	struct mq_segment *seg = q->retired;
+	q->retired = NULL;
+	if (q->spare == NULL && seg->cap == q->segment_size) {
+		struct mq_segment *next = seg->free_next;
+		seg->next = NULL;
+		seg->free_next = NULL;
+		seg->tail = 0;
+		seg->head = 0;
+		memset(seg->slot, 0, sizeof(struct mq_slot) * seg->cap);
+		ATOM_STORE(&q->spare, seg);
+		seg = next;
+	}
+	free_retired(seg);
+}
 
-		// 假溢出操作
-		if (head >= cap) {
-			q->head = head = 0;
+/**
+ * 消费者取出头部的一个消息，队列为空（或头部的槽位还没写完）返回1
+*/
+static int
+segment_pop(struct message_queue *q, struct skynet_message *message) {
+	struct mq_segment *seg = q->head;
+	for (;;) {
+		if (seg->head < seg->cap) {
+			struct mq_slot *slot = &seg->slot[seg->head];
+			if (!ATOM_LOAD(&slot->ready)) {
+				return 1;
+			}
+			*message = slot->msg;			// 内存拷贝
+			++seg->head;
+			return 0;
+		}
+		struct mq_segment *next = ATOM_LOAD(&seg->next);
+		if (next == NULL) {
+			return 1;
 		}
+		// 该段已读完，切换到下一个段
+		// 积压超过段容量就加倍下一个新段，否则恢复默认容量
+		q->head = next;
+		int length = skynet_mq_length(q);
+		if (length >= seg->cap) {
+			int size = seg->cap * 2;
+			q->segment_size = size > MAX_SEGMENT_SIZE ? MAX_SEGMENT_SIZE : size;
+		} else {
+			q->segment_size = DEFAULT_QUEUE_SIZE;
+		}
+		seg->free_next = q->retired;
+		q->retired = seg;
+		seg = next;
+	}
+}
+
+static int
+segment_ready(struct mq_segment *seg) {
+	while (seg->head >= seg->cap) {
+		seg = ATOM_LOAD(&seg->next);
+		if (seg == NULL)
+			return 0;
+	}
+	return ATOM_LOAD(&seg->slot[seg->head].ready);
+}
 
-		// 计算队列有效数据长度，且考虑tail假溢出情况
-		int length = tail - head;
-		if (length < 0) {
-			length += cap;
+/**
+ * 从次级消息队列中取出头部的消息
+ * 只有持有该队列的工作线程（单消费者）会调用
+*/
+int
+skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
+	int ret = segment_pop(q, message);			// errno，异常标记，若成功pop，返回0
+	if (ret) {
+		// 消息队列为空时，就不打算在消息循环中重新将该队列push进去了（降低消息循环的负载）
+		// 而是做个标记，在产生新消息时，通过标记重新push到全局消息队列
+		// 因为新消息的产生的流程：找到服务实例 -> 找到对应消息队列 -> skynet_mq_push
+		// 和消息循环无关
+		q->in_global = 0;
+		ATOM_SYNC();
+		// 清除标记之后再检查一次：生产者可能在标记清除前写完了消息，却看到 in_global 仍为1。
+		// 这时谁把标记从0改回1，谁就拥有这个队列
+		if (segment_ready(q->head) && ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+			ret = segment_pop(q, message);
+			assert(ret == 0);
 		}
+	}
 
+	if (ret == 0) {
 		// 超载的话，打上标记，并扩大超载阈值
 		// 为什么是pop消息的时候判断超载呢？？？
+		int length = skynet_mq_length(q);
 		while (length > q->overload_threshold) {
 			q->overload = length;
 			q->overload_threshold *= 2;
@@ -206,75 +446,87 @@ skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
 		q->overload_threshold = MQ_OVERLOAD;
 	}
 
-	if (ret) {
-		// 消息队列为空时，就不打算在消息循环中重新将该队列push进去了（降低消息循环的负载）
-		// 而是做个标记，在产生新消息时，通过标记重新push到全局消息队列
-		// 因为新消息的产生的流程：找到服务实例 -> 找到对应消息队列 -> skynet_mq_push
-		// 和消息循环无关
-		q->in_global = 0;
+	if (q->retired) {
+		reclaim_segment(q);
 	}
-	
-	SPIN_UNLOCK(q)
 
 	return ret;
 }
 
 /**
- * 扩展队列容量
- * 又是内存拷贝
+ * 取一个新段：优先复用消费者回收的段
+ * 只有消费者会把段放进spare，且 pushing 不为0时消费者不会回收，所以这里的CAS没有ABA问题
 */
-static void
-expand_queue(struct message_queue *q) {
-	struct skynet_message *new_queue = skynet_malloc(sizeof(struct skynet_message) * q->cap * 2);
-	int i;
-	for (i=0;i<q->cap;i++) {
-		new_queue[i] = q->queue[(q->head + i) % q->cap];
+static struct mq_segment *
+segment_alloc(struct message_queue *q) {
+	struct mq_segment *seg = ATOM_LOAD(&q->spare);
+	if (seg && ATOM_CAS_POINTER(&q->spare, seg, NULL)) {
+		return seg;
 	}
-	q->head = 0;
-	q->tail = q->cap;
-	q->cap *= 2;
-	
-	skynet_free(q->queue);
-	q->queue = new_queue;
+	return segment_new(q->segment_size);
 }
 
 /**
  * 将消息加入到次级消息队列的尾部
+ * 多个线程可以同时push，不加锁
 */
 void 
 skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	assert(message);
-	SPIN_LOCK(q)
-
-	// 内存拷贝
-	q->queue[q->tail] = *message;
-
-	// 假溢出操作
-	if (++ q->tail >= q->cap) {
-		q->tail = 0;
+	ATOM_INC(&q->pushing);
+
+	struct mq_segment *seg = ATOM_LOAD(&q->tail);
+	for (;;) {
+		int idx = ATOM_FINC(&seg->tail);
+		if (idx < seg->cap) {
+			struct mq_slot *slot = &seg->slot[idx];
+			slot->msg = *message;			// 内存拷贝
+			ATOM_STORE(&slot->ready, 1);
+			break;
+		}
+		// 段已写满，链接一个新段（代替原来的expand_queue）
+		struct mq_segment *next = ATOM_LOAD(&seg->next);
+		if (next == NULL) {
+			struct mq_segment *ns = segment_alloc(q);
+			ns->base = seg->base + seg->cap;
+			if (ATOM_CAS_POINTER(&seg->next, NULL, ns)) {
+				next = ns;
+			} else {
+				skynet_free(ns);
+				next = ATOM_LOAD(&seg->next);
+			}
+		}
+		ATOM_CAS_POINTER(&q->tail, seg, next);
+		seg = next;
 	}
 
-	// tail追上head，表示容量满了
-	if (q->head == q->tail) {
-		expand_queue(q);
-	}
+	// ATOM_DEC 同时是一个完整的内存屏障：消息写入必须在读取 in_global 之前可见
+	ATOM_DEC(&q->pushing);
 
 	// 由标记触发的重新入队全局消息队列
 	// 标记的使用得了解调度逻辑
-	if (q->in_global == 0) {
-		q->in_global = MQ_IN_GLOBAL;
+	if (q->in_global == 0 && ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
 		skynet_globalmq_push(q);
 	}
-	
-	SPIN_UNLOCK(q)
 }
 
 void 
-skynet_mq_init() {
+skynet_mq_init(int worker, int steal) {
 	struct global_queue *q = skynet_malloc(sizeof(*q));
 	memset(q,0,sizeof(*q));
 	SPIN_INIT(q);
 	Q=q;
+
+	if (steal && worker > 1) {
+		int i;
+		struct worker_queue *w = skynet_malloc(worker * sizeof(*w));
+		memset(w,0,worker * sizeof(*w));
+		for (i=0;i<worker;i++) {
+			SPIN_INIT(&w[i].q);
+		}
+		WORKER_COUNT = worker;
+		W = w;
+	}
 }
 
 /**
@@ -286,13 +538,12 @@ skynet_mq_init() {
 */
 void 
 skynet_mq_mark_release(struct message_queue *q) {
-	SPIN_LOCK(q)
 	assert(q->release == 0);
 	q->release = 1;
-	if (q->in_global != MQ_IN_GLOBAL) {
+	ATOM_SYNC();
+	if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
 		skynet_globalmq_push(q);
 	}
-	SPIN_UNLOCK(q)
 }
 
 static void
@@ -318,13 +569,9 @@ _drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
 */
 void 
 skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
-	SPIN_LOCK(q)
-	
 	if (q->release) {
-		SPIN_UNLOCK(q)
 		_drop_queue(q, drop_func, ud);
 	} else {
 		skynet_globalmq_push(q);
-		SPIN_UNLOCK(q)
 	}
 }
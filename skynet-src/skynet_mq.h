@@ -17,11 +17,19 @@ struct skynet_message {
 // type is encoding in skynet_message.sz high 8bit
 #define MESSAGE_TYPE_SHIFT ((sizeof(size_t)-1) * 8)			// 用size_t的最高位的字节表示消息类型（MESSAGE_TYPE）
 #define MESSAGE_TYPE_MASK (SIZE_MAX >> 8)					// 所以的消息最大尺寸少了8位
+// shared payload of skynet_sendbatch, data points to the refcounted payload (see skynet_server.c)
+#define MESSAGE_SHARED ((size_t)1 << (MESSAGE_TYPE_SHIFT - 1))	// 尺寸的最高位标记共享的消息数据
 
 struct message_queue;
 
 void skynet_globalmq_push(struct message_queue * queue);
 struct message_queue * skynet_globalmq_pop(void);
+void skynet_globalmq_bind(int worker);
+int skynet_globalmq_empty(void);
+
+// called when a push makes the global mq (or a worker's local queue) non-empty
+typedef void (*globalmq_wakeup)(void *ud);
+void skynet_globalmq_wakeup(globalmq_wakeup func, void *ud);
 
 struct message_queue * skynet_mq_create(uint32_t handle);
 void skynet_mq_mark_release(struct message_queue *q);
@@ -39,6 +47,7 @@ void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
 int skynet_mq_length(struct message_queue *q);
 int skynet_mq_overload(struct message_queue *q);
 
-void skynet_mq_init();
+// steal != 0 : every worker has its own run queue and steals from peers when idle
+void skynet_mq_init(int worker, int steal);
 
 #endif
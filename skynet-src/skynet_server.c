@@ -11,6 +11,7 @@
 #include "skynet_imp.h"
 #include "skynet_log.h"
 #include "skynet_timer.h"
+#include "malloc_hook.h"
 #include "spinlock.h"
 #include "atomic.h"
 
@@ -64,9 +65,15 @@ struct skynet_context
     int session_id;                         // 消息的ID，是个累加值
     int ref;								// 引用计数
     int message_count;						// 处理过的消息数量（统计信息）
+    int quantum;                            // 每轮调度处理的消息数量，-1表示使用工作线程的权重，0表示处理整个队列
+    int dispatch_round;                     // 被调度的轮数（统计信息），message_count / dispatch_round 为平均每轮处理的消息数
+    int dispatch_batch;                     // 单轮调度处理过的最大消息数量（统计信息）
+    int arena;                              // numa模式：第一次运行该服务的工作线程所在节点的arena，-1表示未绑定
     bool init;                              // 成功初始化标记
     bool endless;                           // 消息是否堵住
     bool profile;                           // 调试信息标记
+    bool shared;                            // 回调函数不保留消息，可以直接收到 skynet_sendbatch 共享的消息数据
+    bool timerbatch;                        // 回调函数能处理合并的定时器消息，见 skynet_context_pushtimer
 
     CHECKCALLING_DECL
 };
@@ -129,6 +136,65 @@ id_to_hex(char *str, uint32_t id)
     str[9] = '\0';
 }
 
+/**
+ * skynet_sendbatch 发出的共享消息数据
+ * 每个接收者持有一个引用，最后一个接收者处理完后释放
+ * 共享消息的 msg->data 指向这个结构，msg->sz 带有 MESSAGE_SHARED 标记
+*/
+struct shared_payload
+{
+    int ref;
+    void *data;
+};
+
+static void
+shared_release(struct shared_payload *sp)
+{
+    if (ATOM_DEC(&sp->ref) == 0)
+    {
+        skynet_free(sp->data);
+        skynet_free(sp);
+    }
+}
+
+// 丢弃没有被接收的消息前的回调，见 skynet_drop_hook
+static void (*DROP_RELEASE)(void *msg, size_t sz) = NULL;
+
+void skynet_drop_hook(void (*release)(void *msg, size_t sz))
+{
+    DROP_RELEASE = release;
+    ATOM_SYNC();
+}
+
+/**
+ * 丢弃一个没有被接收的消息，sz 可以带着类型
+*/
+static void
+drop_data(void *data, size_t sz)
+{
+    if (data && DROP_RELEASE)
+    {
+        DROP_RELEASE(data, sz & MESSAGE_TYPE_MASK);
+    }
+    skynet_free(data);
+}
+
+/**
+ * 释放一个未被处理的消息的数据
+*/
+static void
+free_message(struct skynet_message *msg)
+{
+    if (msg->sz & MESSAGE_SHARED)
+    {
+        shared_release(msg->data);
+    }
+    else
+    {
+        drop_data(msg->data, msg->sz);
+    }
+}
+
 struct drop_t
 {
     uint32_t handle;
@@ -138,7 +204,7 @@ static void
 drop_message(struct skynet_message *msg, void *ud)
 {
     struct drop_t *d = ud;
-    skynet_free(msg->data);
+    free_message(msg);
     uint32_t source = d->handle;        // 这个消息所在的消息队列所属的服务句柄，即应该由这个服务处理这个消息的
     assert(source);
     // report error to the message source
@@ -179,10 +245,16 @@ skynet_context_new(const char *name, const char *param)
 
     ctx->init = false;
     ctx->endless = false;
+    ctx->shared = false;
+    ctx->timerbatch = false;
 
     ctx->cpu_cost = 0;
     ctx->cpu_start = 0;
     ctx->message_count = 0;
+    ctx->quantum = -1;
+    ctx->dispatch_round = 0;
+    ctx->dispatch_batch = 0;
+    ctx->arena = -1;
     ctx->profile = G_NODE.profile;
     // Should set to 0 first to avoid skynet_handle_retireall get an uninitialized handle
     ctx->handle = 0;
@@ -247,6 +319,24 @@ void skynet_context_grab(struct skynet_context *ctx)
     ATOM_INC(&ctx->ref);
 }
 
+/**
+ * 引用计数不为0时才增加引用
+ * 用于 skynet_handle_grab，它不加锁，看到的服务实例可能正在被释放
+*/
+int skynet_context_trygrab(struct skynet_context *ctx)
+{
+    int ref = ATOM_LOAD(&ctx->ref);
+    while (ref > 0)
+    {
+        if (ATOM_CAS(&ctx->ref, ref, ref + 1))
+        {
+            return 1;
+        }
+        ref = ATOM_LOAD(&ctx->ref);
+    }
+    return 0;
+}
+
 /**
  * 注册常驻内存的服务实例
 */
@@ -271,6 +361,8 @@ delete_context(struct skynet_context *ctx)
     skynet_module_instance_release(ctx->mod, ctx->instance);
     skynet_mq_mark_release(ctx->queue);
     CHECKCALLING_DESTROY(ctx)
+    // skynet_handle_grab 不加锁，等它们不再访问 ctx 再释放
+    skynet_handle_sync();
     skynet_free(ctx);
     context_dec();
 }
@@ -302,6 +394,45 @@ int skynet_context_push(uint32_t handle, struct skynet_message *message)
     return 0;
 }
 
+/**
+ * 同一个 tick 到期的多个定时器
+ * 服务声明了能处理时合并成一个消息：PTYPE_RESPONSE，source 和 session 为0，数据是 session 数组
+ * 否则逐个推送
+*/
+int skynet_context_pushtimer(uint32_t handle, const int session[], int n)
+{
+    struct skynet_context *ctx = skynet_handle_grab(handle);
+    if (ctx == NULL)
+    {
+        return -1;
+    }
+    struct skynet_message message;
+    message.source = 0;
+    if (ctx->timerbatch)
+    {
+        size_t sz = n * sizeof(int);
+        message.session = 0;
+        message.data = skynet_malloc(sz);
+        memcpy(message.data, session, sz);
+        message.sz = sz | (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+        skynet_mq_push(ctx->queue, &message);
+    }
+    else
+    {
+        int i;
+        for (i = 0; i < n; i++)
+        {
+            message.session = session[i];
+            message.data = NULL;
+            message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+            skynet_mq_push(ctx->queue, &message);
+        }
+    }
+    skynet_context_release(ctx);
+
+    return 0;
+}
+
 // 标记该服务的消息队列堵住了
 void skynet_context_endless(uint32_t handle)
 {
@@ -340,12 +471,42 @@ dispatch_message(struct skynet_context *ctx, struct skynet_message *msg)
     // TLS，设置了服务的handle，malloc_hook就可知是哪个服务申请内存
     pthread_setspecific(G_NODE.handle_key, (void *)(uintptr_t)(ctx->handle));
 
+    // numa模式下工作线程绑定了所在节点的arena，服务第一次运行时记住它
+    // 之后无论被哪个工作线程调度，服务的内存都从这个arena分配，处理完再绑定回线程自己的
+    if (ctx->arena < 0)
+    {
+        ctx->arena = skynet_arena_home();
+    }
+    if (ctx->arena >= 0)
+    {
+        skynet_arena_bind(ctx->arena);
+    }
+
     int type = msg->sz >> MESSAGE_TYPE_SHIFT;
     size_t sz = msg->sz & MESSAGE_TYPE_MASK;
+    void *data = msg->data;
+    struct shared_payload *sp = NULL;
+
+    if (sz & MESSAGE_SHARED)
+    {
+        sz &= ~MESSAGE_SHARED;
+        sp = msg->data;
+        data = sp->data;
+        if (!ctx->shared)
+        {
+            // 入队之后回调函数换成了可能保留消息的版本，只能给它一份拷贝
+            char *copy = skynet_malloc(sz + 1);
+            memcpy(copy, data, sz);
+            copy[sz] = '\0';
+            data = copy;
+            shared_release(sp);
+            sp = NULL;
+        }
+    }
 
     if (ctx->logfile)
     {
-        skynet_log_output(ctx->logfile, msg->source, type, msg->session, msg->data, sz);
+        skynet_log_output(ctx->logfile, msg->source, type, msg->session, data, sz);
     }
     ++ctx->message_count;
 
@@ -354,19 +515,31 @@ dispatch_message(struct skynet_context *ctx, struct skynet_message *msg)
     {
         // 如果开启分析器，需要统计cpu开销
         ctx->cpu_start = skynet_thread_time();
-        reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
+        reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, data, sz);
         uint64_t cost_time = skynet_thread_time() - ctx->cpu_start;
         ctx->cpu_cost += cost_time;
     }
     else
     {
-        reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz);
+        reserve_msg = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, data, sz);
+    }
+    if (sp)
+    {
+        if (reserve_msg)
+        {
+            skynet_error(ctx, "Can't reserve a shared message from %x", msg->source);
+        }
+        shared_release(sp);
     }
-    if (!reserve_msg)
+    else if (!reserve_msg)
     {
         // 一般callback返回0
         // 保留消息的情况，见于service_gate.c lua-skynet.c
-        skynet_free(msg->data);
+        skynet_free(data);
+    }
+    if (ctx->arena >= 0)
+    {
+        skynet_arena_restore();
     }
     CHECKCALLING_END(ctx)
 }
@@ -385,6 +558,22 @@ void skynet_context_dispatchall(struct skynet_context *ctx)
     }
 }
 
+/**
+ * 统计一轮调度处理的消息数量
+ * 只有持有该服务消息队列的工作线程会调用，不需要原子操作
+*/
+static inline void
+dispatch_stat(struct skynet_context *ctx, int n)
+{
+    if (n == 0)
+        return;
+    ++ctx->dispatch_round;
+    if (n > ctx->dispatch_batch)
+    {
+        ctx->dispatch_batch = n;
+    }
+}
+
 /**
  * woker线程的主要工作：消息循环的一个步骤
 */
@@ -422,15 +611,29 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
         {
             // 消息队列为空，就不打算将其放回去了
             // 仅恢复引用计数
+            dispatch_stat(ctx, i);
             skynet_context_release(ctx);
             return skynet_globalmq_pop();
         }
-        else if (i == 0 && weight >= 0)
+        else if (i == 0)
         {
             // 在处理第1个消息之前，重新调整要处理的消息数量
-            // n = 消息队列有效长度 / (2^weight)
-            n = skynet_mq_length(q);
-            n >>= weight;
+            // 服务设置了 quantum 时优先于工作线程的权重
+            int quantum = ctx->quantum;
+            if (quantum > 0)
+            {
+                n = quantum;
+            }
+            else if (quantum == 0)
+            {
+                n = skynet_mq_length(q);
+            }
+            else if (weight >= 0)
+            {
+                // n = 消息队列有效长度 / (2^weight)
+                n = skynet_mq_length(q);
+                n >>= weight;
+            }
         }
 
         // 超载报警
@@ -445,7 +648,7 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 
         if (ctx->cb == NULL)
         {
-            skynet_free(msg.data);
+            free_message(&msg);
         }
         else
         {
@@ -457,6 +660,7 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
         skynet_monitor_trigger(sm, 0, 0);
     }
 
+    dispatch_stat(ctx, i);
     assert(q == ctx->queue);
     struct message_queue *nq = skynet_globalmq_pop();
     if (nq)
@@ -500,6 +704,12 @@ skynet_queryname(struct skynet_context *context, const char *name)
     return 0;
 }
 
+unsigned int
+skynet_queryname_version(void)
+{
+    return skynet_handle_nameversion();
+}
+
 /**
  * 下线某个服务。
  * 如果handle为0，就是杀掉自己。
@@ -545,6 +755,35 @@ cmd_timeout(struct skynet_context *context, const char *param)
     return context->result;
 }
 
+/**
+ * 毫秒为单位的定时器，精度取决于配置项 timer_resolution
+*/
+static const char *
+cmd_mtimeout(struct skynet_context *context, const char *param)
+{
+    char *session_ptr = NULL;
+    int ti = strtol(param, &session_ptr, 10);
+    int session = skynet_context_newsession(context);
+    skynet_timeout_ms(context->handle, ti, session);
+    sprintf(context->result, "%d", session);
+    return context->result;
+}
+
+/**
+ * 取消本服务的定时器，成功返回 session，已经到期返回NULL
+*/
+static const char *
+cmd_canceltimeout(struct skynet_context *context, const char *param)
+{
+    int session = strtol(param, NULL, 10);
+    if (skynet_timeout_cancel(context->handle, session))
+    {
+        return NULL;
+    }
+    sprintf(context->result, "%d", session);
+    return context->result;
+}
+
 /**
  * 获取服务实例的句柄
  * 或者设置别名
@@ -614,7 +853,13 @@ cmd_name(struct skynet_context *context, const char *param)
     }
     if (name[0] == '.')
     {
-        return skynet_handle_namehandle(handle_id, name + 1);
+        // name 在栈上，返回前复制到 result 里（过长的别名只截断返回值）
+        if (skynet_handle_namehandle(handle_id, name + 1) == NULL)
+        {
+            return NULL;
+        }
+        snprintf(context->result, sizeof(context->result), "%s", name + 1);
+        return context->result;
     }
     else
     {
@@ -824,6 +1069,14 @@ cmd_stat(struct skynet_context *context, const char *param)
     {
         sprintf(context->result, "%d", context->message_count);
     }
+    else if (strcmp(param, "round") == 0)
+    {
+        sprintf(context->result, "%d", context->dispatch_round);
+    }
+    else if (strcmp(param, "batch") == 0)
+    {
+        sprintf(context->result, "%d", context->dispatch_batch);
+    }
     else
     {
         context->result[0] = '\0';
@@ -831,6 +1084,26 @@ cmd_stat(struct skynet_context *context, const char *param)
     return context->result;
 }
 
+/**
+ * 设置每轮调度处理的消息数量，覆盖工作线程的权重
+ * param格式：
+ * n>0 每轮最多处理n个消息（如延迟敏感的agent设为1）
+ * 0   每轮处理整个队列（如gate、logger）
+ * -1  恢复使用工作线程的权重
+ * param为空时仅返回当前值
+*/
+static const char *
+cmd_quantum(struct skynet_context *context, const char *param)
+{
+    if (param && param[0] != '\0')
+    {
+        int quantum = strtol(param, NULL, 10);
+        context->quantum = quantum < 0 ? -1 : quantum;
+    }
+    sprintf(context->result, "%d", context->quantum);
+    return context->result;
+}
+
 static const char *
 cmd_logon(struct skynet_context *context, const char *param)
 {
@@ -907,6 +1180,8 @@ cmd_signal(struct skynet_context *context, const char *param)
 */
 static struct command_func cmd_funcs[] = {
     {"TIMEOUT", cmd_timeout},
+    {"MTIMEOUT", cmd_mtimeout},
+    {"CANCELTIMEOUT", cmd_canceltimeout},
     {"REG", cmd_reg},
     {"QUERY", cmd_query},
     {"NAME", cmd_name},
@@ -922,6 +1197,7 @@ static struct command_func cmd_funcs[] = {
     {"LOGON", cmd_logon},
     {"LOGOFF", cmd_logoff},
     {"SIGNAL", cmd_signal},
+    {"QUANTUM", cmd_quantum},
     {NULL, NULL},
 };
 
@@ -994,7 +1270,7 @@ int skynet_send(struct skynet_context *context, uint32_t source, uint32_t destin
         skynet_error(context, "The message to %x is too large", destination);
         if (type & PTYPE_TAG_DONTCOPY)
         {
-            skynet_free(data);
+            drop_data(data, sz);
         }
         return -2;
     }
@@ -1010,7 +1286,7 @@ int skynet_send(struct skynet_context *context, uint32_t source, uint32_t destin
         if (data)
         {
             skynet_error(context, "Destination address can't be 0");
-            skynet_free(data);
+            drop_data(data, sz);
             return -1;
         }
 
@@ -1035,7 +1311,7 @@ int skynet_send(struct skynet_context *context, uint32_t source, uint32_t destin
 
         if (skynet_context_push(destination, &smsg))
         {
-            skynet_free(data);
+            drop_data(data, sz);
             return -1;
         }
     }
@@ -1067,7 +1343,7 @@ int skynet_sendname(struct skynet_context *context, uint32_t source, const char
         {
             if (type & PTYPE_TAG_DONTCOPY)
             {
-                skynet_free(data);
+                drop_data(data, sz);
             }
             return -1;
         }
@@ -1100,6 +1376,94 @@ int skynet_sendname(struct skynet_context *context, uint32_t source, const char
     return skynet_send(context, source, des, type, session, data, sz);
 }
 
+/**
+ * 向一组服务发送同一个消息
+ * 消息数据只拷贝一次（PTYPE_TAG_DONTCOPY 时不拷贝），声明了不保留消息的本地接收者共享这份数据，
+ * 其它接收者（远程服务，或可能保留消息的服务）各自拿到一份拷贝
+ * session 原样发给每个接收者，不支持 PTYPE_TAG_ALLOCSESSION
+*/
+int skynet_sendbatch(struct skynet_context *context, uint32_t source, const uint32_t destination[], int n, int type, int session, void *data, size_t sz)
+{
+    if ((sz & MESSAGE_TYPE_MASK & ~MESSAGE_SHARED) != sz)
+    {
+        skynet_error(context, "The batch message is too large");
+        if (type & PTYPE_TAG_DONTCOPY)
+        {
+            skynet_free(data);
+        }
+        return -2;
+    }
+    if (source == 0)
+    {
+        source = context->handle;
+    }
+    if (data && !(type & PTYPE_TAG_DONTCOPY))
+    {
+        char *msg = skynet_malloc(sz + 1);
+        memcpy(msg, data, sz);
+        msg[sz] = '\0';
+        data = msg;
+    }
+    type &= 0xff;
+
+    // 发送过程中自己持有一个引用，防止前面的接收者处理完就把数据释放了
+    struct shared_payload *sp = skynet_malloc(sizeof(*sp));
+    sp->ref = 1;
+    sp->data = data;
+
+    int i;
+    int count = 0;
+    for (i = 0; i < n; i++)
+    {
+        uint32_t des = destination[i];
+        if (des == 0)
+        {
+            continue;
+        }
+        if (skynet_harbor_message_isremote(des))
+        {
+            // 远程服务交给 harbor，需要独立的一份数据
+            if (skynet_send(context, source, des, type, session, data, sz) >= 0)
+            {
+                ++count;
+            }
+            continue;
+        }
+        struct skynet_context *ctx = skynet_handle_grab(des);
+        if (ctx == NULL)
+        {
+            continue;
+        }
+        struct skynet_message smsg;
+        smsg.source = source;
+        smsg.session = session;
+        if (data && ctx->shared)
+        {
+            ATOM_INC(&sp->ref);
+            smsg.data = sp;
+            smsg.sz = sz | MESSAGE_SHARED | (size_t)type << MESSAGE_TYPE_SHIFT;
+        }
+        else
+        {
+            char *msg = NULL;
+            if (data)
+            {
+                msg = skynet_malloc(sz + 1);
+                memcpy(msg, data, sz);
+                msg[sz] = '\0';
+            }
+            smsg.data = msg;
+            smsg.sz = sz | (size_t)type << MESSAGE_TYPE_SHIFT;
+        }
+        skynet_mq_push(ctx->queue, &smsg);
+        skynet_context_release(ctx);
+        ++count;
+    }
+    shared_release(sp);
+
+    return count;
+}
+
 uint32_t
 skynet_context_handle(struct skynet_context *ctx)
 {
@@ -1110,6 +1474,18 @@ void skynet_callback(struct skynet_context *context, void *ud, skynet_cb cb)
 {
     context->cb = cb;
     context->cb_ud = ud;
+    context->shared = false;
+    context->timerbatch = false;
+}
+
+void skynet_callback_shared(struct skynet_context *context, int enable)
+{
+    context->shared = enable ? true : false;
+}
+
+void skynet_callback_timerbatch(struct skynet_context *context, int enable)
+{
+    context->timerbatch = enable ? true : false;
 }
 
 void skynet_context_send(struct skynet_context *ctx, void *msg, size_t sz, uint32_t source, int type, int session)
@@ -5,33 +5,174 @@
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_harbor.h"
+#include "atomic.h"
+#include "spinlock.h"
+#include "sharebuffer.h"
+#include "malloc_hook.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-static struct socket_server * SOCKET_SERVER = NULL;
+#define MAX_SOCKET_THREAD 16
 
-void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create(skynet_now());
+/**
+ * 分片监听：每个分片各自用 SO_REUSEPORT 监听同一端口，由内核分发连接
+ * 服务只看到主监听 id，start/close 时由这里带上其余分片的副本
+*/
+struct listen_group {
+	struct listen_group *next;
+	int id;								// 主监听 id（分片0）
+	int n;
+	int replica[MAX_SOCKET_THREAD];		// 其余分片上的副本 id
+};
+
+// 每个 socket 线程一个 socket_server，id % SOCKET_SHARD 即所在分片
+static struct socket_server * SOCKET_SERVER[MAX_SOCKET_THREAD];
+static int SOCKET_SHARD = 0;
+static int SOCKET_NEXT = 0;			// 新建 socket 轮流分配到各分片
+
+static struct spinlock GROUP_LOCK;
+static struct listen_group * LISTEN_GROUP = NULL;
+
+#define SHARD(id) SOCKET_SERVER[(unsigned)(id) % SOCKET_SHARD]
+
+static inline struct socket_server *
+next_shard() {
+	if (SOCKET_SHARD == 1) {
+		return SOCKET_SERVER[0];
+	}
+	return SOCKET_SERVER[(unsigned)ATOM_FINC(&SOCKET_NEXT) % SOCKET_SHARD];
+}
+
+// 发送时 sz == -1 表示 buffer 是 sharebuffer，socket 线程直接发它的内容，发完释放一个引用
+static void *
+sharebuffer_buffer(void *object) {
+	struct sharebuffer * sb = object;
+	return sb->msg;
+}
+
+static int
+sharebuffer_size(void *object) {
+	struct sharebuffer * sb = object;
+	return sb->sz;
+}
+
+static void
+sharebuffer_free(void *object) {
+	sharebuffer_release(object);
+}
+
+int
+skynet_socket_init(int thread, const char * backend) {
+	if (thread < 1) {
+		thread = 1;
+	} else if (thread > MAX_SOCKET_THREAD) {
+		thread = MAX_SOCKET_THREAD;
+	}
+	int uring = backend && strcmp(backend, "io_uring") == 0;
+	struct socket_object_interface soi = {
+		sharebuffer_buffer,
+		sharebuffer_size,
+		sharebuffer_free,
+	};
+	int i;
+	for (i=0;i<thread;i++) {
+		SOCKET_SERVER[i] = socket_server_create(skynet_now(), i, thread);
+		if (SOCKET_SERVER[i] == NULL) {
+			// 至少保留一个分片
+			if (i == 0) {
+				return 0;
+			}
+			thread = i;
+			break;
+		}
+		socket_server_userobject(SOCKET_SERVER[i], &soi);
+		if (uring && socket_server_uring(SOCKET_SERVER[i])) {
+			// 失败通常是内核不支持，其余分片不再尝试
+			uring = 0;
+		}
+	}
+	SOCKET_SHARD = thread;
+	spinlock_init(&GROUP_LOCK);
+	// 进程内只有一个钩子，所有分片共用
+	skynet_pool_hook(socket_server_pool_release);
+	return thread;
 }
 
 void
 skynet_socket_exit() {
-	socket_server_exit(SOCKET_SERVER);
+	int i;
+	for (i=0;i<SOCKET_SHARD;i++) {
+		socket_server_exit(SOCKET_SERVER[i]);
+	}
 }
 
 void
 skynet_socket_free() {
-	socket_server_release(SOCKET_SERVER);
-	SOCKET_SERVER = NULL;
+	int i;
+	// 之后还没被服务释放的读缓冲直接走普通的 free
+	skynet_pool_hook(NULL);
+	for (i=0;i<SOCKET_SHARD;i++) {
+		socket_server_release(SOCKET_SERVER[i]);
+		SOCKET_SERVER[i] = NULL;
+	}
+	SOCKET_SHARD = 0;
+	while (LISTEN_GROUP) {
+		struct listen_group *g = LISTEN_GROUP;
+		LISTEN_GROUP = g->next;
+		skynet_free(g);
+	}
+	spinlock_destroy(&GROUP_LOCK);
 }
 
 void
 skynet_socket_updatetime() {
-	socket_server_updatetime(SOCKET_SERVER, skynet_now());
+	uint64_t now = skynet_now();
+	int i;
+	for (i=0;i<SOCKET_SHARD;i++) {
+		socket_server_updatetime(SOCKET_SERVER[i], now);
+	}
+}
+
+// 取出 id 对应的分片监听组（从表中摘除），非分片监听返回 NULL
+static struct listen_group *
+group_remove(int id) {
+	if (LISTEN_GROUP == NULL) {
+		return NULL;
+	}
+	spinlock_lock(&GROUP_LOCK);
+	struct listen_group **pg = &LISTEN_GROUP;
+	struct listen_group *g;
+	while ((g = *pg)) {
+		if (g->id == id) {
+			*pg = g->next;
+			break;
+		}
+		pg = &g->next;
+	}
+	spinlock_unlock(&GROUP_LOCK);
+	return g;
+}
+
+static void
+group_start(uint32_t source, int id) {
+	if (LISTEN_GROUP == NULL) {
+		return;
+	}
+	spinlock_lock(&GROUP_LOCK);
+	struct listen_group *g;
+	for (g = LISTEN_GROUP; g; g = g->next) {
+		if (g->id == id) {
+			int i;
+			for (i=0;i<g->n;i++) {
+				socket_server_start(SHARD(g->replica[i]), source, g->replica[i]);
+			}
+			break;
+		}
+	}
+	spinlock_unlock(&GROUP_LOCK);
 }
 
 // mainloop thread
@@ -76,8 +217,8 @@ forward_message(int type, bool padding, struct socket_message * result) {
 }
 
 int 
-skynet_socket_poll() {
-	struct socket_server *ss = SOCKET_SERVER;
+skynet_socket_poll(int shard) {
+	struct socket_server *ss = SOCKET_SERVER[shard];
 	assert(ss);
 	struct socket_message result;
 	int more = 1;
@@ -106,6 +247,9 @@ skynet_socket_poll() {
 	case SOCKET_WARNING:
 		forward_message(SKYNET_SOCKET_TYPE_WARNING, false, &result);
 		break;
+	case SOCKET_UDPBATCH:
+		forward_message(SKYNET_SOCKET_TYPE_UDPBATCH, false, &result);
+		break;
 	default:
 		skynet_error(NULL, "Unknown socket message type %d.",type);
 		return -1;
@@ -118,69 +262,132 @@ skynet_socket_poll() {
 
 int
 skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz) {
-	return socket_server_send(SOCKET_SERVER, id, buffer, sz);
+	return socket_server_send(SHARD(id), id, buffer, sz);
 }
 
 int
 skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer, int sz) {
-	return socket_server_send_lowpriority(SOCKET_SERVER, id, buffer, sz);
+	return socket_server_send_lowpriority(SHARD(id), id, buffer, sz);
+}
+
+int
+skynet_socket_sendv(struct skynet_context *ctx, int id, const struct socket_iovec *v, int n) {
+	return socket_server_sendv(SHARD(id), id, v, n);
+}
+
+int
+skynet_socket_sendfile(struct skynet_context *ctx, int id, int fd, int64_t offset, int64_t len) {
+	return socket_server_sendfile(SHARD(id), id, fd, offset, len);
 }
 
 int 
 skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
+	if (SOCKET_SHARD == 1 || port == 0) {
+		// 随机端口无法让多个分片监听同一端口
+		return socket_server_listen(next_shard(), source, host, port, backlog);
+	}
+	int id = socket_server_listen_reuseport(SOCKET_SERVER[0], source, host, port, backlog, -1);
+	if (id < 0) {
+		return id;
+	}
+	struct listen_group *g = skynet_malloc(sizeof(*g));
+	g->id = id;
+	g->n = 0;
+	int i;
+	for (i=1;i<SOCKET_SHARD;i++) {
+		int replica = socket_server_listen_reuseport(SOCKET_SERVER[i], source, host, port, backlog, id);
+		if (replica >= 0) {
+			g->replica[g->n++] = replica;
+		}
+	}
+	if (g->n == 0) {
+		skynet_free(g);
+		return id;
+	}
+	spinlock_lock(&GROUP_LOCK);
+	g->next = LISTEN_GROUP;
+	LISTEN_GROUP = g;
+	spinlock_unlock(&GROUP_LOCK);
+	return id;
 }
 
 int 
 skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_connect(SOCKET_SERVER, source, host, port);
+	return socket_server_connect(next_shard(), source, host, port);
 }
 
 int 
 skynet_socket_bind(struct skynet_context *ctx, int fd) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_bind(SOCKET_SERVER, source, fd);
+	return socket_server_bind(next_shard(), source, fd);
 }
 
 void 
 skynet_socket_close(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_close(SOCKET_SERVER, source, id);
+	struct listen_group *g = group_remove(id);
+	if (g) {
+		int i;
+		for (i=0;i<g->n;i++) {
+			socket_server_close(SHARD(g->replica[i]), source, g->replica[i]);
+		}
+		skynet_free(g);
+	}
+	socket_server_close(SHARD(id), source, id);
 }
 
 void 
 skynet_socket_shutdown(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_shutdown(SOCKET_SERVER, source, id);
+	struct listen_group *g = group_remove(id);
+	if (g) {
+		int i;
+		for (i=0;i<g->n;i++) {
+			socket_server_shutdown(SHARD(g->replica[i]), source, g->replica[i]);
+		}
+		skynet_free(g);
+	}
+	socket_server_shutdown(SHARD(id), source, id);
 }
 
 void 
 skynet_socket_start(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_start(SOCKET_SERVER, source, id);
+	group_start(source, id);
+	socket_server_start(SHARD(id), source, id);
 }
 
 void
 skynet_socket_nodelay(struct skynet_context *ctx, int id) {
-	socket_server_nodelay(SOCKET_SERVER, id);
+	socket_server_nodelay(SHARD(id), id);
+}
+
+void
+skynet_socket_watermark(struct skynet_context *ctx, int id, int64_t high, int64_t low, int64_t limit, int policy) {
+	socket_server_watermark(SHARD(id), id, high, low, limit, policy);
+}
+
+void
+skynet_socket_udpbatch(struct skynet_context *ctx, int id, int enable) {
+	socket_server_udpbatch(SHARD(id), id, enable);
 }
 
 int 
 skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_udp(SOCKET_SERVER, source, addr, port);
+	return socket_server_udp(next_shard(), source, addr, port);
 }
 
 int 
 skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port) {
-	return socket_server_udp_connect(SOCKET_SERVER, id, addr, port);
+	return socket_server_udp_connect(SHARD(id), id, addr, port);
 }
 
 int 
 skynet_socket_udp_send(struct skynet_context *ctx, int id, const char * address, const void *buffer, int sz) {
-	return socket_server_udp_send(SOCKET_SERVER, id, (const struct socket_udp_address *)address, buffer, sz);
+	return socket_server_udp_send(SHARD(id), id, (const struct socket_udp_address *)address, buffer, sz);
 }
 
 const char *
@@ -193,10 +400,23 @@ skynet_socket_udp_address(struct skynet_socket_message *msg, int *addrsz) {
 	sm.opaque = 0;
 	sm.ud = msg->ud;
 	sm.data = msg->buffer;
-	return (const char *)socket_server_udp_address(SOCKET_SERVER, &sm, addrsz);
+	return (const char *)socket_server_udp_address(SHARD(sm.id), &sm, addrsz);
 }
 
 struct socket_info *
 skynet_socket_info() {
-	return socket_server_info(SOCKET_SERVER);
+	struct socket_info *si = NULL;
+	int i;
+	for (i=SOCKET_SHARD-1;i>=0;i--) {
+		struct socket_info *s = socket_server_info(SOCKET_SERVER[i]);
+		if (s) {
+			struct socket_info *tail = s;
+			while (tail->next) {
+				tail = tail->next;
+			}
+			tail->next = si;
+			si = s;
+		}
+	}
+	return si;
 }
@@ -2,6 +2,7 @@
 #define skynet_socket_h
 
 #include "socket_info.h"
+#include "socket_buffer.h"
 
 struct skynet_context;
 
@@ -12,6 +13,7 @@ struct skynet_context;
 #define SKYNET_SOCKET_TYPE_ERROR 5
 #define SKYNET_SOCKET_TYPE_UDP 6
 #define SKYNET_SOCKET_TYPE_WARNING 7
+#define SKYNET_SOCKET_TYPE_UDPBATCH 8	// buffer 里是多个 udp 包，ud 为 buffer 总长度；只发给用 skynet_socket_udpbatch 打开的 socket
 
 struct skynet_socket_message {
 	int type;
@@ -20,14 +22,18 @@ struct skynet_socket_message {
 	char * buffer;
 };
 
-void skynet_socket_init();
+// thread : socket 线程（分片）数量，返回实际创建的分片数
+int skynet_socket_init(int thread, const char * backend);
 void skynet_socket_exit();
 void skynet_socket_free();
-int skynet_socket_poll();
+int skynet_socket_poll(int shard);
 void skynet_socket_updatetime();
 
+// sz == -1 时 buffer 是 struct sharebuffer *（见 sharebuffer.h），发送接管调用者的一个引用
 int skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz);
 int skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer, int sz);
+int skynet_socket_sendv(struct skynet_context *ctx, int id, const struct socket_iovec *v, int n);
+int skynet_socket_sendfile(struct skynet_context *ctx, int id, int fd, int64_t offset, int64_t len);
 int skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog);
 int skynet_socket_connect(struct skynet_context *ctx, const char *host, int port);
 int skynet_socket_bind(struct skynet_context *ctx, int fd);
@@ -35,8 +41,10 @@ void skynet_socket_close(struct skynet_context *ctx, int id);
 void skynet_socket_shutdown(struct skynet_context *ctx, int id);
 void skynet_socket_start(struct skynet_context *ctx, int id);
 void skynet_socket_nodelay(struct skynet_context *ctx, int id);
+void skynet_socket_watermark(struct skynet_context *ctx, int id, int64_t high, int64_t low, int64_t limit, int policy);
 
 int skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port);
+void skynet_socket_udpbatch(struct skynet_context *ctx, int id, int enable);
 int skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port);
 int skynet_socket_udp_send(struct skynet_context *ctx, int id, const char * address, const void *buffer, int sz);
 const char * skynet_socket_udp_address(struct skynet_socket_message *, int *addrsz);
@@ -9,6 +9,9 @@
 #include "skynet_socket.h"
 #include "skynet_daemon.h"
 #include "skynet_harbor.h"
+#include "skynet_affinity.h"
+#include "malloc_hook.h"
+#include "atomic.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -26,6 +29,10 @@ struct monitor {
 	pthread_mutex_t mutex;
 	int sleep;					  // 休眠中的工作线程数量
 	int quit;					  // 退出标记
+	int spin;					  // 休眠前空转检查消息队列的次数
+	int wakeup;					  // push 使队列非空时唤醒休眠的工作线程（否则只靠计时器轮询）
+	const char * socket_cpu;	  // socket线程绑定的CPU集合
+	const char * timer_cpu;		  // 计时器线程绑定的CPU集合
 };
 ////////////////////////////////////
 
@@ -33,8 +40,18 @@ struct worker_parm {
 	struct monitor *m;			// 工作线程监视器管理器
 	int id;						// 工作线程序号
 	int weight;					// 权重
+	int cpu;					// 绑定的CPU，-1表示不绑定
+	int arena;					// numa模式下所在节点的arena，-1表示默认
 };
 
+struct socket_parm {
+	struct monitor *m;
+	int shard;					// socket线程序号，对应一个socket_server分片
+};
+
+#define MAX_CPU 1024
+#define MAX_NUMA_NODE 64
+
 static volatile int SIG = 0;
 
 /**
@@ -56,6 +73,20 @@ handle_hup(int signal) {
 
 #define CHECK_ABORT if (skynet_context_total()==0) break;
 
+/**
+ * 将当前线程绑定到配置的CPU集合上（如 socket_cpu = "15"）
+*/
+static void
+bind_cpuset(const char *name, const char *cpuset) {
+	if (cpuset == NULL)
+		return;
+	int cpus[MAX_CPU];
+	int n = skynet_cpuset_parse(cpuset, cpus, MAX_CPU);
+	if (n == 0 || skynet_affinity_bind(cpus, n)) {
+		fprintf(stderr, "Bind %s thread to cpu %s failed\n", name, cpuset);
+	}
+}
+
 static void
 create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 	if (pthread_create(thread,NULL, start_routine, arg)) {
@@ -79,15 +110,36 @@ wakeup(struct monitor *m, int busy) {
 	}
 }
 
+/**
+ * 全局消息队列由空变为非空时调用（见 skynet_globalmq_wakeup）
+ * 必须在持有 mutex 时 signal：工作线程在 ++sleep 之后、cond_wait 之前会再检查一次队列，
+ * 持锁保证 signal 不会落在这两步之间而丢失
+*/
+static void
+wakeup_push(void *ud) {
+	struct monitor *m = ud;
+	ATOM_SYNC();
+	if (m->sleep > 0) {
+		pthread_mutex_lock(&m->mutex);
+		if (m->sleep > 0) {
+			pthread_cond_signal(&m->cond);
+		}
+		pthread_mutex_unlock(&m->mutex);
+	}
+}
+
 /**
  * socket线程居然是轮询
+ * 配置多个socket线程时，每个线程轮询自己的分片（独立的 epoll 与控制管道）
 */
 static void *
 thread_socket(void *p) {
-	struct monitor * m = p;
+	struct socket_parm *sp = p;
+	struct monitor * m = sp->m;
 	skynet_initthread(THREAD_SOCKET);
+	bind_cpuset("socket", m->socket_cpu);
 	for (;;) {
-		int r = skynet_socket_poll();
+		int r = skynet_socket_poll(sp->shard);
 		if (r==0)
 			break;
 		if (r<0) {
@@ -155,12 +207,17 @@ static void *
 thread_timer(void *p) {
 	struct monitor * m = p;
 	skynet_initthread(THREAD_TIMER);
+	bind_cpuset("timer", m->timer_cpu);
+	// 每个 tick 检查4次
+	int interval = skynet_timer_resolution() * 250;
 	for (;;) {
 		skynet_updatetime();
 		skynet_socket_updatetime();
 		CHECK_ABORT
-		wakeup(m,m->count-1);			// 确保工作线程满负荷运行
-		usleep(2500);					// 每2500微妙/2.5毫秒跑一次, 每4次for循环计数一次
+		if (!m->wakeup || !skynet_globalmq_empty()) {
+			wakeup(m,m->count-1);		// 确保工作线程满负荷运行；push 唤醒开启时只在队列非空时兜底
+		}
+		usleep(interval);				// 默认每2500微妙/2.5毫秒跑一次, 每4次for循环 tick 一次
 		if (SIG) {
 			signal_hup();
 			SIG = 0;
@@ -187,18 +244,32 @@ thread_worker(void *p) {
 	struct monitor *m = wp->m;				// 监视管理器
 	struct skynet_monitor *sm = m->m[id];	// 监视器
 	skynet_initthread(THREAD_WORKER);
+	if (wp->cpu >= 0 && skynet_affinity_bind(&wp->cpu, 1)) {
+		fprintf(stderr, "Bind worker %d to cpu %d failed\n", id, wp->cpu);
+	}
+	skynet_arena_sethome(wp->arena);		// 之后该线程（以及第一次在这里运行的服务）的内存从本节点的arena分配
+	skynet_globalmq_bind(id);				// steal 模式下绑定本地队列
 	struct message_queue * q = NULL;
 
 	// 主循环
 	while (!m->quit) {
 		q = skynet_context_message_dispatch(sm, q, weight);
 		if (q == NULL) {
+			// 全局消息队列是空的，先空转几次，新消息往往很快就到
+			int i;
+			for (i=0;i<m->spin && q == NULL;i++) {
+				q = skynet_context_message_dispatch(sm, q, weight);
+			}
+			if (q)
+				continue;
 			// 全局消息队列是空的，工作线程将所有消息都处理完后会变成这样
 			if (pthread_mutex_lock(&m->mutex) == 0) {
 				++ m->sleep;						// 工作线程：没有工作单了么？那我睡一会
+				ATOM_SYNC();
 				// "spurious wakeup" is harmless,
 				// because skynet_context_message_dispatch() can be call at any time.
-				if (!m->quit)
+				// 登记休眠之后再看一眼队列，与 wakeup_push 配合避免丢失唤醒
+				if (!m->quit && (!m->wakeup || skynet_globalmq_empty()))
 					pthread_cond_wait(&m->cond, &m->mutex);
 				-- m->sleep;
 				if (pthread_mutex_unlock(&m->mutex)) {
@@ -211,18 +282,84 @@ thread_worker(void *p) {
 	return NULL;
 }
 
+/**
+ * 解析配置中的权重表，如 "-1,-1,0,0,1,1,2,2"
+ * 配置的数量不足时，剩下的工作线程权重为0
+*/
+static void
+parse_weight(const char *str, int weight[], int thread) {
+	int i;
+	for (i=0;i<thread;i++) {
+		char *endptr = NULL;
+		while (*str == ',' || *str == ' ' || *str == '\t') {
+			++str;
+		}
+		long w = strtol(str, &endptr, 10);
+		if (endptr == str) {
+			break;
+		}
+		if (w < -1) {
+			w = -1;
+		}
+		weight[i] = (int)w;
+		str = endptr;
+	}
+	for (;i<thread;i++) {
+		weight[i] = 0;
+	}
+}
+
+/**
+ * 按 worker_cpu 给每个工作线程分配CPU
+ * numa模式下，为工作线程用到的每个节点创建一个arena
+*/
+static void
+worker_placement(struct worker_parm wp[], int thread, const char *worker_cpu, int numa) {
+	int cpus[MAX_CPU];
+	int n = 0;
+	int i;
+	if (worker_cpu) {
+		n = skynet_cpuset_parse(worker_cpu, cpus, MAX_CPU);
+	}
+	if (numa && n == 0) {
+		fprintf(stderr, "numa mode needs worker_cpu, ignore it\n");
+		numa = 0;
+	}
+	int arena[MAX_NUMA_NODE];
+	for (i=0;i<MAX_NUMA_NODE;i++) {
+		arena[i] = -1;
+	}
+	for (i=0;i<thread;i++) {
+		wp[i].cpu = n > 0 ? cpus[i % n] : -1;
+		wp[i].arena = -1;
+		if (numa) {
+			int node = skynet_cpu_node(wp[i].cpu) % MAX_NUMA_NODE;
+			if (arena[node] < 0) {
+				arena[node] = skynet_arena_create();
+			}
+			wp[i].arena = arena[node];
+		}
+	}
+}
+
 /**
  * 线程模型在这里初始化
 */
 static void
-start(int thread) {
-	pthread_t pid[thread+3];
+start(struct skynet_config * config, int socket_thread) {
+	int thread = config->thread;
+	const char *weight_config = config->weight;
+	pthread_t pid[thread+2+socket_thread];
 
 	////////////////////////////////////////// 监视器管理器，线程模型成功初始化销毁
 	struct monitor *m = skynet_malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
 	m->count = thread;
 	m->sleep = 0;
+	m->spin = config->worker_spin;
+	m->wakeup = config->worker_wakeup;
+	m->socket_cpu = config->socket_cpu;
+	m->timer_cpu = config->timer_cpu;
 
 	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
 	int i;
@@ -237,12 +374,20 @@ start(int thread) {
 		fprintf(stderr, "Init cond error");
 		exit(1);
 	}
+	if (m->wakeup) {
+		skynet_globalmq_wakeup(wakeup_push, m);
+	}
 
-	// 为什么要thread+3，因为0/1/2有特殊用途
+	// 0/1 为监视器与计时器，随后是 socket_thread 个网络线程，最后是工作线程
 	// thread仅代表woker线程数量
 	create_thread(&pid[0], thread_monitor, m);			// 监视器
 	create_thread(&pid[1], thread_timer, m);			// 计时器
-	create_thread(&pid[2], thread_socket, m);			// 网络
+	struct socket_parm sp[socket_thread];
+	for (i=0;i<socket_thread;i++) {
+		sp[i].m = m;
+		sp[i].shard = i;
+		create_thread(&pid[i+2], thread_socket, &sp[i]);	// 网络
+	}
 
 	/**
 	 * 权重分 5 级：代表消息循环的每一步（从全局消息队列pop，再到push之间）处理的消息数量n与消息队列有效长度length的关系
@@ -257,24 +402,32 @@ start(int thread) {
 		1, 1, 1, 1, 1, 1, 1, 1, 
 		2, 2, 2, 2, 2, 2, 2, 2, 
 		3, 3, 3, 3, 3, 3, 3, 3, };
-	struct worker_parm wp[thread];						// 工作线程启动例程的参数：监视管理器，序号，权重
+	int config_weight[thread];							// 配置文件中的权重表（weight），覆盖内置的表
+	if (weight_config) {
+		parse_weight(weight_config, config_weight, thread);
+	}
+	struct worker_parm wp[thread];						// 工作线程启动例程的参数：监视管理器，序号，权重，CPU
+	worker_placement(wp, thread, config->worker_cpu, config->numa);
 	for (i=0;i<thread;i++) {
 		wp[i].m = m;
 		wp[i].id = i;
-		if (i < sizeof(weight)/sizeof(weight[0])) {
+		if (weight_config) {
+			wp[i].weight = config_weight[i];
+		} else if (i < sizeof(weight)/sizeof(weight[0])) {
 			wp[i].weight= weight[i];
 		} else {
 			wp[i].weight = 0;
 		}
-		create_thread(&pid[i+3], thread_worker, &wp[i]);
+		create_thread(&pid[i+2+socket_thread], thread_worker, &wp[i]);
 	}
 
 	// 阻塞主进程，等待这几个线程返回
 	// 每个worker线程都有个主循环，所以在这一刻，整个线程模型开始工作了
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<thread+2+socket_thread;i++) {
 		pthread_join(pid[i], NULL); 
 	}
 
+	skynet_globalmq_wakeup(NULL, NULL);
 	free_monitor(m);
 }
 
@@ -315,14 +468,22 @@ skynet_start(struct skynet_config * config) {
 	skynet_harbor_init(config->harbor);
 	// 2. 全局服务实例句柄存储
 	skynet_handle_init(config->harbor);
-	// 3. 全局消息队列
-	skynet_mq_init();
+	// 3. 全局消息队列（steal 模式下还有每个工作线程的本地队列）
+	int steal = strcmp(config->scheduler, "steal") == 0;
+	if (!steal && strcmp(config->scheduler, "global") != 0) {
+		fprintf(stderr, "Unknown scheduler %s, use global\n", config->scheduler);
+	}
+	skynet_mq_init(config->thread, steal);
 	// 4. 模块管理器
 	skynet_module_init(config->module_path);
 	// 5. 计时器
-	skynet_timer_init();
-	// 6. 网络
-	skynet_socket_init();
+	skynet_timer_init(config->timer_resolution);
+	// 6. 网络，每个socket线程一个分片
+	int socket_thread = skynet_socket_init(config->socket_thread, config->socket_backend);
+	if (socket_thread == 0) {
+		fprintf(stderr, "Can't create socket server\n");
+		exit(1);
+	}
 
 	// 分析器开关
 	skynet_profile_enable(config->profile);
@@ -345,7 +506,7 @@ skynet_start(struct skynet_config * config) {
 	/////////////////////////////////////// bootstrap 对应 service/bootstrap.lua
 	bootstrap(ctx, config->bootstrap);   // 这里将logger服务传入，只是为了做异常处理
 
-	start(config->thread);				 // 按数量启动线程，主逻辑
+	start(config, socket_thread);	// 按数量启动线程，主逻辑
 
 	// harbor_exit may call socket send, so it should exit before socket_free
 	skynet_harbor_exit();
@@ -19,8 +19,6 @@
 #include <mach/mach.h>
 #endif
 
-typedef void (*timer_execute_func)(void *ud,void *arg);
-
 /**
  * 时间轮算法参考 : Linux 时钟处理机制
  * https://www.ibm.com/developerworks/cn/linux/l-cn-clocks/index.html
@@ -32,14 +30,28 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1)			// 255		1111 1111B
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)			// 63		0011 1111B
 
+#define DEFAULT_RESOLUTION 10					// 默认每 10 毫秒 tick 一次
+#define NODE_CHUNK 256							// timer_node 每次从系统申请的数量
+#define DISPATCH_STACK 64
+#define INDEX_STRIPE_SHIFT 6
+#define INDEX_STRIPE (1 << INDEX_STRIPE_SHIFT)	// 定时器索引分成 64 段，每段有自己的锁
+#define STRIPE_INIT_SIZE 64						// 每段索引的初始桶数
+
 struct timer_event {
 	uint32_t handle;
 	int session;
 };
 
+/**
+ * 定时器节点，同时挂在时间轮的链表和 (handle, session) 的索引上
+ * 取消时从索引摘下成为墓碑，留在时间轮上直到到期时丢弃
+*/
 struct timer_node {
 	struct timer_node *next;
 	uint32_t expire;
+	struct timer_event event;
+	struct timer_node *hnext;				// 索引的桶链表
+	struct timer_node **hprev;				// 指向前一个节点的 hnext（或桶），NULL 表示不在索引上
 };
 
 struct link_list {
@@ -47,17 +59,34 @@ struct link_list {
 	struct timer_node *tail;
 };
 
+/**
+ * 一段 (handle, session) 索引，按 hash 的低 INDEX_STRIPE_SHIFT 位分段
+ * 注册、取消、到期时的索引操作和扩展只锁一段，不占用时间轮的锁
+ * 空闲的 timer_node 也按段存放，分配和回收都在已经持有段锁的时候顺便完成
+*/
+struct timer_stripe {
+	struct spinlock lock;
+	int size;								// 桶的数量，2的幂级数
+	int count;
+	struct timer_node **index;
+	struct timer_node *freelist;
+};
+
 ////////////////////////////////////// 计时器
 // 1秒 = 100厘秒
 // 1厘秒 = 10毫秒
+// 时间轮每 resolution 毫秒 tick 一次，由配置项 timer_resolution 指定，默认10毫秒即1厘秒
 struct timer {
 	struct link_list near[TIME_NEAR];		// 256 个链表
 	struct link_list t[4][TIME_LEVEL];
 	struct spinlock lock;
-	uint32_t time;							// timer_update 累计执行的次数。通常为系统流逝的厘秒数，即与current有关
+	uint32_t time;							// timer_update 累计执行的次数。即系统流逝的 tick 数
 	uint32_t starttime;						// 系统启动时间。单位：秒
-	uint64_t current;						// 系统运行时间（累计值）。单位：厘秒
-	uint64_t current_point;					// 当前时间。单位：厘秒
+	uint64_t current;						// 系统运行时间（累计值）。单位：毫秒
+	uint64_t current_point;					// 当前时间。单位：毫秒
+	int resolution;							// 每个 tick 的毫秒数
+	uint32_t remain;						// 还不够一个 tick 的毫秒数
+	struct timer_stripe stripe[INDEX_STRIPE];	// 还没到期的定时器索引，用于取消
 };
 
 static struct timer * TI = NULL;
@@ -142,12 +171,107 @@ add_node(struct timer *T,struct timer_node *node) {
 	}
 }
 
-// sz 就是 arg 的内存长度
-// time 指的是 delay time 延迟时间
+/**
+ * 从空闲链表取一个 timer_node，空了就一次申请 NODE_CHUNK 个，申请的内存不再归还
+ * 需要持有 s->lock
+*/
+static struct timer_node *
+node_alloc(struct timer_stripe *s) {
+	struct timer_node *node = s->freelist;
+	if (node == NULL) {
+		struct timer_node *chunk = (struct timer_node *)skynet_malloc(NODE_CHUNK * sizeof(*chunk));
+		int i;
+		for (i=0;i<NODE_CHUNK-1;i++) {
+			chunk[i].next = &chunk[i+1];
+		}
+		chunk[NODE_CHUNK-1].next = NULL;
+		node = chunk;
+	}
+	s->freelist = node->next;
+	return node;
+}
+
+static inline uint32_t
+index_hash(uint32_t handle, int session) {
+	return (handle * 2654435761u) ^ (uint32_t)session;
+}
+
+static inline struct timer_stripe *
+index_stripe(struct timer *T, uint32_t h) {
+	return &T->stripe[h & (INDEX_STRIPE-1)];
+}
+
+// 段内的桶用去掉分段位之后的 hash
+static inline struct timer_node **
+index_bucket(struct timer_stripe *s, uint32_t h) {
+	return &s->index[(h >> INDEX_STRIPE_SHIFT) & (s->size-1)];
+}
+
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);		// 这直接就+1了, 将arg的数据放到timer_node的尾部
+index_link(struct timer_node **bucket, struct timer_node *node) {
+	node->hnext = *bucket;
+	if (node->hnext) {
+		node->hnext->hprev = &node->hnext;
+	}
+	node->hprev = bucket;
+	*bucket = node;
+}
+
+// 每段只有全部定时器的 1/INDEX_STRIPE，扩展时只锁这一段
+static void
+index_expand(struct timer_stripe *s) {
+	struct timer_node **old = s->index;
+	int old_size = s->size;
+	s->size = old_size * 2;
+	s->index = (struct timer_node **)skynet_malloc(s->size * sizeof(*s->index));
+	memset(s->index, 0, s->size * sizeof(*s->index));
+	int i;
+	for (i=0;i<old_size;i++) {
+		struct timer_node *node = old[i];
+		while (node) {
+			struct timer_node *next = node->hnext;
+			index_link(index_bucket(s, index_hash(node->event.handle, node->event.session)), node);
+			node = next;
+		}
+	}
+	skynet_free(old);
+}
+
+// 需要持有 s->lock
+static void
+index_insert(struct timer_stripe *s, struct timer_node *node, uint32_t h) {
+	if (s->count >= s->size) {
+		index_expand(s);
+	}
+	index_link(index_bucket(s, h), node);
+	++s->count;
+}
+
+// 需要持有 s->lock
+static void
+index_remove(struct timer_stripe *s, struct timer_node *node) {
+	*node->hprev = node->hnext;
+	if (node->hnext) {
+		node->hnext->hprev = node->hprev;
+	}
+	node->hprev = NULL;
+	--s->count;
+}
+
+/**
+ * time 指的是 delay time 延迟时间，单位：tick
+ * 先在段锁里分配节点、挂上索引，再在时间轮的锁里只做 add_node
+ * 挂上时间轮之前不会到期，中间被取消的话作为墓碑挂上时间轮
+*/
+static void
+timer_add(struct timer *T,struct timer_event *event,int time) {
+	uint32_t h = index_hash(event->handle, event->session);
+	struct timer_stripe *s = index_stripe(T, h);
+	SPIN_LOCK(s);
+	struct timer_node *node = node_alloc(s);
+	node->event = *event;
+	index_insert(s, node, h);
+	SPIN_UNLOCK(s);
 
 	SPIN_LOCK(T);
 
@@ -171,6 +295,7 @@ move_list(struct timer *T, int level, int idx) {
  * 一个32位无符号整型的重置
  * 至少也要 
  * 2^32 / 100 / 60 / 60 / 24 = 497.1026962962962962962962962963 .... 天
+ * 1毫秒精度时是 49.7 天，重置的处理见下面 ct == 0 的分支
 */
 
 static void
@@ -224,23 +349,117 @@ timer_shift(struct timer *T) {
 	}
 }
 
-static inline void
-dispatch_list(struct timer_node *current) {
-	do {
-		struct timer_event * event = (struct timer_event *)(current+1);
-		struct skynet_message message;
-		message.source = 0;
-		message.session = event->session;
-		message.data = NULL;
-		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+static void
+timeout_push(uint32_t handle, int session) {
+	struct skynet_message message;
+	message.source = 0;
+	message.session = session;
+	message.data = NULL;
+	message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+
+	// 向注册定时器的服务发 RESPONSE 消息
+	skynet_context_push(handle, &message);
+}
+
+struct dispatch_item {
+	uint32_t handle;
+	int order;
+	int session;
+};
+
+static int
+compare_item(const void *a, const void *b) {
+	const struct dispatch_item *x = a;
+	const struct dispatch_item *y = b;
+	if (x->handle != y->handle) {
+		return x->handle < y->handle ? -1 : 1;
+	}
+	// 同一个服务保持定时器注册的先后次序
+	return x->order - y->order;
+}
+
+/**
+ * 到期的节点从索引摘下，还给所在段的空闲链表
+ * 返回 0 表示已经被取消（墓碑）
+ * event 在注册后不再改变，可以在锁外读
+*/
+static int
+node_expire(struct timer *T, struct timer_node *node, struct timer_event *event) {
+	*event = node->event;
+	struct timer_stripe *s = index_stripe(T, index_hash(event->handle, event->session));
+	SPIN_LOCK(s);
+	int alive = node->hprev != NULL;
+	if (alive) {
+		index_remove(s, node);
+	}
+	node->next = s->freelist;
+	s->freelist = node;
+	SPIN_UNLOCK(s);
+	return alive;
+}
+
+/**
+ * 派发同一个 tick 到期的定时器
+ * 同一个服务的多个定时器合并成一个消息推送，见 skynet_context_pushtimer
+*/
+static void
+dispatch_list(struct timer *T, struct timer_node *current) {
+	struct timer_event event;
+	int n = 1;
+	struct timer_node *tail = current;
+	while (tail->next) {
+		tail = tail->next;
+		++n;
+	}
 
-		// 向注册定时器的服务发 RESPONSE 消息
-		skynet_context_push(event->handle, &message);
-		
-		struct timer_node * temp = current;
-		current=current->next;
-		skynet_free(temp);	
-	} while (current);
+	if (n == 1) {
+		if (node_expire(T, current, &event)) {
+			timeout_push(event.handle, event.session);
+		}
+	} else {
+		struct dispatch_item tmp[DISPATCH_STACK];
+		struct dispatch_item *item = tmp;
+		int session[DISPATCH_STACK];
+		int *batch = session;
+		if (n > DISPATCH_STACK) {
+			item = skynet_malloc(n * sizeof(*item));
+			batch = skynet_malloc(n * sizeof(int));
+		}
+		int i;
+		int m = 0;
+		for (i=0;i<n;i++) {
+			struct timer_node *next = current->next;
+			// 跳过取消了的定时器
+			if (node_expire(T, current, &event)) {
+				item[m].handle = event.handle;
+				item[m].session = event.session;
+				item[m].order = m;
+				++m;
+			}
+			current = next;
+		}
+		n = m;
+		qsort(item, n, sizeof(*item), compare_item);
+
+		i = 0;
+		while (i < n) {
+			int j = i;
+			do {
+				batch[j-i] = item[j].session;
+				++j;
+			} while (j < n && item[j].handle == item[i].handle);
+			if (j - i == 1) {
+				timeout_push(item[i].handle, batch[0]);
+			} else {
+				skynet_context_pushtimer(item[i].handle, batch, j - i);
+			}
+			i = j;
+		}
+		if (item != tmp) {
+			skynet_free(item);
+			skynet_free(batch);
+		}
+	}
 }
 
 static inline void
@@ -252,7 +471,8 @@ timer_execute(struct timer *T) {
 		struct timer_node *current = link_clear(&T->near[idx]);
 		SPIN_UNLOCK(T);
 		// dispatch_list don't need lock T
-		dispatch_list(current);
+		// 节点在 dispatch_list 里从索引摘下，之前还可以被取消
+		dispatch_list(T, current);
 		SPIN_LOCK(T);
 	}
 }
@@ -273,7 +493,7 @@ timer_update(struct timer *T) {
 }
 
 static struct timer *
-timer_create_timer() {
+timer_create_timer(int resolution) {
 	struct timer *r=(struct timer *)skynet_malloc(sizeof(struct timer));
 	memset(r,0,sizeof(*r));
 
@@ -292,12 +512,26 @@ timer_create_timer() {
 	SPIN_INIT(r)
 
 	r->current = 0;
+	r->resolution = resolution;
+	r->remain = 0;
+	for (i=0;i<INDEX_STRIPE;i++) {
+		struct timer_stripe *s = &r->stripe[i];
+		SPIN_INIT(s)
+		s->size = STRIPE_INIT_SIZE;
+		s->count = 0;
+		s->freelist = NULL;
+		s->index = (struct timer_node **)skynet_malloc(s->size * sizeof(struct timer_node *));
+		memset(s->index, 0, s->size * sizeof(struct timer_node *));
+	}
 
 	return r;
 }
 
-int
-skynet_timeout(uint32_t handle, int time, int session) {
+/**
+ * time: 延迟的 tick 数
+*/
+static int
+timeout(uint32_t handle, int time, int session) {
 	if (time <= 0) {
 		struct skynet_message message;
 		message.source = 0;
@@ -318,12 +552,61 @@ skynet_timeout(uint32_t handle, int time, int session) {
 		 * session 	消息ID
 		 * expire 	终止时间
 		*/
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(TI, &event, time);
 	}
 
 	return session;
 }
 
+// time 单位：厘秒
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	if (time > 0) {
+		int64_t ms = (int64_t)time * 10;
+		int64_t tick = (ms + TI->resolution - 1) / TI->resolution;
+		time = tick > INT32_MAX ? INT32_MAX : (int)tick;
+	}
+	return timeout(handle, time, session);
+}
+
+// time 单位：毫秒，不足一个 tick 的部分向上取整
+int
+skynet_timeout_ms(uint32_t handle, int time, int session) {
+	if (time > 0) {
+		time = time / TI->resolution + (time % TI->resolution != 0);
+	}
+	return timeout(handle, time, session);
+}
+
+/**
+ * 取消还没到期的定时器，O(1)
+ * 成功返回0；已经到期（RESPONSE 消息可能已经发出）或不存在返回-1
+*/
+int
+skynet_timeout_cancel(uint32_t handle, int session) {
+	uint32_t h = index_hash(handle, session);
+	struct timer_stripe *s = index_stripe(TI, h);
+	int ret = -1;
+	SPIN_LOCK(s);
+	struct timer_node *node = *index_bucket(s, h);
+	while (node) {
+		if (node->event.handle == handle && node->event.session == session) {
+			// 不在索引上就是墓碑，到期时丢弃
+			index_remove(s, node);
+			ret = 0;
+			break;
+		}
+		node = node->hnext;
+	}
+	SPIN_UNLOCK(s);
+	return ret;
+}
+
+int
+skynet_timer_resolution(void) {
+	return TI->resolution;
+}
+
 /**
  * 3处系统调用：
  * systime -> clock_gettime(CLOCK_REALTIME, &ti);						挂钟时间。即wall time，这个值可以人为改变
@@ -331,37 +614,37 @@ skynet_timeout(uint32_t handle, int time, int session) {
  * skynet_thread_time -> clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ti); 	调用线程的CPU时间。
 */
 
-// centisecond: 1/100 second
-// 挂钟时间。返回秒，厘秒
+// millisecond: 1/1000 second
+// 挂钟时间。返回秒，毫秒
 static void
-systime(uint32_t *sec, uint32_t *cs) {
+systime(uint32_t *sec, uint32_t *ms) {
 #if !defined(__APPLE__) || defined(AVAILABLE_MAC_OS_X_VERSION_10_12_AND_LATER)
 	struct timespec ti;
 	clock_gettime(CLOCK_REALTIME, &ti);
 	*sec = (uint32_t)ti.tv_sec;
-	*cs = (uint32_t)(ti.tv_nsec / 10000000);
+	*ms = (uint32_t)(ti.tv_nsec / 1000000);
 #else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	*sec = tv.tv_sec;
-	*cs = tv.tv_usec / 10000;
+	*ms = tv.tv_usec / 1000;
 #endif
 }
 
-// 单调时间。返回一个值，单位：厘秒。
+// 单调时间。返回一个值，单位：毫秒。
 static uint64_t
 gettime() {
 	uint64_t t;
 #if !defined(__APPLE__) || defined(AVAILABLE_MAC_OS_X_VERSION_10_12_AND_LATER)
 	struct timespec ti;
 	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
+	t = (uint64_t)ti.tv_sec * 1000;
+	t += ti.tv_nsec / 1000000;
 #else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
-	t = (uint64_t)tv.tv_sec * 100;
-	t += tv.tv_usec / 10000;
+	t = (uint64_t)tv.tv_sec * 1000;
+	t += tv.tv_usec / 1000;
 #endif
 	return t;
 }
@@ -378,11 +661,13 @@ skynet_updatetime(void) {
 		TI->current_point = cp;		// 记录单调时间
 		TI->current += diff;		// 累计运行时间
 
-		// 根据流逝的厘秒量，执行逻辑
+		// 根据流逝的毫秒数，每满 resolution 毫秒 tick 一次
 		// current 先行
 		// 后面 TI->time 跟上
-		int i;
-		for (i=0;i<diff;i++) {
+		uint32_t ms = TI->remain + diff;
+		uint32_t i, n = ms / TI->resolution;
+		TI->remain = ms % TI->resolution;
+		for (i=0;i<n;i++) {
 			timer_update(TI);
 		}
 	}
@@ -404,18 +689,21 @@ skynet_starttime(void) {
 */
 uint64_t 
 skynet_now(void) {
-	return TI->current;
+	return TI->current / 10;
 }
 
 void 
-skynet_timer_init(void) {
-	TI = timer_create_timer();
+skynet_timer_init(int resolution) {
+	if (resolution <= 0 || resolution > DEFAULT_RESOLUTION) {
+		resolution = DEFAULT_RESOLUTION;
+	}
+	TI = timer_create_timer(resolution);
 	uint32_t current = 0;
 	systime(&TI->starttime, &current);
 
-	// 因为这是唯一系统调用 systime 取的厘秒, 它的值范围在 [0,99] 之间
+	// 因为这是唯一系统调用 systime 取的毫秒, 它的值范围在 [0,999] 之间
 	// 服务器启动时间 starttime 精度只算到秒
-	// 所以理论上, 服务器一启动, 我们已经累计运行了 current 个厘秒.
+	// 所以理论上, 服务器一启动, 我们已经累计运行了 current 个毫秒.
 	TI->current = current;					// 不太明白，这个累计运行时间为啥不从0开始算？？？
 	TI->current_point = gettime();
 }
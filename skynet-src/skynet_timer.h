@@ -3,11 +3,14 @@
 
 #include <stdint.h>
 
-int skynet_timeout(uint32_t handle, int time, int session);
+int skynet_timeout(uint32_t handle, int time, int session);		// time in centisecond
+int skynet_timeout_ms(uint32_t handle, int time, int session);	// time in millisecond
+int skynet_timeout_cancel(uint32_t handle, int session);		// 0 if the timer is removed before expiry
 void skynet_updatetime(void);
 uint32_t skynet_starttime(void);
 uint64_t skynet_thread_time(void);	// for profile, in micro second
+int skynet_timer_resolution(void);	// millisecond per tick
 
-void skynet_timer_init(void);
+void skynet_timer_init(int resolution);
 
 #endif
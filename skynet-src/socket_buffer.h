@@ -0,0 +1,14 @@
+#ifndef socket_buffer_h
+#define socket_buffer_h
+
+// 写缓冲超过上限时的处理，见 socket_server_watermark
+#define SOCKET_LIMIT_DROP 0		// 丢弃低优先级的包
+#define SOCKET_LIMIT_CLOSE 1	// 关闭连接
+
+// socket_server_sendv 的一块待发送缓冲，缓冲本身仍归调用者所有
+struct socket_iovec {
+	const void * buffer;
+	int sz;
+};
+
+#endif
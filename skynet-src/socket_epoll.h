@@ -49,10 +49,18 @@ sp_write(int efd, int sock, void *ud, bool enable) {
 	epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);
 }
 
-static int 
-sp_wait(int efd, struct event *e, int max) {
+static void
+sp_enable(int efd, int sock, void *ud, bool read_enable, bool write_enable) {
+	struct epoll_event ev;
+	ev.events = (read_enable ? EPOLLIN : 0) | (write_enable ? EPOLLOUT : 0);
+	ev.data.ptr = ud;
+	epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);
+}
+
+static int
+sp_poll(int efd, struct event *e, int max, int timeout) {
 	struct epoll_event ev[max];
-	int n = epoll_wait(efd , ev, max, -1);
+	int n = epoll_wait(efd , ev, max, timeout);
 	int i;
 	for (i=0;i<n;i++) {
 		e[i].s = ev[i].data.ptr;
@@ -61,11 +69,17 @@ sp_wait(int efd, struct event *e, int max) {
 		e[i].read = (flag & (EPOLLIN | EPOLLHUP)) != 0;
 		e[i].error = (flag & EPOLLERR) != 0;
 		e[i].eof = false;
+		e[i].complete = 0;
 	}
 
 	return n;
 }
 
+static int 
+sp_wait(int efd, struct event *e, int max) {
+	return sp_poll(efd, e, max, -1);
+}
+
 static void
 sp_nonblocking(int fd) {
 	int flag = fcntl(fd, F_GETFL, 0);
@@ -18,6 +18,8 @@ struct socket_info {
 	uint64_t rtime;
 	uint64_t wtime;
 	int64_t wbuffer;
+	uint64_t rbuffer;	// tcp 读缓冲分配次数
+	uint64_t rreuse;	// 其中从读缓冲池复用的次数
 	char name[128];
 	struct socket_info *next;
 };
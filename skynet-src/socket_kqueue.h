@@ -64,6 +64,15 @@ sp_write(int kfd, int sock, void *ud, bool enable) {
 	}
 }
 
+static void
+sp_enable(int kfd, int sock, void *ud, bool read_enable, bool write_enable) {
+	struct kevent ke;
+	EV_SET(&ke, sock, EVFILT_READ, read_enable ? EV_ENABLE : EV_DISABLE, 0, 0, ud);
+	kevent(kfd, &ke, 1, NULL, 0, NULL);
+	EV_SET(&ke, sock, EVFILT_WRITE, write_enable ? EV_ENABLE : EV_DISABLE, 0, 0, ud);
+	kevent(kfd, &ke, 1, NULL, 0, NULL);
+}
+
 static int 
 sp_wait(int kfd, struct event *e, int max) {
 	struct kevent ev[max];
@@ -78,6 +87,7 @@ sp_wait(int kfd, struct event *e, int max) {
 		e[i].read = (filter == EVFILT_READ) && (!eof);
 		e[i].error = (ev[i].flags & EV_ERROR) != 0;
 		e[i].eof = eof;
+		e[i].complete = 0;
 	}
 
 	return n;
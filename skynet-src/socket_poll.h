@@ -2,6 +2,7 @@
 #define socket_poll_h
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef int poll_fd;
 
@@ -11,6 +12,9 @@ struct event {
 	bool write;
 	bool error;
 	bool eof;
+	uint64_t complete;	// io_uring 完成事件的 user_data，epoll/kqueue 的就绪事件为 0
+	int res;
+	unsigned flags;
 };
 
 static bool sp_invalid(poll_fd fd);
@@ -19,6 +23,7 @@ static void sp_release(poll_fd fd);
 static int sp_add(poll_fd fd, int sock, void *ud);
 static void sp_del(poll_fd fd, int sock);
 static void sp_write(poll_fd, int sock, void *ud, bool enable);
+static void sp_enable(poll_fd, int sock, void *ud, bool read_enable, bool write_enable);
 static int sp_wait(poll_fd, struct event *e, int max);
 static void sp_nonblocking(int sock);
 
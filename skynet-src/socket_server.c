@@ -1,12 +1,21 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		// recvmmsg
+#endif
+
 #include "skynet.h"
 
 #include "socket_server.h"
 #include "socket_poll.h"
+#ifdef __linux__
+#include "socket_uring.h"
+#endif
 #include "atomic.h"
 #include "spinlock.h"
+#include "malloc_hook.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
@@ -16,12 +25,31 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
 
 #define MAX_INFO 128
-// MAX_SOCKET will be 2^MAX_SOCKET_P
+// MAX_SOCKET will be 2^MAX_SOCKET_P，每个分片的上限；槽位按页分配，用到时才增长
+// id 里除去槽位号的位数是槽位的代数，MAX_SOCKET_P 越大代数越少，同一个 id 越快被再次分配
+// 槽位只用到 cap 个时，一个 id 要再分配 cap * 2^(31-MAX_SOCKET_P) / shard_count 次才会重复
+#ifndef MAX_SOCKET_P
 #define MAX_SOCKET_P 16
+#endif
+#define SLOT_PAGE_P 12
+#define SLOT_PROBE 64		// reserve_id 连续探测这么多个槽位都被占用时，先扩容而不是继续找
 #define MAX_EVENT 64
 #define MIN_READ_BUFFER 64
+// 一次可读事件里 tcp 最多连续读几次（每次缓冲翻倍），读到的数据合并成一条消息
+#define READ_BUDGET 4
+// 控制命令环的格子数，必须是 2 的幂
+#define CTRL_RING 4096
+// tcp 读缓冲池按 2 的幂分级：64B ~ 64KB
+#define POOL_CLASS 11
+#define POOL_LIMIT 1024		// 每级最多缓存的缓冲数量，多出的真正释放
 #define SOCKET_TYPE_INVALID 0
 #define SOCKET_TYPE_RESERVE 1
 #define SOCKET_TYPE_PLISTEN 2
@@ -33,11 +61,14 @@
 #define SOCKET_TYPE_BIND 8
 
 #define MAX_SOCKET (1<<MAX_SOCKET_P)
+#define SLOT_PAGE (1<<SLOT_PAGE_P)
+#define SLOT_PAGES (MAX_SOCKET / SLOT_PAGE)
 
 #define PRIORITY_HIGH 0
 #define PRIORITY_LOW 1
 
-#define HASH_ID(id) (((unsigned)id) % MAX_SOCKET)
+// 分片时每个 socket_server 只分配 id % shard_count == shard 的 id，槽位按 id / shard_count 散列
+#define HASH_ID(ss, id) (((unsigned)(id) / (ss)->shard_count) % MAX_SOCKET)
 #define ID_TAG16(id) ((id>>MAX_SOCKET_P) & 0xffff)
 
 #define PROTOCOL_TCP 0
@@ -49,6 +80,21 @@
 
 #define MAX_UDP_PACKAGE 65535
 
+// linux 下 udp 用 recvmmsg 一次收多个包，打开了 udpbatch 的 socket 把包合并成一条 SOCKET_UDPBATCH 消息
+// 发送时用 sendmmsg 一次发出写队列里的多个包
+#ifdef __linux__
+#define UDP_RECVMMSG
+#define UDP_SENDMMSG
+#define UDP_BATCH 16
+#endif
+
+// tcp 发送时一次 writev 最多聚合的 write_buffer 数量
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define MAX_IOV IOV_MAX
+#else
+#define MAX_IOV 1024
+#endif
+
 // EAGAIN and EWOULDBLOCK may be not the same value.
 #if (EAGAIN != EWOULDBLOCK)
 #define AGAIN_WOULDBLOCK EAGAIN : case EWOULDBLOCK
@@ -64,6 +110,9 @@ struct write_buffer {
 	char *ptr;
 	int sz;
 	bool userobject;
+	int file;			// >= 0 时是 sendfile 缓冲：要发送文件的 [offset, end)，发完后关闭文件
+	int64_t offset;
+	int64_t end;
 	uint8_t udp_address[UDP_ADDRESS_SIZE];
 };
 
@@ -80,6 +129,8 @@ struct socket_stat {
 	uint64_t wtime;
 	uint64_t read;
 	uint64_t write;
+	uint64_t rbuffer;	// 分配的读缓冲数
+	uint64_t rreuse;	// 其中从缓冲池复用的数量
 };
 
 struct socket {
@@ -91,10 +142,17 @@ struct socket {
 	volatile uint32_t sending;
 	int fd;
 	int id;
+	int report_id;		// 上报给服务的 id，分片监听的副本填主监听 id
 	uint8_t protocol;
 	uint8_t type;
+	uint8_t uring;		// 挂在 io_uring 上的操作（URING_ACCEPT/URING_RECV），0 表示完全由 epoll 处理
+	uint8_t wb_policy;	// 写缓冲超过 wb_limit 时的处理：SOCKET_LIMIT_DROP 或 SOCKET_LIMIT_CLOSE
+	uint8_t udpbatch;	// 1 表示 socket 的所有者能处理 SOCKET_UDPBATCH，见 socket_server_udpbatch
 	uint16_t udpconnecting;
-	int64_t warn_size;
+	int64_t warn_size;	// 下一次高水位通知的大小，0 表示不在告警状态
+	int64_t warn_high;	// 高水位，0 时用 WARNING_SIZE
+	int64_t warn_low;	// 告警后写缓冲降到低水位以下时通知一次（ud 为 0）
+	int64_t wb_limit;	// 写缓冲上限，0 表示不限制
 	union {
 		int size;
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
@@ -105,21 +163,56 @@ struct socket {
 	size_t dw_size;
 };
 
+/**
+ * 读缓冲池中的一级
+ * 服务消费完数据后用 skynet_free 释放读缓冲，malloc hook 会把它压回 returned（多线程无锁压栈），
+ * socket 线程在 free 用完时一次性取回 returned 复用
+*/
+struct buffer_class {
+	void * free;				// 只有 socket 线程访问，用缓冲的头部做链表指针
+	int n;
+	void * volatile returned;
+};
+
+/**
+ * 控制命令环的一格，seq 是 Vyukov 式的序号：
+ * 等于票号时格子空闲，等于票号+1 时命令已写好，socket 线程取走后加上 CTRL_RING 留给下一圈
+*/
+struct ctrl_cell {
+	volatile uint32_t seq;
+	uint8_t type;
+	uint8_t len;
+	uint8_t buffer[256];
+};
+
 struct socket_server {
 	volatile uint64_t time;
-	int recvctrl_fd;
+	volatile uint32_t ctrl_tail;	// 工作线程取票号的位置
+	int recvctrl_fd;				// 门铃：linux 上是同一个 eventfd，其他平台是一对管道
 	int sendctrl_fd;
 	int checkctrl;
+	int ctrl_sleep;					// socket 线程准备阻塞时置 1，之后写入命令的工作线程负责敲门铃
+	uint32_t ctrl_head;				// 只有 socket 线程访问
 	poll_fd event_fd;
+	struct uring * uring;		// 使用 io_uring 后端时非 NULL
 	int alloc_id;
+	volatile int slot_cap;		// 已分配的槽位数，总是 SLOT_PAGE 的整数倍
+	int shard;
+	int shard_count;
 	int event_n;
 	int event_index;
 	struct socket_object_interface soi;
+	struct udp_batch * udpbatch;	// 第一次收 udp 时才分配
+	int pool_enable;
+	struct buffer_class pool[POOL_CLASS];
 	struct event ev[MAX_EVENT];
-	struct socket slot[MAX_SOCKET];
+	struct socket * volatile slot[SLOT_PAGES];	// 槽位页，只增不减，直到 socket_server_release
+	struct socket invalid_slot;		// 还没分配的页上的 id 都查到这里，type 永远是 SOCKET_TYPE_INVALID
 	char buffer[MAX_INFO];
+#ifndef UDP_RECVMMSG
 	uint8_t udpbuffer[MAX_UDP_PACKAGE];
-	fd_set rfds;
+#endif
+	struct ctrl_cell ctrl[CTRL_RING];
 };
 
 struct request_open {
@@ -154,6 +247,7 @@ struct request_close {
 struct request_listen {
 	int id;
 	int fd;
+	int report_id;
 	uintptr_t opaque;
 	char host[1];
 };
@@ -169,6 +263,21 @@ struct request_start {
 	uintptr_t opaque;
 };
 
+struct request_sendfile {
+	int id;
+	int fd;
+	int64_t offset;
+	int64_t len;
+};
+
+struct request_watermark {
+	int id;
+	int policy;
+	int64_t high;
+	int64_t low;
+	int64_t limit;
+};
+
 struct request_setopt {
 	int id;
 	int what;
@@ -194,6 +303,8 @@ struct request_udp {
 	D Send package (high)
 	P Send package (low)
 	A Send UDP package
+	F Send file
+	W Set watermark
 	T Set opt
 	U Create UDP socket
 	C set udp address
@@ -201,17 +312,18 @@ struct request_udp {
  */
 
 struct request_package {
-	uint8_t header[8];	// 6 bytes dummy
 	union {
 		char buffer[256];
 		struct request_open open;
 		struct request_send send;
 		struct request_send_udp send_udp;
+		struct request_sendfile sendfile;
 		struct request_close close;
 		struct request_listen listen;
 		struct request_bind bind;
 		struct request_start start;
 		struct request_setopt setopt;
+		struct request_watermark watermark;
 		struct request_udp udp;
 		struct request_setudp set_udp;
 	} u;
@@ -224,6 +336,15 @@ union sockaddr_all {
 	struct sockaddr_in6 v6;
 };
 
+#ifdef UDP_RECVMMSG
+struct udp_batch {
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	union sockaddr_all addr[UDP_BATCH];
+	uint8_t buffer[UDP_BATCH][MAX_UDP_PACKAGE];
+};
+#endif
+
 struct send_object {
 	void * buffer;
 	int sz;
@@ -288,7 +409,9 @@ send_object_init(struct socket_server *ss, struct send_object *so, void *object,
 
 static inline void
 write_buffer_free(struct socket_server *ss, struct write_buffer *wb) {
-	if (wb->userobject) {
+	if (wb->file >= 0) {
+		close(wb->file);
+	} else if (wb->userobject) {
 		ss->soi.free(wb->buffer);
 	} else {
 		FREE(wb->buffer);
@@ -302,43 +425,145 @@ socket_keepalive(int fd) {
 	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keepalive , sizeof(keepalive));  
 }
 
+static inline void
+clear_wb_list(struct wb_list *list) {
+	list->head = NULL;
+	list->tail = NULL;
+}
+
+/**
+ * id 到槽位：id / shard_count 的低 MAX_SOCKET_P 位是槽位号，其余位是槽位的代数
+ * 工作线程可能拿着任意 id 来查，页还没分配时返回 invalid_slot，调用者核对 id 和 type 后自然放弃
+*/
+static inline struct socket *
+get_socket(struct socket_server *ss, int id) {
+	unsigned h = HASH_ID(ss, id);
+	struct socket * page = ATOM_LOAD(&ss->slot[h >> SLOT_PAGE_P]);
+	if (page == NULL) {
+		return &ss->invalid_slot;
+	}
+	return &page[h & (SLOT_PAGE - 1)];
+}
+
+static void
+init_slot(struct socket *s) {
+	s->type = SOCKET_TYPE_INVALID;
+	s->id = -1;
+	clear_wb_list(&s->high);
+	clear_wb_list(&s->low);
+	spinlock_init(&s->dw_lock);
+}
+
+// 追加一页槽位，多个线程同时扩容时只有一个能装上，其余的释放自己的页
+static void
+expand_slot(struct socket_server *ss, int cap) {
+	int n = cap / SLOT_PAGE;
+	if (ss->slot[n] == NULL) {
+		struct socket * page = MALLOC(SLOT_PAGE * sizeof(struct socket));
+		int i;
+		for (i=0;i<SLOT_PAGE;i++) {
+			init_slot(&page[i]);
+		}
+		if (!ATOM_CAS_POINTER(&ss->slot[n], NULL, page)) {
+			for (i=0;i<SLOT_PAGE;i++) {
+				spinlock_destroy(&page[i].dw_lock);
+			}
+			FREE(page);
+		}
+	}
+	ATOM_CAS(&ss->slot_cap, cap, cap + SLOT_PAGE);
+}
+
+// 同一个槽位每次复用时代数加一，拿着旧 id 的服务不会误操作新的 socket
+static int
+slot_id(struct socket_server *ss, struct socket *s, unsigned h) {
+	unsigned gen = 0;
+	if (s->id >= 0) {
+		gen = ((unsigned)s->id / ss->shard_count >> MAX_SOCKET_P) + 1;
+		gen %= (0x80000000u / ss->shard_count) >> MAX_SOCKET_P;
+	}
+	return (int)((gen << MAX_SOCKET_P | h) * ss->shard_count + ss->shard);
+}
+
 static int
 reserve_id(struct socket_server *ss) {
-	int i;
-	for (i=0;i<MAX_SOCKET;i++) {
-		int id = ATOM_INC(&(ss->alloc_id));
-		if (id < 0) {
-			id = ATOM_AND(&(ss->alloc_id), 0x7fffffff);
-		}
-		struct socket *s = &ss->slot[HASH_ID(id)];
-		if (s->type == SOCKET_TYPE_INVALID) {
-			if (ATOM_CAS(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
-				s->id = id;
-				s->protocol = PROTOCOL_UNKNOWN;
-				// socket_server_udp_connect may inc s->udpconncting directly (from other thread, before new_fd), 
-				// so reset it to 0 here rather than in new_fd.
-				s->udpconnecting = 0;
-				s->fd = -1;
-				return id;
-			} else {
-				// retry
-				--i;
+	for (;;) {
+		int cap = ATOM_LOAD(&ss->slot_cap);
+		// 还能扩容时只探测有限次，避免在快满的表里长时间寻找
+		int probe = cap < MAX_SOCKET ? SLOT_PROBE : cap;
+		int i;
+		for (i=0;i<probe;i++) {
+			unsigned h = (unsigned)ATOM_FINC(&ss->alloc_id) % cap;
+			struct socket *s = &ss->slot[h >> SLOT_PAGE_P][h & (SLOT_PAGE - 1)];
+			if (s->type == SOCKET_TYPE_INVALID) {
+				if (ATOM_CAS(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
+					int id = slot_id(ss, s, h);
+					s->id = id;
+					s->protocol = PROTOCOL_UNKNOWN;
+					// socket_server_udp_connect may inc s->udpconncting directly (from other thread, before new_fd), 
+					// so reset it to 0 here rather than in new_fd.
+					s->udpconnecting = 0;
+					s->fd = -1;
+					return id;
+				} else {
+					// retry
+					--i;
+				}
 			}
 		}
+		if (cap >= MAX_SOCKET) {
+			return -1;
+		}
+		expand_slot(ss, cap);
 	}
-	return -1;
 }
 
-static inline void
-clear_wb_list(struct wb_list *list) {
-	list->head = NULL;
-	list->tail = NULL;
+void
+socket_server_pool_release(void *ud, void *ptr) {
+	struct buffer_class *c = ud;
+	void * head;
+	do {
+		head = c->returned;
+		*(void **)ptr = head;
+	} while (!ATOM_CAS_POINTER(&c->returned, head, ptr));
+}
+
+static void
+pool_freelist(void *list) {
+	while (list) {
+		void *next = *(void **)list;
+		skynet_free_pool(list);
+		list = next;
+	}
+}
+
+// 创建门铃，fd[0] 读 fd[1] 写，都是非阻塞的
+static int
+ctrl_doorbell(int fd[2]) {
+#ifdef __linux__
+	fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK);
+	return fd[0] < 0;
+#else
+	if (pipe(fd)) {
+		return 1;
+	}
+	sp_nonblocking(fd[0]);
+	sp_nonblocking(fd[1]);
+	return 0;
+#endif
+}
+
+static void
+close_doorbell(struct socket_server *ss) {
+	close(ss->recvctrl_fd);
+	if (ss->sendctrl_fd != ss->recvctrl_fd) {
+		close(ss->sendctrl_fd);
+	}
 }
 
 struct socket_server * 
-socket_server_create(uint64_t time) {
+socket_server_create(uint64_t time, int shard, int shard_count) {
 	int i;
-	// 两种方式同时用 poll/epoll
 	int fd[2];
 	poll_fd efd = sp_create();
 
@@ -346,10 +571,10 @@ socket_server_create(uint64_t time) {
 		fprintf(stderr, "socket-server: create event pool failed.\n");
 		return NULL;
 	}
-	// poll用到的socket
-	if (pipe(fd)) {
+	// 控制命令走无锁的命令环，门铃只在 socket 线程阻塞时用来叫醒它
+	if (ctrl_doorbell(fd)) {
 		sp_release(efd);
-		fprintf(stderr, "socket-server: create socket pair failed.\n");
+		fprintf(stderr, "socket-server: create doorbell failed.\n");
 		return NULL;
 	}
 	// 注册epoll
@@ -357,7 +582,9 @@ socket_server_create(uint64_t time) {
 		// add recvctrl_fd to event poll
 		fprintf(stderr, "socket-server: can't add server fd to event pool.\n");
 		close(fd[0]);
-		close(fd[1]);
+		if (fd[1] != fd[0]) {
+			close(fd[1]);
+		}
 		sp_release(efd);
 		return NULL;
 	}
@@ -365,23 +592,34 @@ socket_server_create(uint64_t time) {
 	struct socket_server *ss = MALLOC(sizeof(*ss));
 	ss->time = time;
 	ss->event_fd = efd;
+	ss->uring = NULL;
 	ss->recvctrl_fd = fd[0];		// for read
 	ss->sendctrl_fd = fd[1];		// for write
 	ss->checkctrl = 1;
+	ss->ctrl_sleep = 0;
+	ss->ctrl_head = 0;
+	ss->ctrl_tail = 0;
+	for (i=0;i<CTRL_RING;i++) {
+		ss->ctrl[i].seq = i;
+	}
 
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
-		s->type = SOCKET_TYPE_INVALID;
-		clear_wb_list(&s->high);
-		clear_wb_list(&s->low);
-		spinlock_init(&s->dw_lock);
+	// 一个分片至少能容纳 2 代 id
+	assert(((0x80000000u / shard_count) >> MAX_SOCKET_P) >= 2);
+	for (i=0;i<SLOT_PAGES;i++) {
+		ss->slot[i] = NULL;
 	}
+	init_slot(&ss->invalid_slot);
+	ss->slot_cap = 0;
+	expand_slot(ss, 0);
 	ss->alloc_id = 0;
+	ss->shard = shard;
+	ss->shard_count = shard_count;
 	ss->event_n = 0;
 	ss->event_index = 0;
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds);
-	assert(ss->recvctrl_fd < FD_SETSIZE);
+	ss->udpbatch = NULL;
+	ss->pool_enable = 1;
+	memset(ss->pool, 0, sizeof(ss->pool));
 
 	return ss;
 }
@@ -410,6 +648,48 @@ free_buffer(struct socket_server *ss, const void * buffer, int sz) {
 	so.free_func((void *)buffer);
 }
 
+#ifdef SOCKET_URING
+
+/**
+ * 监听 socket 挂上 multishot accept，tcp 连接挂上 multishot recv，epoll 里只留写事件
+ * 完成事件的 user_data 带着 socket id，socket 关闭后残留的完成事件靠 id 识别
+*/
+static void
+uring_start(struct socket_server *ss, struct socket *s, bool write) {
+	if (s->type == SOCKET_TYPE_PLISTEN || s->type == SOCKET_TYPE_LISTEN) {
+		s->uring = URING_ACCEPT;
+		uring_accept(ss->uring, s->fd, URING_UD(s->id, URING_ACCEPT));
+	} else {
+		s->uring = URING_RECV;
+		sp_enable(ss->event_fd, s->fd, s, false, write);
+		uring_recv(ss->uring, s->fd, URING_UD(s->id, URING_RECV));
+	}
+}
+
+// 挂着的请求持有 fd 的引用，不取消的话 close 之后连接也不会真正关闭
+// 立即提交取消，否则 close 返回后监听端口还被占着，马上重新 listen 会失败
+static void
+uring_stop(struct socket_server *ss, struct socket *s) {
+	uring_cancel(ss->uring, URING_UD(s->id, s->uring));
+	uring_submit(ss->uring, 0);
+	s->uring = 0;
+}
+
+static void
+uring_free(struct socket_server *ss) {
+	if (ss->uring) {
+		uring_release(ss->uring);
+	}
+}
+
+#else
+
+static void uring_start(struct socket_server *ss, struct socket *s, bool write) {}
+static void uring_stop(struct socket_server *ss, struct socket *s) {}
+static void uring_free(struct socket_server *ss) {}
+
+#endif
+
 static void
 force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	result->id = s->id;
@@ -422,6 +702,9 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	assert(s->type != SOCKET_TYPE_RESERVE);
 	free_wb_list(ss,&s->high);
 	free_wb_list(ss,&s->low);
+	if (s->uring) {
+		uring_stop(ss, s);
+	}
 	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
 		sp_del(ss->event_fd, s->fd);
 	}
@@ -441,20 +724,30 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 
 void 
 socket_server_release(struct socket_server *ss) {
-	int i;
+	int i,j;
 	struct socket_message dummy;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
-		struct socket_lock l;
-		socket_lock_init(s, &l);
-		if (s->type != SOCKET_TYPE_RESERVE) {
-			force_close(ss, s, &l, &dummy);
+	for (i=0;i<SLOT_PAGES && ss->slot[i];i++) {
+		struct socket *page = ss->slot[i];
+		for (j=0;j<SLOT_PAGE;j++) {
+			struct socket *s = &page[j];
+			struct socket_lock l;
+			socket_lock_init(s, &l);
+			if (s->type != SOCKET_TYPE_RESERVE) {
+				force_close(ss, s, &l, &dummy);
+			}
+			spinlock_destroy(&s->dw_lock);
 		}
-		spinlock_destroy(&s->dw_lock);
+		FREE(page);
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
+	spinlock_destroy(&ss->invalid_slot.dw_lock);
+	for (i=0;i<POOL_CLASS;i++) {
+		pool_freelist(ss->pool[i].free);
+		pool_freelist(ss->pool[i].returned);
+	}
+	close_doorbell(ss);
 	sp_release(ss->event_fd);
+	uring_free(ss);
+	FREE(ss->udpbatch);
 	FREE(ss);
 }
 
@@ -466,7 +759,7 @@ check_wb_list(struct wb_list *s) {
 
 static struct socket *
 new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque, bool add) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	assert(s->type == SOCKET_TYPE_RESERVE);
 
 	if (add) {
@@ -477,13 +770,20 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	}
 
 	s->id = id;
+	s->report_id = id;
 	s->fd = fd;
+	s->uring = 0;
 	s->sending = ID_TAG16(id) << 16 | 0;
 	s->protocol = protocol;
 	s->p.size = MIN_READ_BUFFER;
 	s->opaque = opaque;
 	s->wb_size = 0;
 	s->warn_size = 0;
+	s->warn_high = 0;
+	s->warn_low = 0;
+	s->wb_limit = 0;
+	s->wb_policy = SOCKET_LIMIT_DROP;
+	s->udpbatch = 0;
 	check_wb_list(&s->high);
 	check_wb_list(&s->low);
 	s->dw_buffer = NULL;
@@ -504,6 +804,16 @@ stat_write(struct socket_server *ss, struct socket *s, int n) {
 	s->stat.wtime = ss->time;
 }
 
+// 收数据交给 io_uring 的 socket 在 epoll 里只关心写事件
+static inline void
+enable_write(struct socket_server *ss, struct socket *s, bool enable) {
+	if (s->uring) {
+		sp_enable(ss->event_fd, s->fd, s, false, enable);
+	} else {
+		sp_write(ss->event_fd, s->fd, s, enable);
+	}
+}
+
 // return -1 when connecting
 static int
 open_socket(struct socket_server *ss, struct request_open * request, struct socket_message *result) {
@@ -560,6 +870,9 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 
 	if(status == 0) {
 		ns->type = SOCKET_TYPE_CONNECTED;
+		if (ss->uring) {
+			uring_start(ss, ns, false);
+		}
 		struct sockaddr * addr = ai_ptr->ai_addr;
 		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
 		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
@@ -569,23 +882,92 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		return SOCKET_OPEN;
 	} else {
 		ns->type = SOCKET_TYPE_CONNECTING;
-		sp_write(ss->event_fd, ns->fd, ns, true);
+		enable_write(ss, ns, true);
 	}
 
 	freeaddrinfo( ai_list );
 	return -1;
 _failed:
 	freeaddrinfo( ai_list );
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+	get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 	return SOCKET_ERR;
 }
 
+static ssize_t
+file_send(int sock, int file, int64_t *offset, int64_t sz) {
+#ifdef __linux__
+	off_t off = (off_t)*offset;
+	ssize_t n = sendfile(sock, file, &off, sz > INT_MAX ? INT_MAX : (size_t)sz);
+	if (n > 0) {
+		*offset = off;
+	}
+	return n;
+#else
+	char tmp[16384];
+	ssize_t n = pread(file, tmp, sz < (int64_t)sizeof(tmp) ? (size_t)sz : sizeof(tmp), (off_t)*offset);
+	if (n <= 0) {
+		return n;
+	}
+	n = write(sock, tmp, n);
+	if (n > 0) {
+		*offset += n;
+	}
+	return n;
+#endif
+}
+
+// 链表头是 sendfile 缓冲时由内核直接从文件发送，发完返回 0
+static int
+send_list_file(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
+	struct write_buffer * wb = list->head;
+	while (wb->offset < wb->end) {
+		ssize_t sz = file_send(s->fd, wb->file, &wb->offset, wb->end - wb->offset);
+		if (sz < 0) {
+			switch(errno) {
+			case EINTR:
+				continue;
+			case AGAIN_WOULDBLOCK:
+				return -1;
+			}
+			force_close(ss,s,l,result);
+			return SOCKET_CLOSE;
+		}
+		if (sz == 0) {
+			// 文件比请求的短，剩下的数据永远发不出去，只能断开
+			fprintf(stderr, "socket-server: sendfile (%d) reach the end of file.\n", s->id);
+			force_close(ss,s,l,result);
+			return SOCKET_CLOSE;
+		}
+		stat_write(ss,s,(int)sz);
+		s->wb_size -= sz;
+	}
+	list->head = wb->next;
+	write_buffer_free(ss,wb);
+	return 0;
+}
+
 static int
 send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
+	struct iovec iov[MAX_IOV];
 	while (list->head) {
-		struct write_buffer * tmp = list->head;
+		if (list->head->file >= 0) {
+			int type = send_list_file(ss, s, list, l, result);
+			if (type != 0) {
+				return type;
+			}
+			continue;
+		}
+		// 把链表前面的最多 MAX_IOV 个内存缓冲聚合成一次 writev，遇到 sendfile 缓冲为止
+		struct write_buffer * tmp;
+		int n = 0;
+		for (tmp = list->head; tmp && tmp->file < 0 && n < MAX_IOV; tmp = tmp->next) {
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			++n;
+		}
+		ssize_t sz;
 		for (;;) {
-			ssize_t sz = write(s->fd, tmp->ptr, tmp->sz);
+			sz = writev(s->fd, iov, n);
 			if (sz < 0) {
 				switch(errno) {
 				case EINTR:
@@ -596,17 +978,23 @@ send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 				force_close(ss,s,l,result);
 				return SOCKET_CLOSE;
 			}
-			stat_write(ss,s,(int)sz);
-			s->wb_size -= sz;
-			if (sz != tmp->sz) {
+			break;
+		}
+		stat_write(ss,s,(int)sz);
+		s->wb_size -= sz;
+		int i;
+		for (i=0;i<n;i++) {
+			tmp = list->head;
+			if (sz < tmp->sz) {
+				// 只写出一部分，剩余部分留在 ptr/sz 里等下次可写
 				tmp->ptr += sz;
 				tmp->sz -= sz;
 				return -1;
 			}
-			break;
+			sz -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
 		}
-		list->head = tmp->next;
-		write_buffer_free(ss,tmp);
 	}
 	list->tail = NULL;
 
@@ -646,6 +1034,68 @@ drop_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struc
 	write_buffer_free(ss,tmp);
 }
 
+#ifdef UDP_SENDMMSG
+
+static int
+send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	union sockaddr_all sa[UDP_BATCH];
+	while (list->head) {
+		struct write_buffer * tmp = list->head;
+		int n = 0;
+		while (tmp && n < UDP_BATCH) {
+			socklen_t sasz = udp_socket_address(s, tmp->udp_address, &sa[n]);
+			if (sasz == 0) {
+				break;
+			}
+			struct msghdr *h = &msg[n].msg_hdr;
+			memset(h, 0, sizeof(*h));
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			h->msg_name = &sa[n];
+			h->msg_namelen = sasz;
+			h->msg_iov = &iov[n];
+			h->msg_iovlen = 1;
+			++n;
+			tmp = tmp->next;
+		}
+		if (n == 0) {
+			fprintf(stderr, "socket-server : udp (%d) type mismatch.\n", s->id);
+			drop_udp(ss, s, list, list->head);
+			return -1;
+		}
+		int m = sendmmsg(s->fd, msg, n, 0);
+		if (m < 0) {
+			switch(errno) {
+			case EINTR:
+			case AGAIN_WOULDBLOCK:
+				return -1;
+			}
+			fprintf(stderr, "socket-server : udp (%d) sendto error %s.\n",s->id, strerror(errno));
+			drop_udp(ss, s, list, list->head);
+			return -1;
+		}
+		int i;
+		for (i=0;i<m;i++) {
+			tmp = list->head;
+			stat_write(ss,s,tmp->sz);
+			s->wb_size -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
+		}
+		if (m < n) {
+			// 发送缓冲满了，剩下的等下次可写
+			return -1;
+		}
+	}
+	list->tail = NULL;
+
+	return -1;
+}
+
+#else
+
 static int
 send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
 	while (list->head) {
@@ -678,6 +1128,8 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 	return -1;
 }
 
+#endif
+
 static int
 send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
 	if (s->protocol == PROTOCOL_TCP) {
@@ -718,6 +1170,20 @@ send_buffer_empty(struct socket *s) {
 	return (s->high.head == NULL && s->low.head == NULL);
 }
 
+// 告警后写缓冲降到低水位（默认 0，即发空）以下时通知服务，ud 为 0
+static int
+lowwater_warning(struct socket *s, struct socket_message *result) {
+	if (s->warn_size > 0 && s->wb_size <= s->warn_low) {
+		s->warn_size = 0;
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = 0;
+		result->data = NULL;
+		return SOCKET_WARNING;
+	}
+	return -1;
+}
+
 /*
 	Each socket has two write buffer list, high priority and low priority.
 
@@ -742,30 +1208,22 @@ send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l,
 			// step 3
 			if (list_uncomplete(&s->low)) {
 				raise_uncomplete(s);
-				return -1;
+				return lowwater_warning(s, result);
 			}
 			if (s->low.head)
-				return -1;
+				return lowwater_warning(s, result);
 		} 
 		// step 4
 		assert(send_buffer_empty(s) && s->wb_size == 0);
-		sp_write(ss->event_fd, s->fd, s, false);			
+		enable_write(ss, s, false);			
 
 		if (s->type == SOCKET_TYPE_HALFCLOSE) {
 				force_close(ss, s, l, result);
 				return SOCKET_CLOSE;
 		}
-		if(s->warn_size > 0){
-				s->warn_size = 0;
-				result->opaque = s->opaque;
-				result->id = s->id;
-				result->ud = 0;
-				result->data = NULL;
-				return SOCKET_WARNING;
-		}
 	}
 
-	return -1;
+	return lowwater_warning(s, result);
 }
 
 static int
@@ -780,6 +1238,7 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 		buf->ptr = (char*)so.buffer+s->dw_offset;
 		buf->sz = so.sz - s->dw_offset;
 		buf->buffer = (void *)s->dw_buffer;
+		buf->file = -1;
 		s->wb_size+=buf->sz;
 		if (s->high.head == NULL) {
 			s->high.head = s->high.tail = buf;
@@ -804,6 +1263,7 @@ append_sendbuffer_(struct socket_server *ss, struct wb_list *s, struct request_s
 	buf->ptr = (char*)so.buffer;
 	buf->sz = so.sz;
 	buf->buffer = request->buffer;
+	buf->file = -1;
 	buf->next = NULL;
 	if (s->head == NULL) {
 		s->head = s->tail = buf;
@@ -837,6 +1297,26 @@ append_sendbuffer_low(struct socket_server *ss,struct socket *s, struct request_
 }
 
 
+// 丢掉低优先级链表里还没开始发送的包，发了一部分的链表头要留着，否则数据流会错乱
+static void
+drop_lowpriority(struct socket_server *ss, struct socket *s) {
+	struct wb_list *low = &s->low;
+	struct write_buffer *wb = low->head;
+	struct write_buffer *keep = NULL;
+	if (wb && list_uncomplete(low)) {
+		keep = wb;
+		wb = wb->next;
+		keep->next = NULL;
+	}
+	while (wb) {
+		struct write_buffer *tmp = wb;
+		wb = wb->next;
+		s->wb_size -= tmp->sz;
+		write_buffer_free(ss, tmp);
+	}
+	low->head = low->tail = keep;
+}
+
 /*
 	When send a package , we can assign the priority : PRIORITY_HIGH or PRIORITY_LOW
 
@@ -847,7 +1327,7 @@ append_sendbuffer_low(struct socket_server *ss,struct socket *s, struct request_
 static int
 send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result, int priority, const uint8_t *udp_address) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	struct send_object so;
 	send_object_init(ss, &so, request->buffer, request->sz);
 	if (s->type == SOCKET_TYPE_INVALID || s->id != id 
@@ -861,6 +1341,22 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 		so.free_func(request->buffer);
 		return -1;
 	}
+	if (s->wb_limit > 0 && s->wb_size + so.sz > s->wb_limit) {
+		if (s->wb_policy == SOCKET_LIMIT_CLOSE) {
+			fprintf(stderr, "socket-server: close socket (%d), %lld bytes need to send out exceed the limit.\n", id, (long long)(s->wb_size + so.sz));
+			so.free_func(request->buffer);
+			struct socket_lock l;
+			socket_lock_init(s, &l);
+			force_close(ss, s, &l, result);
+			return SOCKET_CLOSE;
+		}
+		// SOCKET_LIMIT_DROP : 低优先级的数据丢掉，高优先级的照常排队
+		drop_lowpriority(ss, s);
+		if (priority == PRIORITY_LOW) {
+			so.free_func(request->buffer);
+			return -1;
+		}
+	}
 	if (send_buffer_empty(s) && s->type == SOCKET_TYPE_CONNECTED) {
 		if (s->protocol == PROTOCOL_TCP) {
 			append_sendbuffer(ss, s, request);	// add to high priority list, even priority == PRIORITY_LOW
@@ -886,7 +1382,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 				return -1;
 			}
 		}
-		sp_write(ss->event_fd, s->fd, s, true);
+		enable_write(ss, s, true);
 	} else {
 		if (s->protocol == PROTOCOL_TCP) {
 			if (priority == PRIORITY_LOW) {
@@ -901,8 +1397,9 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			append_sendbuffer_udp(ss,s,priority,request,udp_address);
 		}
 	}
-	if (s->wb_size >= WARNING_SIZE && s->wb_size >= s->warn_size) {
-		s->warn_size = s->warn_size == 0 ? WARNING_SIZE *2 : s->warn_size*2;
+	int64_t high = s->warn_high > 0 ? s->warn_high : WARNING_SIZE;
+	if (s->wb_size >= high && s->wb_size >= s->warn_size) {
+		s->warn_size = s->warn_size == 0 ? high *2 : s->warn_size*2;
 		result->opaque = s->opaque;
 		result->id = s->id;
 		result->ud = s->wb_size%1024 == 0 ? s->wb_size/1024 : s->wb_size/1024 + 1;
@@ -912,6 +1409,51 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 	return -1;
 }
 
+/**
+ * 文件作为一个 sendfile 缓冲接在高优先级链表后面，计入 wb_size，等可写时由 send_list_tcp 发送
+ * 这里不发 SOCKET_WARNING，大文件一次性计入的字节数不代表对端读得慢
+*/
+static int
+sendfile_socket(struct socket_server *ss, struct request_sendfile * request) {
+	int id = request->id;
+	struct socket * s = get_socket(ss, id);
+	if (s->type == SOCKET_TYPE_INVALID || s->id != id
+		|| s->type == SOCKET_TYPE_HALFCLOSE
+		|| s->type == SOCKET_TYPE_PACCEPT
+		|| s->type == SOCKET_TYPE_PLISTEN
+		|| s->type == SOCKET_TYPE_LISTEN) {
+		close(request->fd);
+		return -1;
+	}
+	if (s->protocol != PROTOCOL_TCP) {
+		fprintf(stderr, "socket-server: sendfile to udp socket (%d).\n", id);
+		close(request->fd);
+		return -1;
+	}
+	bool idle = send_buffer_empty(s) && s->type == SOCKET_TYPE_CONNECTED;
+	struct write_buffer * buf = MALLOC(SIZEOF_TCPBUFFER);
+	buf->next = NULL;
+	buf->buffer = NULL;
+	buf->ptr = NULL;
+	buf->sz = 0;
+	buf->userobject = false;
+	buf->file = request->fd;
+	buf->offset = request->offset;
+	buf->end = request->offset + request->len;
+	struct wb_list *high = &s->high;
+	if (high->head == NULL) {
+		high->head = high->tail = buf;
+	} else {
+		high->tail->next = buf;
+		high->tail = buf;
+	}
+	s->wb_size += request->len;
+	if (idle) {
+		enable_write(ss, s, true);
+	}
+	return -1;
+}
+
 static int
 listen_socket(struct socket_server *ss, struct request_listen * request, struct socket_message *result) {
 	int id = request->id;
@@ -921,14 +1463,21 @@ listen_socket(struct socket_server *ss, struct request_listen * request, struct
 		goto _failed;
 	}
 	s->type = SOCKET_TYPE_PLISTEN;
+	if (request->report_id >= 0) {
+		s->report_id = request->report_id;
+	}
 	return -1;
 _failed:
 	close(listen_fd);
+	get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
+	if (request->report_id >= 0) {
+		// 副本失败不影响主监听，其余分片照常 accept
+		return -1;
+	}
 	result->opaque = request->opaque;
 	result->id = id;
 	result->ud = 0;
 	result->data = "reach skynet socket number limit";
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
 
 	return SOCKET_ERR;
 }
@@ -941,7 +1490,7 @@ nomore_sending_data(struct socket *s) {
 static int
 close_socket(struct socket_server *ss, struct request_close *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
 		result->id = id;
 		result->opaque = request->opaque;
@@ -958,7 +1507,12 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 			return type;
 	}
 	if (request->shutdown || nomore_sending_data(s)) {
+		int replica = s->report_id != id;
 		force_close(ss,s,&l,result);
+		if (replica) {
+			// 分片监听的副本随主监听一起关闭，只由主监听上报 SOCKET_CLOSE
+			return -1;
+		}
 		result->id = id;
 		result->opaque = request->opaque;
 		return SOCKET_CLOSE;
@@ -992,7 +1546,7 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	result->opaque = request->opaque;
 	result->ud = 0;
 	result->data = NULL;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		result->data = "invalid socket";
 		return SOCKET_ERR;
@@ -1000,13 +1554,20 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	struct socket_lock l;
 	socket_lock_init(s, &l);
 	if (s->type == SOCKET_TYPE_PACCEPT || s->type == SOCKET_TYPE_PLISTEN) {
-		if (sp_add(ss->event_fd, s->fd, s)) {
+		// io_uring 后端的监听 socket 不进 epoll
+		if ((ss->uring == NULL || s->type == SOCKET_TYPE_PACCEPT) && sp_add(ss->event_fd, s->fd, s)) {
 			force_close(ss, s, &l, result);
 			result->data = strerror(errno);
 			return SOCKET_ERR;
 		}
+		if (ss->uring) {
+			uring_start(ss, s, false);
+		}
 		s->type = (s->type == SOCKET_TYPE_PACCEPT) ? SOCKET_TYPE_CONNECTED : SOCKET_TYPE_LISTEN;
 		s->opaque = request->opaque;
+		if (s->report_id != id) {
+			return -1;
+		}
 		result->data = "start";
 		return SOCKET_OPEN;
 	} else if (s->type == SOCKET_TYPE_CONNECTED) {
@@ -1022,7 +1583,7 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 static void
 setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		return;
 	}
@@ -1031,33 +1592,46 @@ setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 }
 
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
-	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			if (errno == EINTR)
-				continue;
-			fprintf(stderr, "socket-server : read pipe error %s.\n",strerror(errno));
-			return;
-		}
-		// must atomic read from a pipe
-		assert(n == sz);
+watermark_socket(struct socket_server *ss, struct request_watermark *request) {
+	int id = request->id;
+	struct socket *s = get_socket(ss, id);
+	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		return;
 	}
+	s->warn_high = request->high;
+	s->warn_low = request->low;
+	s->wb_limit = request->limit;
+	s->wb_policy = (uint8_t)request->policy;
 }
 
-static int
-has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
+static void
+udpbatch_socket(struct socket_server *ss, struct request_setopt *request) {
+	int id = request->id;
+	struct socket *s = get_socket(ss, id);
+	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
+		return;
+	}
+	s->udpbatch = request->value ? 1 : 0;
+}
 
-	FD_SET(ss->recvctrl_fd, &ss->rfds);
-
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {
-		return 1;
+// 清掉门铃上的计数，之后再有命令时才会重新可读
+static void
+clear_doorbell(struct socket_server *ss) {
+	uint64_t tmp[16];
+	for (;;) {
+		int n = read(ss->recvctrl_fd, tmp, sizeof(tmp));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == sizeof(tmp))
+			continue;
+		return;
 	}
-	return 0;
+}
+
+static inline int
+has_cmd(struct socket_server *ss) {
+	struct ctrl_cell *c = &ss->ctrl[ss->ctrl_head % CTRL_RING];
+	return ATOM_LOAD(&c->seq) == ss->ctrl_head + 1;
 }
 
 static void
@@ -1072,7 +1646,7 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 	struct socket *ns = new_fd(ss, id, udp->fd, protocol, udp->opaque, true);
 	if (ns == NULL) {
 		close(udp->fd);
-		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		get_socket(ss, id)->type = SOCKET_TYPE_INVALID;
 		return;
 	}
 	ns->type = SOCKET_TYPE_CONNECTED;
@@ -1082,7 +1656,7 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 static int
 set_udp_address(struct socket_server *ss, struct request_setudp *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = get_socket(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		return -1;
 	}
@@ -1129,7 +1703,7 @@ inc_sending_ref(struct socket *s, int id) {
 
 static inline void
 dec_sending_ref(struct socket_server *ss, int id) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	// Notice: udp may inc sending while type == SOCKET_TYPE_RESERVE
 	if (s->id == id && s->protocol == PROTOCOL_TCP) {
 		assert((s->sending & 0xffff) != 0);
@@ -1140,14 +1714,15 @@ dec_sending_ref(struct socket_server *ss, int id) {
 // return type
 static int
 ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
-	// the length of message is one byte, so 256+8 buffer size is enough.
+	// the length of message is one byte, so 256 buffer size is enough.
 	uint8_t buffer[256];
-	uint8_t header[2];
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
+	struct ctrl_cell *c = &ss->ctrl[ss->ctrl_head % CTRL_RING];
+	int type = c->type;
+	int len = c->len;
+	memcpy(buffer, c->buffer, len);
+	// 复制出来后马上让出格子
+	ATOM_STORE(&c->seq, ss->ctrl_head + CTRL_RING);
+	++ss->ctrl_head;
 	// ctrl command only exist in local fd, so don't worry about endian.
 	switch (type) {
 	case 'S':
@@ -1174,6 +1749,12 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		dec_sending_ref(ss, request->id);
 		return ret;
 	}
+	case 'F': {
+		struct request_sendfile * request = (struct request_sendfile *) buffer;
+		int ret = sendfile_socket(ss, request);
+		dec_sending_ref(ss, request->id);
+		return ret;
+	}
 	case 'A': {
 		struct request_send_udp * rsu = (struct request_send_udp *)buffer;
 		return send_socket(ss, &rsu->send, result, PRIORITY_HIGH, rsu->address);
@@ -1183,6 +1764,12 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'T':
 		setopt_socket(ss, (struct request_setopt *)buffer);
 		return -1;
+	case 'W':
+		watermark_socket(ss, (struct request_watermark *)buffer);
+		return -1;
+	case 'M':
+		udpbatch_socket(ss, (struct request_setopt *)buffer);
+		return -1;
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
@@ -1195,10 +1782,55 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 }
 
 // return -1 (ignore) when error
+/**
+ * 分配至少 *sz 字节的读缓冲，*sz 改为实际容量
+ * 缓冲由收到数据的服务用 skynet_free 释放，池化的缓冲会回到这里
+*/
+static char *
+read_buffer_alloc(struct socket_server *ss, struct socket *s, int *sz) {
+	++s->stat.rbuffer;
+	int cls = 0;
+	while ((MIN_READ_BUFFER << cls) < *sz) {
+		++cls;
+	}
+	if (!ss->pool_enable || cls >= POOL_CLASS) {
+		return MALLOC(*sz);
+	}
+	*sz = MIN_READ_BUFFER << cls;
+	struct buffer_class *c = &ss->pool[cls];
+	if (c->free == NULL && c->returned) {
+		// 取回服务归还的缓冲，超过 POOL_LIMIT 的部分释放掉
+		void * list = ATOM_EXCHANGE(&c->returned, NULL);
+		void ** tail = &c->free;
+		while (list && c->n < POOL_LIMIT) {
+			*tail = list;
+			tail = (void **)list;
+			list = *tail;
+			++c->n;
+		}
+		*tail = NULL;
+		pool_freelist(list);
+	}
+	if (c->free) {
+		char * buffer = c->free;
+		c->free = *(void **)buffer;
+		--c->n;
+		++s->stat.rreuse;
+		return buffer;
+	}
+	char * buffer = skynet_malloc_pool(*sz, c);
+	if (buffer == NULL) {
+		// 内存分配器不支持，不再使用缓冲池
+		ss->pool_enable = 0;
+		return MALLOC(*sz);
+	}
+	return buffer;
+}
+
 static int
 forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	int sz = s->p.size;
-	char * buffer = MALLOC(sz);
+	char * buffer = read_buffer_alloc(ss, s, &sz);
 	int n = (int)read(s->fd, buffer, sz);
 	if (n<0) {
 		FREE(buffer);
@@ -1228,12 +1860,30 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 		return -1;
 	}
 
+	// 缓冲读满说明内核里可能还有数据，在预算内扩大缓冲接着读，合并成一条消息
+	int budget = READ_BUDGET - 1;
+	while (n == sz && budget-- > 0) {
+		sz *= 2;
+		char * tmp = read_buffer_alloc(ss, s, &sz);
+		memcpy(tmp, buffer, n);
+		FREE(buffer);
+		buffer = tmp;
+		int r = (int)read(s->fd, buffer + n, sz - n);
+		if (r <= 0) {
+			// EAGAIN 说明读空了；出错或 EOF 留给下一次可读事件处理，先上报已读到的数据
+			break;
+		}
+		n += r;
+	}
+
 	stat_read(ss,s,n);
 
 	if (n == sz) {
-		s->p.size *= 2;
+		s->p.size = sz * 2;
 	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
-		s->p.size /= 2;
+		s->p.size = sz / 2;
+	} else {
+		s->p.size = sz;
 	}
 
 	result->opaque = s->opaque;
@@ -1261,6 +1911,104 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	return addrsz;
 }
 
+#ifdef UDP_RECVMMSG
+
+static int
+forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	struct udp_batch *b = ss->udpbatch;
+	if (b == NULL) {
+		b = ss->udpbatch = MALLOC(sizeof(*b));
+	}
+	int i;
+	for (i=0;i<UDP_BATCH;i++) {
+		struct msghdr *h = &b->msg[i].msg_hdr;
+		b->iov[i].iov_base = b->buffer[i];
+		b->iov[i].iov_len = MAX_UDP_PACKAGE;
+		memset(h, 0, sizeof(*h));
+		h->msg_name = &b->addr[i];
+		h->msg_namelen = sizeof(b->addr[i]);
+		h->msg_iov = &b->iov[i];
+		h->msg_iovlen = 1;
+	}
+	// 没有要求合并的 socket 一次只收一个包，所有者只会收到 SOCKET_UDP
+	int n = recvmmsg(s->fd, b->msg, s->udpbatch ? UDP_BATCH : 1, 0, NULL);
+	if (n<0) {
+		switch(errno) {
+		case EINTR:
+		case AGAIN_WOULDBLOCK:
+			break;
+		default:
+			// close when error
+			force_close(ss, s, l, result);
+			result->data = strerror(errno);
+			return SOCKET_ERR;
+		}
+		return -1;
+	}
+
+	socklen_t slen;
+	int addrsz;
+	if (s->protocol == PROTOCOL_UDP) {
+		slen = sizeof(b->addr[0].v4);
+		addrsz = 1+2+4;
+	} else {
+		slen = sizeof(b->addr[0].v6);
+		addrsz = 1+2+16;
+	}
+	// 丢掉地址族与 socket 不符的包
+	int count = 0;
+	int last = 0;
+	size_t total = 0;
+	for (i=0;i<n;i++) {
+		int len = (int)b->msg[i].msg_len;
+		stat_read(ss,s,len);
+		if (b->msg[i].msg_hdr.msg_namelen != slen) {
+			b->msg[i].msg_len = (unsigned)-1;
+			continue;
+		}
+		++count;
+		last = i;
+		total += sizeof(int) + 1 + addrsz + len;
+	}
+	if (count == 0) {
+		return -1;
+	}
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	if (count == 1) {
+		int len = (int)b->msg[last].msg_len;
+		uint8_t * data = MALLOC(len + addrsz);
+		memcpy(data, b->buffer[last], len);
+		gen_udp_address(s->protocol, &b->addr[last], data + len);
+		result->ud = len;
+		result->data = (char *)data;
+		return SOCKET_UDP;
+	}
+
+	// 每个包依次为：int 数据长度 + uint8 地址长度 + udp 地址 + 数据
+	uint8_t * data = MALLOC(total);
+	uint8_t * ptr = data;
+	for (i=0;i<n;i++) {
+		int len = (int)b->msg[i].msg_len;
+		if (len < 0) {
+			continue;
+		}
+		memcpy(ptr, &len, sizeof(len));
+		ptr += sizeof(len);
+		*ptr++ = (uint8_t)addrsz;
+		ptr += gen_udp_address(s->protocol, &b->addr[i], ptr);
+		memcpy(ptr, b->buffer[i], len);
+		ptr += len;
+	}
+	result->ud = (int)total;
+	result->data = (char *)data;
+
+	return SOCKET_UDPBATCH;
+}
+
+#else
+
 static int
 forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	union sockaddr_all sa;
@@ -1303,6 +2051,8 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lo
 	return SOCKET_UDP;
 }
 
+#endif
+
 static int
 report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	int error;
@@ -1320,7 +2070,9 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l
 		result->opaque = s->opaque;
 		result->id = s->id;
 		result->ud = 0;
-		if (nomore_sending_data(s)) {
+		if (ss->uring) {
+			uring_start(ss, s, !nomore_sending_data(s));
+		} else if (nomore_sending_data(s)) {
 			sp_write(ss->event_fd, s->fd, s, false);
 		}
 		union sockaddr_all u;
@@ -1351,23 +2103,9 @@ getname(union sockaddr_all *u, char *buffer, size_t sz) {
 	}
 }
 
-// return 0 when failed, or -1 when file limit
+// return 0 when failed
 static int
-report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
-	union sockaddr_all u;
-	socklen_t len = sizeof(u);
-	int client_fd = accept(s->fd, &u.s, &len);
-	if (client_fd < 0) {
-		if (errno == EMFILE || errno == ENFILE) {
-			result->opaque = s->opaque;
-			result->id = s->id;
-			result->ud = 0;
-			result->data = strerror(errno);
-			return -1;
-		} else {
-			return 0;
-		}
-	}
+accept_fd(struct socket_server *ss, struct socket *s, int client_fd, union sockaddr_all *u, struct socket_message *result) {
 	int id = reserve_id(ss);
 	if (id < 0) {
 		close(client_fd);
@@ -1385,17 +2123,184 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 
 	ns->type = SOCKET_TYPE_PACCEPT;
 	result->opaque = s->opaque;
-	result->id = s->id;
+	result->id = s->report_id;
 	result->ud = id;
 	result->data = NULL;
 
-	if (getname(&u, ss->buffer, sizeof(ss->buffer))) {
+	if (getname(u, ss->buffer, sizeof(ss->buffer))) {
 		result->data = ss->buffer;
 	}
 
 	return 1;
 }
 
+// return 0 when failed, or -1 when file limit
+static int
+report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	union sockaddr_all u;
+	socklen_t len = sizeof(u);
+	int client_fd = accept(s->fd, &u.s, &len);
+	if (client_fd < 0) {
+		if (errno == EMFILE || errno == ENFILE) {
+			result->opaque = s->opaque;
+			result->id = s->report_id;
+			result->ud = 0;
+			result->data = strerror(errno);
+			return -1;
+		} else {
+			return 0;
+		}
+	}
+	return accept_fd(ss, s, client_fd, &u, result);
+}
+
+#ifdef SOCKET_URING
+
+/**
+ * 取一批事件：io_uring 的完成事件原样放进 ev，epoll fd 可读的完成事件展开成 epoll 的就绪事件
+ * epoll fd 用一次性的 poll 请求，每次取完就绪事件后重新挂上，还有没取完的就绪事件时会马上再次完成
+*/
+static int
+uring_wait(struct socket_server *ss, struct event *e, int max) {
+	struct uring *u = ss->uring;
+	for (;;) {
+		int n = 0;
+		struct io_uring_cqe cqe;
+		while (n < max && uring_peek(u, &cqe)) {
+			switch (URING_OP(cqe.user_data)) {
+			case URING_EPOLL: {
+				int r = sp_poll(ss->event_fd, e + n, max - n, 0);
+				if (r > 0) {
+					n += r;
+				}
+				uring_poll(u, ss->event_fd, URING_EPOLL);
+				break;
+			}
+			case URING_CANCEL:
+				break;
+			default:
+				e[n].s = NULL;
+				e[n].complete = cqe.user_data;
+				e[n].res = cqe.res;
+				e[n].flags = cqe.flags;
+				++n;
+				break;
+			}
+		}
+		if (n > 0) {
+			uring_submit(u, 0);
+			return n;
+		}
+		if (uring_submit(u, 1) < 0 && errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+static int
+report_uring(struct socket_server *ss, struct event *e, struct socket_message *result) {
+	struct uring *u = ss->uring;
+	int id = URING_ID(e->complete);
+	int op = URING_OP(e->complete);
+	int bid = (e->flags & IORING_CQE_F_BUFFER) ? (int)(e->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+	bool more = (e->flags & IORING_CQE_F_MORE) != 0;
+	struct socket *s = get_socket(ss, id);
+	if (s->id != id || s->uring != op) {
+		// 已经关闭的 socket 残留的完成事件
+		if (op == URING_ACCEPT && e->res >= 0) {
+			close(e->res);
+		}
+		if (bid >= 0) {
+			uring_recycle(u, bid);
+		}
+		return -1;
+	}
+	if (op == URING_ACCEPT) {
+		if (!more) {
+			uring_accept(u, s->fd, e->complete);
+		}
+		if (e->res < 0) {
+			if (e->res == -EMFILE || e->res == -ENFILE) {
+				result->opaque = s->opaque;
+				result->id = s->report_id;
+				result->ud = 0;
+				result->data = strerror(-e->res);
+				return SOCKET_ERR;
+			}
+			return -1;
+		}
+		union sockaddr_all addr;
+		socklen_t len = sizeof(addr);
+		if (getpeername(e->res, &addr.s, &len) != 0) {
+			memset(&addr, 0, sizeof(addr));
+		}
+		return accept_fd(ss, s, e->res, &addr, result) ? SOCKET_ACCEPT : -1;
+	}
+	if (e->res > 0) {
+		if (!more) {
+			uring_recv(u, s->fd, e->complete);
+		}
+		if (s->type == SOCKET_TYPE_HALFCLOSE) {
+			// discard recv data
+			uring_recycle(u, bid);
+			return -1;
+		}
+		// 缓冲区环里的缓冲要马上还回去，数据复制到读缓冲里交给服务
+		int sz = e->res;
+		char * buffer = read_buffer_alloc(ss, s, &sz);
+		memcpy(buffer, uring_buffer(u, bid), e->res);
+		uring_recycle(u, bid);
+		stat_read(ss, s, e->res);
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = e->res;
+		result->data = buffer;
+		return SOCKET_DATA;
+	}
+	if (bid >= 0) {
+		uring_recycle(u, bid);
+	}
+	if (e->res == -ENOBUFS) {
+		// 缓冲区环暂时用光了，recv 被内核终止，重新挂上
+		uring_recv(u, s->fd, e->complete);
+		return -1;
+	}
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	if (e->res == 0) {
+		force_close(ss, s, &l, result);
+		return SOCKET_CLOSE;
+	}
+	force_close(ss, s, &l, result);
+	result->data = strerror(-e->res);
+	return SOCKET_ERR;
+}
+
+int
+socket_server_uring(struct socket_server *ss) {
+	struct uring *u = uring_create();
+	if (u == NULL) {
+		fprintf(stderr, "socket-server: io_uring is not available, use epoll.\n");
+		return -1;
+	}
+	ss->uring = u;
+	uring_poll(u, ss->event_fd, URING_EPOLL);
+	return 0;
+}
+
+#else
+
+static int uring_wait(struct socket_server *ss, struct event *e, int max) { return -1; }
+static int report_uring(struct socket_server *ss, struct event *e, struct socket_message *result) { return -1; }
+
+int
+socket_server_uring(struct socket_server *ss) {
+	fprintf(stderr, "socket-server: io_uring is not supported, use epoll.\n");
+	return -1;
+}
+
+#endif
+
 static inline void 
 clear_closed_event(struct socket_server *ss, struct socket_message * result, int type) {
 	if (type == SOCKET_CLOSE || type == SOCKET_ERR) {
@@ -1404,6 +2309,7 @@ clear_closed_event(struct socket_server *ss, struct socket_message * result, int
 		for (i=ss->event_index; i<ss->event_n; i++) {
 			struct event *e = &ss->ev[i];
 			struct socket *s = e->s;
+			// io_uring 的完成事件处理时会自己核对 id
 			if (s) {
 				if (s->type == SOCKET_TYPE_INVALID && s->id == id) {
 					e->s = NULL;
@@ -1431,7 +2337,20 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			}
 		}
 		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
+			// 先声明要阻塞了再确认命令环是空的，之后写入命令的工作线程会看到 ctrl_sleep 并敲门铃
+			ss->ctrl_sleep = 1;
+			ATOM_SYNC();
+			if (has_cmd(ss)) {
+				ss->ctrl_sleep = 0;
+				ss->checkctrl = 1;
+				continue;
+			}
+			if (ss->uring) {
+				ss->event_n = uring_wait(ss, ss->ev, MAX_EVENT);
+			} else {
+				ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
+			}
+			ss->ctrl_sleep = 0;
 			ss->checkctrl = 1;
 			if (more) {
 				*more = 0;
@@ -1446,9 +2365,17 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			}
 		}
 		struct event *e = &ss->ev[ss->event_index++];
+		if (e->complete) {
+			int type = report_uring(ss, e, result);
+			if (type == -1)
+				continue;
+			clear_closed_event(ss, result, type);
+			return type;
+		}
 		struct socket *s = e->s;
 		if (s == NULL) {
-			// dispatch pipe message at beginning
+			// 门铃，命令在下一轮开头处理
+			clear_doorbell(ss);
 			continue;
 		}
 		struct socket_lock l;
@@ -1470,16 +2397,20 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			fprintf(stderr, "socket-server: invalid socket\n");
 			break;
 		default:
+			if (e->read && s->uring) {
+				// 数据、EOF 和错误都由 io_uring 的 recv 送来
+				e->read = false;
+			}
 			if (e->read) {
 				int type;
 				if (s->protocol == PROTOCOL_TCP) {
 					type = forward_message_tcp(ss, s, &l, result);
 				} else {
 					type = forward_message_udp(ss, s, &l, result);
-					if (type == SOCKET_UDP) {
+					if (type == SOCKET_UDP || type == SOCKET_UDPBATCH) {
 						// try read again
 						--ss->event_index;
-						return SOCKET_UDP;
+						return type;
 					}
 				}
 				if (e->write && type != SOCKET_CLOSE && type != SOCKET_ERR) {
@@ -1524,22 +2455,44 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 }
 
 static void
-send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
+ring_doorbell(struct socket_server *ss) {
+	uint64_t one = 1;
 	for (;;) {
-		ssize_t n = write(ss->sendctrl_fd, &request->header[6], len+2);
+		ssize_t n = write(ss->sendctrl_fd, &one, sizeof(one));
 		if (n<0) {
-			if (errno != EINTR) {
-				fprintf(stderr, "socket-server : send ctrl command error %s.\n", strerror(errno));
+			if (errno == EINTR)
+				continue;
+			// 管道满了说明门铃已经响着
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				fprintf(stderr, "socket-server : ring doorbell error %s.\n", strerror(errno));
 			}
-			continue;
 		}
-		assert(n == len+2);
 		return;
 	}
 }
 
+/**
+ * 多生产者单消费者的无锁命令环：工作线程原子地取票号，等到对应的格子空闲后写入命令再发布
+ * 只有 socket 线程准备阻塞（ctrl_sleep）时才敲门铃，忙的时候它会在阻塞前自己检查命令环
+*/
+static void
+send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
+	uint32_t ticket = ATOM_FINC(&ss->ctrl_tail);
+	struct ctrl_cell *c = &ss->ctrl[ticket % CTRL_RING];
+	while (ATOM_LOAD(&c->seq) != ticket) {
+		// 命令环满了，等 socket 线程取走
+		sched_yield();
+	}
+	c->type = (uint8_t)type;
+	c->len = (uint8_t)len;
+	memcpy(c->buffer, request->u.buffer, len);
+	ATOM_STORE(&c->seq, ticket + 1);
+	ATOM_SYNC();
+	if (ss->ctrl_sleep && ATOM_CAS(&ss->ctrl_sleep, 1, 0)) {
+		ring_doorbell(ss);
+	}
+}
+
 static int
 open_request(struct socket_server *ss, struct request_package *req, uintptr_t opaque, const char *addr, int port) {
 	int len = strlen(addr);
@@ -1577,7 +2530,7 @@ can_direct_write(struct socket *s, int id) {
 // return -1 when error, 0 when success
 int 
 socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		free_buffer(ss, buffer, sz);
 		return -1;
@@ -1622,7 +2575,7 @@ socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz
 			s->dw_size = sz;
 			s->dw_offset = n;
 
-			sp_write(ss->event_fd, s->fd, s, true);
+			enable_write(ss, s, true);
 
 			socket_unlock(&l);
 			return 0;
@@ -1641,10 +2594,93 @@ socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz
 	return 0;
 }
 
+// 把 v 中从第 skip 字节开始的内容拷贝到一块新分配的缓冲里
+static void *
+concat_iovec(const struct socket_iovec *v, int n, size_t skip, size_t sz) {
+	char * buffer = MALLOC(sz);
+	char * ptr = buffer;
+	int i;
+	for (i=0;i<n;i++) {
+		size_t len = v[i].sz;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		memcpy(ptr, (const char *)v[i].buffer + skip, len - skip);
+		ptr += len - skip;
+		skip = 0;
+	}
+	return buffer;
+}
+
+/**
+ * 多块缓冲一起发送：能直接写时在工作线程里 writev，缓冲不用先拼接成一块
+ * 没写完的部分才拷贝出来，像 socket_server_send 一样放进 dw_buffer 交给 socket 线程
+ * 不能直接写（或是 udp）时拼接成一块，走 socket_server_send
+*/
+// return -1 when error, 0 when success
+int
+socket_server_sendv(struct socket_server *ss, int id, const struct socket_iovec *v, int n) {
+	struct socket * s = get_socket(ss, id);
+	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
+		return -1;
+	}
+	size_t total = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		total += v[i].sz;
+	}
+	if (total > INT_MAX) {
+		fprintf(stderr, "socket-server : sendv (%d) package is too large.\n", id);
+		return -1;
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+
+	if (s->protocol == PROTOCOL_TCP && can_direct_write(s,id) && socket_trylock(&l)) {
+		// may be we can send directly, double check
+		if (can_direct_write(s,id)) {
+			struct iovec iov[MAX_IOV];
+			int iovcnt = n < MAX_IOV ? n : MAX_IOV;
+			for (i=0;i<iovcnt;i++) {
+				iov[i].iov_base = (void *)v[i].buffer;
+				iov[i].iov_len = v[i].sz;
+			}
+			ssize_t sent = writev(s->fd, iov, iovcnt);
+			if (sent < 0) {
+				// ignore error, let socket thread try again
+				sent = 0;
+			}
+			stat_write(ss,s,(int)sent);
+			if ((size_t)sent == total) {
+				socket_unlock(&l);
+				return 0;
+			}
+			// 剩下的部分拷贝出来交给 socket 线程，见 send_buffer()
+			int sz = (int)(total - sent);
+			s->dw_buffer = concat_iovec(v, n, sent, sz);
+			s->dw_size = sz;
+			s->dw_offset = 0;
+
+			enable_write(ss, s, true);
+
+			socket_unlock(&l);
+			return 0;
+		}
+		socket_unlock(&l);
+	}
+
+	return socket_server_send(ss, id, concat_iovec(v, n, 0, total), (int)total);
+}
+
 // return -1 when error, 0 when success
 int 
 socket_server_send_lowpriority(struct socket_server *ss, int id, const void * buffer, int sz) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		free_buffer(ss, buffer, sz);
 		return -1;
@@ -1661,6 +2697,30 @@ socket_server_send_lowpriority(struct socket_server *ss, int id, const void * bu
 	return 0;
 }
 
+int
+socket_server_sendfile(struct socket_server *ss, int id, int fd, int64_t offset, int64_t len) {
+	struct socket * s = get_socket(ss, id);
+	if (s->id != id || s->type == SOCKET_TYPE_INVALID || offset < 0 || len < 0) {
+		close(fd);
+		return -1;
+	}
+	if (len == 0) {
+		close(fd);
+		return 0;
+	}
+
+	inc_sending_ref(s, id);
+
+	struct request_package request;
+	request.u.sendfile.id = id;
+	request.u.sendfile.fd = fd;
+	request.u.sendfile.offset = offset;
+	request.u.sendfile.len = len;
+
+	send_request(ss, &request, 'F', sizeof(request.u.sendfile));
+	return 0;
+}
+
 void
 socket_server_exit(struct socket_server *ss) {
 	struct request_package request;
@@ -1689,7 +2749,7 @@ socket_server_shutdown(struct socket_server *ss, uintptr_t opaque, int id) {
 // return -1 means failed
 // or return AF_INET or AF_INET6
 static int
-do_bind(const char *host, int port, int protocol, int *family) {
+do_bind(const char *host, int port, int protocol, int reuseport, int *family) {
 	int fd;
 	int status;
 	int reuse = 1;
@@ -1722,6 +2782,11 @@ do_bind(const char *host, int port, int protocol, int *family) {
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
 		goto _failed;
 	}
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+		goto _failed;
+	}
+#endif
 	status = bind(fd, (struct sockaddr *)ai_list->ai_addr, ai_list->ai_addrlen);
 	if (status != 0)
 		goto _failed;
@@ -1736,9 +2801,9 @@ _failed_fd:
 }
 
 static int
-do_listen(const char * host, int port, int backlog) {
+do_listen(const char * host, int port, int backlog, int reuseport) {
 	int family = 0;
-	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family);
+	int listen_fd = do_bind(host, port, IPPROTO_TCP, reuseport, &family);
 	if (listen_fd < 0) {
 		return -1;
 	}
@@ -1749,9 +2814,9 @@ do_listen(const char * host, int port, int backlog) {
 	return listen_fd;
 }
 
-int 
-socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
-	int fd = do_listen(addr, port, backlog);
+static int
+listen_request(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog, int reuseport, int report_id) {
+	int fd = do_listen(addr, port, backlog, reuseport);
 	if (fd < 0) {
 		return -1;
 	}
@@ -1764,10 +2829,28 @@ socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * ad
 	request.u.listen.opaque = opaque;
 	request.u.listen.id = id;
 	request.u.listen.fd = fd;
+	request.u.listen.report_id = report_id;
 	send_request(ss, &request, 'L', sizeof(request.u.listen));
 	return id;
 }
 
+int 
+socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
+	return listen_request(ss, opaque, addr, port, backlog, 0, -1);
+}
+
+int
+socket_server_listen_reuseport(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog, int report_id) {
+#ifdef SO_REUSEPORT
+	return listen_request(ss, opaque, addr, port, backlog, 1, report_id);
+#else
+	if (report_id >= 0) {
+		return -1;
+	}
+	return listen_request(ss, opaque, addr, port, backlog, 0, -1);
+#endif
+}
+
 int
 socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	struct request_package request;
@@ -1798,6 +2881,26 @@ socket_server_nodelay(struct socket_server *ss, int id) {
 	send_request(ss, &request, 'T', sizeof(request.u.setopt));
 }
 
+void
+socket_server_watermark(struct socket_server *ss, int id, int64_t high, int64_t low, int64_t limit, int policy) {
+	struct request_package request;
+	request.u.watermark.id = id;
+	request.u.watermark.policy = policy;
+	request.u.watermark.high = high;
+	request.u.watermark.low = low;
+	request.u.watermark.limit = limit;
+	send_request(ss, &request, 'W', sizeof(request.u.watermark));
+}
+
+void
+socket_server_udpbatch(struct socket_server *ss, int id, int enable) {
+	struct request_package request;
+	request.u.setopt.id = id;
+	request.u.setopt.what = 0;
+	request.u.setopt.value = enable;
+	send_request(ss, &request, 'M', sizeof(request.u.setopt));
+}
+
 void 
 socket_server_userobject(struct socket_server *ss, struct socket_object_interface *soi) {
 	ss->soi = *soi;
@@ -1811,7 +2914,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	int family;
 	if (port != 0 || addr != NULL) {
 		// bind
-		fd = do_bind(addr, port, IPPROTO_UDP, &family);
+		fd = do_bind(addr, port, IPPROTO_UDP, 0, &family);
 		if (fd < 0) {
 			return -1;
 		}
@@ -1841,7 +2944,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 
 int 
 socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp_address *addr, const void *buffer, int sz) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		free_buffer(ss, buffer, sz);
 		return -1;
@@ -1903,7 +3006,7 @@ socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp
 
 int
 socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, int port) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = get_socket(ss, id);
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		return -1;
 	}
@@ -2026,6 +3129,8 @@ query_info(struct socket *s, struct socket_info *si) {
 	si->rtime = s->stat.rtime;
 	si->wtime = s->stat.wtime;
 	si->wbuffer = s->wb_size;
+	si->rbuffer = s->stat.rbuffer;
+	si->rreuse = s->stat.rreuse;
 
 	return 1;
 }
@@ -2034,8 +3139,9 @@ struct socket_info *
 socket_server_info(struct socket_server *ss) {
 	int i;
 	struct socket_info * si = NULL;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket * s = &ss->slot[i];
+	int cap = ATOM_LOAD(&ss->slot_cap);
+	for (i=0;i<cap;i++) {
+		struct socket * s = &ss->slot[i >> SLOT_PAGE_P][i & (SLOT_PAGE - 1)];
 		int id = s->id;
 		struct socket_info temp;
 		if (query_info(s, &temp) && s->id == id) {
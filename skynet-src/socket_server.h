@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "socket_info.h"
+#include "socket_buffer.h"
 
 #define SOCKET_DATA 0
 #define SOCKET_CLOSE 1
@@ -12,6 +13,7 @@
 #define SOCKET_EXIT 5
 #define SOCKET_UDP 6
 #define SOCKET_WARNING 7
+#define SOCKET_UDPBATCH 8
 
 struct socket_server;
 
@@ -22,8 +24,11 @@ struct socket_message {
 	char * data;
 };
 
-struct socket_server * socket_server_create(uint64_t time);
+// shard/shard_count: 多个 socket_server 分片时，本实例只分配 id % shard_count == shard 的 id
+struct socket_server * socket_server_create(uint64_t time, int shard, int shard_count);
 void socket_server_release(struct socket_server *);
+// 改用 io_uring 后端（tcp 的 accept 与收数据走 io_uring），需在创建后、使用前调用；不支持时返回 -1，仍用 epoll
+int socket_server_uring(struct socket_server *);
 void socket_server_updatetime(struct socket_server *, uint64_t time);
 int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
 
@@ -35,15 +40,27 @@ void socket_server_start(struct socket_server *, uintptr_t opaque, int id);
 // return -1 when error
 int socket_server_send(struct socket_server *, int id, const void * buffer, int sz);
 int socket_server_send_lowpriority(struct socket_server *, int id, const void * buffer, int sz);
+// send several buffers as one package, the buffers are still owned by caller.
+// try writev directly in the caller's thread first, only the unsent part is copied and queued.
+int socket_server_sendv(struct socket_server *, int id, const struct socket_iovec *v, int n);
+// send [offset, offset+len) of file fd by sendfile in socket thread, the fd is owned (and closed) by socket_server
+int socket_server_sendfile(struct socket_server *, int id, int fd, int64_t offset, int64_t len);
 
 // ctrl command below returns id
 int socket_server_listen(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
+// listen with SO_REUSEPORT, so that several socket_server can accept on the same port.
+// if report_id >= 0, the socket is a replica : accept reports use report_id, start/close report nothing.
+int socket_server_listen_reuseport(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog, int report_id);
 int socket_server_connect(struct socket_server *, uintptr_t opaque, const char * addr, int port);
 int socket_server_bind(struct socket_server *, uintptr_t opaque, int fd);
 
 // for tcp
 void socket_server_nodelay(struct socket_server *, int id);
 
+// SOCKET_WARNING is reported when the write buffer grows above high (ud is the size in K, 0 means the default 1M),
+// and again (ud is 0) when it drains below low after that. limit is the hard cap of the write buffer, 0 means no limit.
+void socket_server_watermark(struct socket_server *, int id, int64_t high, int64_t low, int64_t limit, int policy);
+
 struct socket_udp_address;
 
 // create an udp socket handle, attach opaque with it . udp socket don't need call socket_server_start to recv message
@@ -54,6 +71,8 @@ int socket_server_udp_connect(struct socket_server *, int id, const char * addr,
 // If the socket_udp_address is NULL, use last call socket_server_udp_connect address instead
 // You can also use socket_server_send 
 int socket_server_udp_send(struct socket_server *, int id, const struct socket_udp_address *, const void *buffer, int sz);
+// Deliver several ready packets as one SOCKET_UDPBATCH (linux only). Off by default, the owner gets one SOCKET_UDP per packet.
+void socket_server_udpbatch(struct socket_server *, int id, int enable);
 // extract the address of the message, struct socket_message * should be SOCKET_UDP
 const struct socket_udp_address * socket_server_udp_address(struct socket_server *, struct socket_message *, int *addrsz);
 
@@ -63,6 +82,9 @@ struct socket_object_interface {
 	void (*free)(void *);
 };
 
+// 读缓冲池的释放回调，由 skynet_pool_hook 安装一次，所有分片共用
+void socket_server_pool_release(void *ud, void *ptr);
+
 // if you send package sz == -1, use soi.
 void socket_server_userobject(struct socket_server *, struct socket_object_interface *soi);
 
@@ -0,0 +1,293 @@
+#ifndef poll_socket_uring_h
+#define poll_socket_uring_h
+
+/**
+ * io_uring 后端
+ * tcp 的 accept 与收数据交给 io_uring：监听 socket 挂一个 multishot accept，连接挂一个 multishot recv，
+ * 数据收进注册给内核的缓冲区环（provided buffer ring）；控制管道、connect、udp 与写就绪仍然走 epoll，
+ * epoll fd 本身作为一个 poll 请求挂在 io_uring 上，socket 线程只阻塞在 io_uring_enter
+ * 只用到内核接口（不依赖 liburing），multishot recv 需要 6.0 以上的内核，创建时实测一次，不支持就用回 epoll
+*/
+
+#include <linux/io_uring.h>
+
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)	// 6.0 的头文件，缓冲区环也在其中
+#define SOCKET_URING
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "skynet_malloc.h"
+
+#define URING_SQ 256
+#define URING_CQ 4096
+#define URING_BUFFER_N 512			// 缓冲区环的缓冲数量，必须是 2 的幂
+#define URING_BUFFER_SIZE 8192
+#define URING_BGID 0
+
+// user_data 的低 8 位是操作类型，其余是 socket id
+#define URING_EPOLL 1
+#define URING_ACCEPT 2
+#define URING_RECV 3
+#define URING_CANCEL 4
+
+#define URING_UD(id, op) ((uint64_t)(unsigned)(id) << 8 | (op))
+#define URING_ID(ud) ((int)((ud) >> 8))
+#define URING_OP(ud) ((int)((ud) & 0xff))
+
+struct uring {
+	int fd;
+	unsigned sq_tail;		// 本地的提交队列尾，uring_submit 时才写回内核
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned * sq_khead;
+	unsigned * sq_ktail;
+	struct io_uring_sqe * sqes;
+	unsigned cq_mask;
+	unsigned * cq_khead;
+	unsigned * cq_ktail;
+	struct io_uring_cqe * cqes;
+	void * sq_ring;
+	size_t sq_ring_sz;
+	void * cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	struct io_uring_buf_ring * br;
+	size_t br_sz;
+	unsigned short br_tail;
+	char * buffer;
+};
+
+static inline int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// 提交所有排队的请求，wait 为 1 时等到至少一个完成事件
+static int
+uring_submit(struct uring *u, int wait) {
+	__atomic_store_n(u->sq_ktail, u->sq_tail, __ATOMIC_RELEASE);
+	unsigned n = u->sq_tail - __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE);
+	if (n == 0 && !wait) {
+		return 0;
+	}
+	return uring_enter(u->fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *u) {
+	while (u->sq_tail - __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		// 提交队列满了，先交给内核
+		uring_submit(u, 0);
+	}
+	struct io_uring_sqe *sqe = &u->sqes[u->sq_tail & u->sq_mask];
+	++u->sq_tail;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+// 取一个完成事件，没有时返回 0
+static int
+uring_peek(struct uring *u, struct io_uring_cqe *cqe) {
+	unsigned head = *u->cq_khead;
+	if (head == __atomic_load_n(u->cq_ktail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	*cqe = u->cqes[head & u->cq_mask];
+	__atomic_store_n(u->cq_khead, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static void
+uring_poll(struct uring *u, int fd, uint64_t ud) {
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = ud;
+}
+
+static void
+uring_accept(struct uring *u, int fd, uint64_t ud) {
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = ud;
+}
+
+static void
+uring_recv(struct uring *u, int fd, uint64_t ud) {
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = ud;
+}
+
+static void
+uring_cancel(struct uring *u, uint64_t ud) {
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = ud;
+	sqe->user_data = URING_CANCEL;
+}
+
+static inline char *
+uring_buffer(struct uring *u, int bid) {
+	return u->buffer + (size_t)bid * URING_BUFFER_SIZE;
+}
+
+// 把用完的缓冲还给缓冲区环
+static void
+uring_recycle(struct uring *u, int bid) {
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUFFER_N - 1)];
+	// 不能清零整个 io_uring_buf，bufs[0] 的 resv 与环的 tail 重叠
+	b->addr = (uint64_t)(uintptr_t)uring_buffer(u, bid);
+	b->len = URING_BUFFER_SIZE;
+	b->bid = (uint16_t)bid;
+	++u->br_tail;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void
+uring_release(struct uring *u) {
+	close(u->fd);
+	if (u->br) {
+		munmap(u->br, u->br_sz);
+	}
+	if (u->buffer) {
+		munmap(u->buffer, (size_t)URING_BUFFER_N * URING_BUFFER_SIZE);
+	}
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_sz);
+	}
+	if (u->cq_ring) {
+		munmap(u->cq_ring, u->cq_ring_sz);
+	}
+	if (u->sq_ring) {
+		munmap(u->sq_ring, u->sq_ring_sz);
+	}
+	skynet_free(u);
+}
+
+static void *
+uring_mmap(int fd, size_t sz, off_t offset) {
+	void * p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/**
+ * 用一对 unix socket 实测 multishot recv + 缓冲区环：
+ * 老内核不认识 IORING_RECV_MULTISHOT 也不会报错，只会少了 IORING_CQE_F_MORE
+*/
+static int
+uring_probe(struct uring *u) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		return 0;
+	}
+	uring_recv(u, sv[0], URING_UD(0, URING_RECV));
+	int ok = 0;
+	struct io_uring_cqe cqe;
+	if (write(sv[1], "x", 1) == 1 && uring_submit(u, 1) >= 0 && uring_peek(u, &cqe)) {
+		ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE) && (cqe.flags & IORING_CQE_F_BUFFER);
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			uring_recycle(u, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+	}
+	// 关掉对端让 recv 收到 EOF 结束，再取走它的完成事件
+	close(sv[1]);
+	if (ok) {
+		while (!uring_peek(u, &cqe)) {
+			if (uring_submit(u, 1) < 0 && errno != EINTR) {
+				ok = 0;
+				break;
+			}
+		}
+	}
+	close(sv[0]);
+	return ok;
+}
+
+static struct uring *
+uring_create() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ;
+	int fd = (int)syscall(__NR_io_uring_setup, URING_SQ, &p);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct uring *u = skynet_malloc(sizeof(*u));
+	memset(u, 0, sizeof(*u));
+	u->fd = fd;
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq_ring = uring_mmap(fd, u->sq_ring_sz, IORING_OFF_SQ_RING);
+	u->cq_ring = uring_mmap(fd, u->cq_ring_sz, IORING_OFF_CQ_RING);
+	u->sqes = uring_mmap(fd, u->sqes_sz, IORING_OFF_SQES);
+	if (u->sq_ring == NULL || u->cq_ring == NULL || u->sqes == NULL) {
+		uring_release(u);
+		return NULL;
+	}
+	char * sq = u->sq_ring;
+	char * cq = u->cq_ring;
+	u->sq_khead = (unsigned *)(sq + p.sq_off.head);
+	u->sq_ktail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_tail = *u->sq_ktail;
+	// 提交队列的下标数组固定成一一对应
+	unsigned * array = (unsigned *)(sq + p.sq_off.array);
+	unsigned i;
+	for (i=0;i<p.sq_entries;i++) {
+		array[i] = i;
+	}
+	u->cq_khead = (unsigned *)(cq + p.cq_off.head);
+	u->cq_ktail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	// 缓冲区环要求页对齐，直接 mmap
+	u->br_sz = URING_BUFFER_N * sizeof(struct io_uring_buf);
+	void * br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	void * buffer = mmap(NULL, (size_t)URING_BUFFER_N * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->br = br == MAP_FAILED ? NULL : br;
+	u->buffer = buffer == MAP_FAILED ? NULL : buffer;
+	if (u->br == NULL || u->buffer == NULL) {
+		uring_release(u);
+		return NULL;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+	reg.ring_entries = URING_BUFFER_N;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		uring_release(u);
+		return NULL;
+	}
+	for (i=0;i<URING_BUFFER_N;i++) {
+		uring_recycle(u, i);
+	}
+	if (!uring_probe(u)) {
+		uring_release(u);
+		return NULL;
+	}
+	return u;
+}
+
+#endif
+
+#endif
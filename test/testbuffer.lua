@@ -0,0 +1,194 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- sharebuffer：打包一次发给多个服务、在上面直接 unpack，socket 收到的内容不经过字符串转发到另一个连接
+-- 最后对比发送同一份大数据给多个服务时，字符串和 sharebuffer 的速度
+-- usage: start = "testbuffer [服务数] [数据大小] [发送次数]"
+
+local mode, arg1, arg2 = ...
+
+if mode == "slave" then
+
+-- text 协议在 dispatch 期间 unpack，返回是否成功，用来检查伪造的 sharebuffer
+skynet.register_protocol {
+	name = "text",
+	id = skynet.PTYPE_TEXT,
+	unpack = function(msg, sz)
+		return pcall(skynet.unpack, msg, sz)
+	end,
+	dispatch = function(_,_, ok)
+		skynet.ret(skynet.pack(ok))
+	end,
+}
+
+-- client 协议在 dispatch 期间把同一个消息解包三次，只有第一次接管消息持有的引用
+skynet.register_protocol {
+	name = "client",
+	id = skynet.PTYPE_CLIENT,
+	unpack = function(msg, sz)
+		local a = skynet.unpack(msg, sz)
+		local b = skynet.unpack(msg, sz)
+		local _, v = skynet.unpackview(msg, sz)
+		return a, b, v
+	end,
+	dispatch = function(_,_, a, b, v)
+		skynet.ret(skynet.pack(skynet.tostring(a) == skynet.tostring(b) and skynet.tostring(b) == skynet.tostring(v.buf)))
+	end,
+}
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd, data)
+		if cmd == "unpack" then
+			local name, t = skynet.unpack(data)
+			skynet.ret(skynet.pack(name, #t, t[#t]))
+		elseif cmd == "size" then
+			skynet.ret(skynet.pack(#data))
+		elseif cmd == "echo" then
+			skynet.ret(skynet.pack(data))
+		else
+			skynet.exit()
+		end
+	end)
+end)
+
+else
+
+skynet.register_protocol {
+	name = "text",
+	id = skynet.PTYPE_TEXT,
+}
+
+skynet.register_protocol {
+	name = "client",
+	id = skynet.PTYPE_CLIENT,
+}
+
+local n = tonumber(mode) or 8
+local size = tonumber(arg1) or 64 * 1024
+local times = tonumber(arg2) or 2000
+local PORT = 8770
+
+local function test_pack(slaves)
+	local t = {}
+	for i=1,1000 do
+		t[i] = i * 2
+	end
+	local buf = skynet.packbuffer("hello", t)
+	for _, addr in ipairs(slaves) do
+		local name, len, last = skynet.call(addr, "lua", "unpack", buf)
+		assert(name == "hello" and len == 1000 and last == 2000)
+	end
+	assert(select(2, skynet.unpack(buf))[1000] == 2000)
+	-- sharebuffer 不能嵌套进 packbuffer/packstring 的结果里
+	assert(not pcall(skynet.packbuffer, buf))
+	assert(not pcall(skynet.packstring, buf))
+	-- 在服务之间来回传递，还是同一份内容
+	local echo = skynet.call(slaves[1], "lua", "echo", buf)
+	assert(skynet.tostring(echo) == skynet.tostring(buf))
+	-- 消息里的 sharebuffer 只在接收方 dispatch 这个消息时才认，复制成字符串或者在别处 unpack 都报错
+	local msg, sz = skynet.pack("echo", buf)
+	assert(not pcall(skynet.unpack, skynet.tostring(msg, sz)))
+	assert(not pcall(skynet.unpack, msg, sz))
+	echo = skynet.unpack(skynet.rawcall(slaves[1], "lua", msg, sz))
+	assert(skynet.tostring(echo) == skynet.tostring(buf))
+	-- 伪造的指针通不过校验，发给其它节点的打包不允许 sharebuffer
+	local forged = string.pack("<BI4I8I8", 3 | 2 << 3, 1, 0x10000, 0) .. skynet.packstring("echo") .. string.pack("<BI4", 3 | 1 << 3, 0)
+	assert(skynet.unpack(skynet.rawcall(slaves[1], "text", forged)) == false)
+	assert(not pcall(skynet.packremote, buf))
+	-- 消息里的 sharebuffer 只有一个引用，不能用 sendbatch 发给多个服务
+	assert(not pcall(skynet.sendbatch, slaves, "lua", "echo", buf))
+	skynet.sendbatch(slaves, "lua", "size", skynet.tostring(buf))
+	-- 同一个消息解包多次，发给已经退出的服务，trash 掉，都不会多释放或者漏掉引用
+	for i=1,100 do
+		assert(skynet.unpack(skynet.rawcall(slaves[1], "client", skynet.pack(buf, { buf = buf }))))
+		skynet.trash(skynet.pack(buf))
+	end
+	local dead = skynet.newservice(SERVICE_NAME, "slave")
+	skynet.kill(dead)
+	for i=1,100 do
+		skynet.send(dead, "lua", "echo", buf)
+	end
+	collectgarbage()
+	assert(skynet.tostring(skynet.call(slaves[1], "lua", "echo", buf)) == skynet.tostring(buf))
+	print("pack ok", #buf)
+end
+
+local function test_forward()
+	local co = coroutine.running()
+	local content = {}
+	for i=1,1000 do
+		content[i] = string.format("%08d", i)
+	end
+	content = table.concat(content)
+	local result
+	local relay = assert(socket.listen("127.0.0.1", PORT))
+	local dest = assert(socket.listen("127.0.0.1", PORT + 1))
+	socket.start(dest, function(fd)
+		socket.start(fd)
+		result = socket.readall(fd)
+		socket.close(fd)
+		skynet.wakeup(co)
+	end)
+	socket.start(relay, function(fd)
+		socket.start(fd)
+		local out = assert(socket.open("127.0.0.1", PORT + 1))
+		-- 先按固定长度转发一段，剩余的有多少转多少
+		socket.write(out, assert(socket.readbuffer(fd, 1000)))
+		while true do
+			local buf = socket.readbuffer(fd)
+			if not buf then
+				break
+			end
+			socket.write(out, buf)
+		end
+		socket.close(fd)
+		socket.close(out)
+	end)
+	local fd = assert(socket.open("127.0.0.1", PORT))
+	socket.write(fd, content)
+	socket.close(fd)
+	skynet.wait(co)
+	socket.close(relay)
+	socket.close(dest)
+	assert(result == content)
+	print("forward ok", #result)
+end
+
+local function bench(slaves)
+	local data = string.rep("x", size)
+	for _, m in ipairs { "string", "buffer" } do
+		local start = skynet.hpc()
+		for i=1,times do
+			local msg = m == "string" and data or skynet.tobuffer(data)
+			for _, addr in ipairs(slaves) do
+				skynet.send(addr, "lua", "size", msg)
+			end
+			if i % 100 == 0 then
+				skynet.call(slaves[1], "lua", "size", msg)
+			end
+		end
+		for _, addr in ipairs(slaves) do
+			skynet.call(addr, "lua", "size", data)
+		end
+		local t = (skynet.hpc() - start) / 1e9
+		print(string.format("%s: %d x %d services, %d bytes, %.3fs, %.0f sends/s",
+			m, times, n, size, t, times * n / t))
+	end
+end
+
+skynet.start(function()
+	local slaves = {}
+	for i=1,n do
+		slaves[i] = skynet.newservice(SERVICE_NAME, "slave")
+	end
+	test_pack(slaves)
+	test_forward()
+	bench(slaves)
+	for _, addr in ipairs(slaves) do
+		skynet.send(addr, "lua", "exit")
+	end
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,80 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- 大量并发的 call：每轮同时发出 n 个 call 再等全部返回，然后 n 个协程同时 sleep，中间做一次完整的 gc
+-- 统计每个 call 的平均耗时，以及 debug STAT 里协程创建、复用和 session 峰值的计数
+-- usage: start = "testfanout [并发数] [轮数]"
+
+local mode, arg1 = ...
+
+if mode == "slave" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, n)
+		skynet.ret(skynet.pack(n))
+	end)
+end)
+
+else
+
+local n = tonumber(mode) or 100000
+local rounds = tonumber(arg1) or 5
+local BATCH = 1000	-- fork 队列是按顺序从头取出的，分批 fork 避免队列太长，每批之间 call 一次让出
+
+local function fanout(slave)
+	local co = coroutine.running()
+	local done = 0
+	for i=1,n do
+		if i % BATCH == 0 then
+			skynet.call(slave, "lua", 0)
+		end
+		skynet.fork(function()
+			assert(skynet.call(slave, "lua", i) == i)
+			done = done + 1
+			if done == n then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+end
+
+local function sleepall(slave)
+	local done = 0
+	local co = coroutine.running()
+	for i=1,n do
+		if i % BATCH == 0 then
+			skynet.call(slave, "lua", 0)
+		end
+		skynet.fork(function()
+			skynet.sleep(10)
+			done = done + 1
+			if done == n then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+end
+
+skynet.start(function()
+	local slave = skynet.newservice(SERVICE_NAME, "slave")
+	local call, wait = 0, 0
+	for i=1,rounds do
+		collectgarbage()
+		local start = skynet.hpc()
+		fanout(slave)
+		call = call + skynet.hpc() - start
+		collectgarbage()
+		start = skynet.hpc()
+		sleepall(slave)
+		wait = wait + skynet.hpc() - start
+	end
+	local stat = skynet.call(skynet.self(), "debug", "STAT")
+	print(string.format("%d x %d: call %.0f ns, sleep %.0f ns, task %d, coroutine create %s reuse %s, session peak %s",
+		rounds, n, call / rounds / n, wait / rounds / n, stat.task,
+		stat.cocreate, stat.coreuse, stat.sessionpeak))
+	skynet.abort()
+end)
+
+end
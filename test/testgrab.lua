@@ -0,0 +1,66 @@
+local skynet = require "skynet"
+require "skynet.manager"
+
+-- handle 查找的吞吐：每次 skynet.send 都要按 handle 找到目标服务
+-- 配置 thread = 1, 2, 4, ... 分别运行，看查找速度随工作线程数的变化
+
+local mode = ...
+
+skynet.register_protocol {
+	name = "text",
+	id = skynet.PTYPE_TEXT,
+	pack = function(m) return tostring(m) end,
+	unpack = function() end,
+}
+
+local ROUND = 200000
+
+if mode == "sink" then
+
+skynet.start(function()
+	skynet.dispatch("text", function() end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, sink)
+		local send = skynet.rawsend
+		for i=1,ROUND do
+			send(sink, "text", "")
+		end
+		skynet.ret()
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local thread = tonumber(skynet.getenv "thread")
+	local senders = {}
+	local sinks = {}
+	for i=1,thread do
+		senders[i] = skynet.newservice(SERVICE_NAME, "sender")
+		sinks[i] = skynet.newservice(SERVICE_NAME, "sink")
+	end
+	local finish = 0
+	local ti = skynet.hpc()
+	for i=1,thread do
+		skynet.fork(function()
+			skynet.call(senders[i], "lua", sinks[i])
+			finish = finish + 1
+			if finish == thread then
+				local total = skynet.hpc() - ti
+				print(string.format("thread %d : %d grabs in %.2fms, %.2f M/s", thread, ROUND * thread,
+					total / 1000000, ROUND * thread * 1000 / total))
+				for j=1,thread do
+					skynet.kill(senders[j])
+					skynet.kill(sinks[j])
+				end
+				skynet.exit()
+			end
+		end)
+	end
+end)
+
+end
@@ -0,0 +1,72 @@
+-- 次级消息队列的争用测试：N 个生产者服务同时向一个热点服务发消息（类似 gate / db proxy）
+-- 生产者数量可以通过启动参数指定，工作线程数由配置中的 thread 决定
+local skynet = require "skynet"
+
+local mode, arg = ...
+
+local PRODUCER = 32		-- 生产者服务数量
+local COUNT = 100000	-- 每个生产者发送的消息数
+
+skynet.register_protocol {
+	name = "text",
+	id = skynet.PTYPE_TEXT,
+	pack = function(m) return tostring(m) end,
+	unpack = function() end,
+}
+
+if mode == "consumer" then
+
+skynet.start(function()
+	local total = tonumber(arg)
+	local recv = 0
+	local start
+	local token = {}
+	skynet.dispatch("text", function()
+		if recv == 0 then
+			start = skynet.hpc()
+		end
+		recv = recv + 1
+		if recv == total then
+			skynet.wakeup(token)
+		end
+	end)
+	skynet.dispatch("lua", function()
+		if recv < total then
+			skynet.wait(token)
+		end
+		local elapsed = (skynet.hpc() - start) / 1000000000
+		skynet.ret(skynet.pack(elapsed, skynet.stat "mqlen"))
+	end)
+end)
+
+elseif mode == "producer" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, consumer)
+		skynet.ret()
+		for i = 1, COUNT do
+			skynet.send(consumer, "text", "")
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local n = tonumber(mode) or PRODUCER
+	local total = n * COUNT
+	local consumer = skynet.newservice(SERVICE_NAME, "consumer", total)
+	local producers = {}
+	for i = 1, n do
+		producers[i] = skynet.newservice(SERVICE_NAME, "producer")
+	end
+	for _, p in ipairs(producers) do
+		skynet.call(p, "lua", consumer)
+	end
+	local elapsed, mqlen = skynet.call(consumer, "lua")
+	skynet.error(string.format("%d producers (thread = %s) : %d messages in %.3fs, %.0f msg/s, mqlen = %d",
+		n, skynet.getenv "thread", total, elapsed, total / elapsed, mqlen))
+	skynet.exit()
+end)
+
+end
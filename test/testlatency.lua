@@ -0,0 +1,45 @@
+-- 调度延迟测试：空闲时向另一个服务发消息，统计从发出到被处理的时间（p50/p99）
+-- 对比 worker_wakeup = false（只靠计时器线程每 2.5ms 轮询唤醒）与默认的 push 唤醒，以及 worker_spin 的影响
+local skynet = require "skynet"
+
+local mode = ...
+
+local SAMPLES = 500
+
+if mode == "echo" then
+
+skynet.start(function()
+	local cost = {}
+	skynet.dispatch("lua", function(_, _, cmd, t)
+		if cmd == "ping" then
+			cost[#cost+1] = skynet.hpc() - t
+		else
+			skynet.ret(skynet.pack(cost))
+		end
+	end)
+end)
+
+else
+
+local function percentile(t, p)
+	return t[math.max(1, math.ceil(#t * p))] / 1000
+end
+
+skynet.start(function()
+	local echo = skynet.newservice(SERVICE_NAME, "echo")
+	for i = 1, SAMPLES do
+		skynet.send(echo, "lua", "ping", skynet.hpc())
+		-- 发送者所在的工作线程继续忙 1ms，消息必须由其它（休眠中的）工作线程处理
+		local t = skynet.hpc()
+		while skynet.hpc() - t < 1000000 do end
+		skynet.sleep(1)	-- 让工作线程有机会进入休眠
+	end
+	local cost = skynet.call(echo, "lua", "result")
+	table.sort(cost)
+	skynet.error(string.format("worker_wakeup = %s worker_spin = %s : %d samples, p50 = %.1fus p99 = %.1fus max = %.1fus",
+		skynet.getenv "worker_wakeup", skynet.getenv "worker_spin", #cost,
+		percentile(cost, 0.5), percentile(cost, 0.99), cost[#cost] / 1000))
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,88 @@
+-- 调度器基准测试：若干对服务互相 ping-pong，统计每秒调度的消息数
+-- 分别用 thread = 4 / 16 / 64 以及 scheduler = "global" / "steal" 的配置启动，对比结果：
+--	thread = 16
+--	scheduler = "steal"
+--	start = "testsched"
+-- 多路服务器上可以加上 worker_cpu = "0-31" numa = true，用 perf stat -e node-loads,node-load-misses 对比跨节点访存
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.kill
+
+local mode = ...
+
+local PAIRS = 64		-- ping-pong 服务对的数量
+local COUNT = 20000		-- 每对服务往返的消息数
+local WINDOW = 16		-- 每对服务同时在途的消息数
+
+if mode == "pong" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, source, n)
+		skynet.send(source, "lua", n)
+	end)
+end)
+
+elseif mode == "ping" then
+
+skynet.start(function()
+	local pong, sent, recv, token
+	skynet.dispatch("lua", function(_, _, cmd, ...)
+		if cmd == "start" then
+			pong = ...
+			sent, recv, token = 0, 0, {}
+			for i = 1, WINDOW do
+				sent = sent + 1
+				skynet.send(pong, "lua", sent)
+			end
+			skynet.wait(token)
+			skynet.ret()
+		else
+			recv = recv + 1
+			if sent < COUNT then
+				sent = sent + 1
+				skynet.send(pong, "lua", sent)
+			elseif recv == COUNT then
+				skynet.wakeup(token)
+			end
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local services = {}
+	local pairs = {}
+	for i = 1, PAIRS do
+		local ping = skynet.newservice(SERVICE_NAME, "ping")
+		local pong = skynet.newservice(SERVICE_NAME, "pong")
+		pairs[i] = { ping, pong }
+		table.insert(services, ping)
+		table.insert(services, pong)
+	end
+
+	local finish = 0
+	local token = {}
+	local start = skynet.hpc()
+	for _, p in ipairs(pairs) do
+		skynet.fork(function()
+			skynet.call(p[1], "lua", "start", p[2])
+			finish = finish + 1
+			if finish == PAIRS then
+				skynet.wakeup(token)
+			end
+		end)
+	end
+	skynet.wait(token)
+	local elapsed = (skynet.hpc() - start) / 1000000000
+
+	local total = PAIRS * COUNT * 2
+	skynet.error(string.format("scheduler = %s thread = %s : %d messages in %.3fs, %.0f msg/s",
+		skynet.getenv "scheduler", skynet.getenv "thread", total, elapsed, total / elapsed))
+
+	for _, addr in ipairs(services) do
+		skynet.kill(addr)
+	end
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,64 @@
+local skynet = require "skynet"
+require "skynet.manager"
+
+local mode = ...
+
+if mode == "sub" then
+
+local count = 0
+
+skynet.start(function()
+	skynet.dispatch("lua", function (_,_, cmd, ...)
+		if cmd == "msg" then
+			local n, str = ...
+			assert(str == "Hello World", str)
+			count = count + 1
+		elseif cmd == "count" then
+			skynet.ret(skynet.pack(count))
+		end
+	end)
+end)
+
+else
+
+local N = 100
+local ROUND = 500
+
+skynet.start(function()
+	local subs = {}
+	for i=1,N do
+		subs[i] = skynet.newservice(SERVICE_NAME, "sub")
+	end
+	skynet.name(".batchsub", subs[1])
+	local addrs = { ".batchsub" }
+	for i=2,N do
+		addrs[i] = subs[i]
+	end
+
+	local ti = skynet.hpc()
+	for i=1,ROUND do
+		local n = skynet.sendbatch(addrs, "lua", "msg", i, "Hello World")
+		assert(n == N, n)
+	end
+	local batch = skynet.hpc() - ti
+
+	ti = skynet.hpc()
+	for i=1,ROUND do
+		for _, addr in ipairs(subs) do
+			skynet.send(addr, "lua", "msg", i, "Hello World")
+		end
+	end
+	local single = skynet.hpc() - ti
+
+	for _, addr in ipairs(subs) do
+		local c = skynet.call(addr, "lua", "count")
+		assert(c == ROUND * 2, c)
+	end
+	print(string.format("sendbatch %d x %d : %.2fms, send : %.2fms", N, ROUND, batch / 1000000, single / 1000000))
+	for _, addr in ipairs(subs) do
+		skynet.kill(addr)
+	end
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,61 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- socket.sendfile 发送文件：先发文件全部、再发文件的一段（文件句柄），最后一个普通的 socket.write 结尾
+-- 接收端校验内容与顺序
+-- usage: start = "testsendfile [文件大小]"
+
+local size = tonumber((...)) or 8 * 1024 * 1024
+local PORT = 8767
+local FILENAME = string.format("/tmp/testsendfile.%d.tmp", skynet.self())
+local TRAILER = "\nend of sendfile\n"
+
+local function make_file()
+	local f = assert(io.open(FILENAME, "wb"))
+	local line = {}
+	for i=1,256 do
+		line[i] = string.char(i-1)
+	end
+	local block = table.concat(line)
+	local content = {}
+	for i=1,size // #block do
+		content[i] = string.format("%08x", i) .. block:sub(9)
+	end
+	local s = table.concat(content) .. block:sub(1, size % #block)
+	f:write(s)
+	f:close()
+	return s
+end
+
+skynet.start(function()
+	local content = make_file()
+	local OFFSET, LEN = size // 8, size // 4
+	local expect = content .. content:sub(OFFSET + 1, OFFSET + LEN) .. TRAILER
+
+	local id = assert(socket.listen("127.0.0.1", PORT))
+	socket.start(id, function(fd, addr)
+		socket.start(fd)
+		local start = skynet.hpc()
+		assert(socket.sendfile(fd, FILENAME))
+		local f = assert(io.open(FILENAME, "rb"))
+		assert(socket.sendfile(fd, f, OFFSET, LEN))
+		f:close()
+		socket.write(fd, TRAILER)
+		print(string.format("queue %d bytes in %.3fms", #expect, (skynet.hpc() - start) / 1e6))
+		socket.close(fd)
+	end)
+
+	local fd = assert(socket.open("127.0.0.1", PORT))
+	local start = skynet.hpc()
+	local s = socket.readall(fd)
+	local t = (skynet.hpc() - start) / 1e9
+	socket.close(fd)
+	socket.close(id)
+	os.remove(FILENAME)
+	assert(#s == #expect, string.format("size %d ~= %d", #s, #expect))
+	assert(s == expect, "content mismatch")
+	print(string.format("recv %d bytes in %.3fs, %.1f MB/s", #s, t, #s / t / 1024 / 1024))
+	print("sendfile ok")
+	skynet.abort()
+end)
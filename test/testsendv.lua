@@ -0,0 +1,96 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- socket.write 发送字符串表：不超过 64 项时不拼接，直接 writev
+-- 先校验内容（小表、超过 64 项的表、写不完需要排队剩余部分的大表），再与 lua 里先拼接的写法对比发送速度
+-- usage: start = "testsendv [发送次数] [每个表的项数]"
+
+local arg1, arg2 = ...
+local n = tonumber(arg1) or 200000
+local item = tonumber(arg2) or 8
+local PORT = 8768
+
+local function make_table(count, size)
+	local t = {}
+	for i=1,count do
+		t[i] = string.rep(string.char(65 + i % 26), size)
+	end
+	return t
+end
+
+local function accept(expect_size)
+	local co = coroutine.running()
+	local result
+	local id = assert(socket.listen("127.0.0.1", PORT))
+	socket.start(id, function(fd, addr)
+		socket.start(fd)
+		result = socket.read(fd, expect_size)
+		socket.close(fd)
+		skynet.wakeup(co)
+	end)
+	return id, function()
+		skynet.wait(co)
+		socket.close(id)
+		return result
+	end
+end
+
+local function check(name, tables)
+	local expect = {}
+	for _, t in ipairs(tables) do
+		expect[#expect+1] = table.concat(t)
+	end
+	expect = table.concat(expect)
+	local _, wait = accept(#expect)
+	local fd = assert(socket.open("127.0.0.1", PORT))
+	for _, t in ipairs(tables) do
+		assert(socket.write(fd, t))
+	end
+	local s = wait()
+	socket.close(fd)
+	assert(s == expect, name)
+	print(name, "ok", #expect)
+end
+
+skynet.start(function()
+	check("small", { make_table(3, 10), { "a", 1, "b", 2.5 }, make_table(1, 100) })
+	check("many", { make_table(100, 7), make_table(65, 3) })
+	check("large", { make_table(8, 1024 * 1024), make_table(4, 1000), make_table(8, 512 * 1024) })
+
+	-- 对比：先在 lua 里拼接成一个字符串再发送
+	local t = make_table(item, 64)
+	local size = #table.concat(t)
+	for _, mode in ipairs { "table", "concat" } do
+		local id = assert(socket.listen("127.0.0.1", PORT))
+		local co = coroutine.running()
+		socket.start(id, function(fd, addr)
+			socket.start(fd)
+			local total = 0
+			while total < size * n do
+				local s = assert(socket.read(fd))
+				total = total + #s
+			end
+			socket.close(fd)
+			skynet.wakeup(co)
+		end)
+		local fd = assert(socket.open("127.0.0.1", PORT))
+		local start = skynet.hpc()
+		for i=1,n do
+			if mode == "table" then
+				socket.write(fd, t)
+			else
+				socket.write(fd, table.concat(t))
+			end
+			if i % 1000 == 0 then
+				skynet.yield()
+			end
+		end
+		skynet.wait(co)
+		local time = (skynet.hpc() - start) / 1e9
+		socket.close(fd)
+		socket.close(id)
+		print(string.format("%s: %d sends (%d items, %d bytes) in %.2fs, %.0f sends/s", mode, n, item, size, time, n / time))
+	end
+	skynet.abort()
+end)
@@ -0,0 +1,230 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- skynet.pack/packcompact/unpack：先校验各种边界情况能原样还原，再对几种典型的数据结构测 pack/unpack 的速度
+-- 速度以每次耗时和按打包后大小折算的每字节耗时（ns）表示
+-- usage: start = "testseri [每种结构的测试次数]"
+
+local times = tonumber((...)) or 2000
+
+local function equal(a, b)
+	if type(a) ~= type(b) then
+		return false
+	end
+	if type(a) ~= "table" then
+		return a == b and math.type(a) == math.type(b)
+	end
+	for k,v in pairs(a) do
+		if not equal(v, b[k]) then
+			return false
+		end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then
+			return false
+		end
+	end
+	return true
+end
+
+local function roundtrip(name, ...)
+	local n = select("#", ...)
+	local args = { ... }
+	local result = table.pack(skynet.unpack(skynet.packstring(...)))
+	assert(result.n == n, name)
+	for i=1,n do
+		assert(equal(args[i], result[i]), name)
+	end
+	for _, pack in ipairs { skynet.pack, skynet.packcompact } do
+		local msg, sz = pack(...)
+		result = table.pack(skynet.unpack(msg, sz))
+		skynet.trash(msg, sz)
+		for i=1,n do
+			assert(equal(args[i], result[i]), name)
+		end
+	end
+end
+
+local function check()
+	roundtrip("values", nil, true, false, 0, 1, -1, 255, 256, 65535, 65536, 0x7fffffff, -0x80000000,
+		0x80000000, math.maxinteger, math.mininteger, 1.5, -0.0, "", "a", string.rep("s", 31),
+		string.rep("l", 32), string.rep("L", 65536))
+
+	local arrays = {
+		{}, { 1, 2, 3 }, { 1.5, 2.5, 3.5 },
+	}
+	-- 足够长的数组：各种整数宽度、浮点、整数和浮点混合、带空洞、带其它类型
+	for _, v in ipairs { 255, 65535, 0x7fffffff, -1, math.maxinteger, 0.5 } do
+		local t = {}
+		for i=1,100 do
+			t[i] = (i % 2 == 0) and v or 0
+		end
+		table.insert(arrays, t)
+	end
+	local mixed = {}
+	for i=1,100 do
+		mixed[i] = (i % 10 == 0) and i + 0.5 or i
+	end
+	table.insert(arrays, mixed)
+	local hole = {}
+	for i=1,100 do
+		hole[i] = i
+	end
+	hole[50] = nil
+	table.insert(arrays, hole)
+	local other = {}
+	for i=1,100 do
+		other[i] = i
+	end
+	other[100] = "end"
+	table.insert(arrays, other)
+	local hash = {}
+	for i=1,100 do
+		hash[i] = i
+	end
+	hash.x = 1
+	hash[1000] = 2
+	table.insert(arrays, hash)
+	for i, t in ipairs(arrays) do
+		roundtrip("array " .. i, t, t)
+	end
+
+	-- 重复的字符串 key，超过引用表上限的 key
+	local records = {}
+	for i=1,300 do
+		records[i] = { id = i, name = "name" .. i, ["key" .. i] = i, [string.rep("k", 40)] = i }
+	end
+	roundtrip("records", records, { id = 1, name = "again" })
+	local keys = {}
+	for i=1,1000 do
+		keys["key" .. i] = { ["key" .. (1001 - i)] = i }
+	end
+	roundtrip("keys", keys)
+
+	-- __pairs 每次返回新建的 key，打包途中旧的 key 被回收，地址可能被新的 key 复用
+	local temp = setmetatable({}, { __pairs = function()
+		local i = 0
+		return function()
+			i = i + 1
+			if i <= 1000 then
+				collectgarbage()
+				return string.format("t%d", i), i
+			end
+		end
+	end })
+	local expect = {}
+	for i=1,1000 do
+		expect["t" .. i] = i
+	end
+	for _, pack in ipairs { skynet.pack, skynet.packcompact } do
+		local msg, sz = pack(temp)
+		local t = skynet.unpack(msg, sz)
+		skynet.trash(msg, sz)
+		assert(equal(t, expect), "temporary keys")
+	end
+
+	-- 截断的数据最多只是报错，不会越界
+	local s = skynet.packstring({ table.unpack(records, 1, 40) }, arrays[4], arrays[9])
+	for i=1,#s-1 do
+		pcall(skynet.unpack, s:sub(1, i))
+	end
+
+	-- __pairs
+	local proxy = setmetatable({}, { __pairs = function() return next, { a = 1, b = { a = 2 } } end })
+	local t = table.pack(skynet.unpack(skynet.packstring(proxy, { a = 3 })))
+	assert(t[1].a == 1 and t[1].b.a == 2 and t[2].a == 3)
+	print("check ok")
+end
+
+local function player()
+	local bag = {}
+	for i=1,100 do
+		bag[i] = { id = 10000 + i, count = i % 5 + 1, bind = i % 3 == 0, expire = 0,
+			attrs = { atk = i * 3, def = i * 2, hp = i * 10 } }
+	end
+	local skills = {}
+	for i=1,30 do
+		skills[i] = { id = 2000 + i, level = i % 10 + 1, cooldown = 1.5 }
+	end
+	return {
+		id = 123456, name = "player", level = 88, exp = 1234567890, gold = 99999, diamond = 888,
+		pos = { map = 1001, x = 123.5, y = 456.25 },
+		bag = bag, skills = skills,
+		flags = { vip = true, guide = false, banned = false },
+	}
+end
+
+local function records()
+	local t = {}
+	for i=1,1000 do
+		t[i] = { id = i, name = "npc" .. i, x = i * 2, y = i * 3, hp = 100 }
+	end
+	return t
+end
+
+local function integers()
+	local t = {}
+	for i=1,10000 do
+		t[i] = i * 7
+	end
+	return t
+end
+
+local function reals()
+	local t = {}
+	for i=1,10000 do
+		t[i] = i * 0.25 + 0.1
+	end
+	return t
+end
+
+local function strmap()
+	local t = {}
+	for i=1,1000 do
+		t["user" .. i] = "value" .. i
+	end
+	return t
+end
+
+local function rpc()
+	return "move", 123456, { x = 1.5, y = 2.5 }, true
+end
+
+local function bench(pack, name, ...)
+	local msg, sz = pack(...)
+	skynet.trash(msg, sz)
+	local n = times
+	if sz < 1024 then
+		n = n * 100
+	end
+	local start = skynet.hpc()
+	for i=1,n do
+		msg, sz = pack(...)
+		skynet.trash(msg, sz)
+	end
+	local t = (skynet.hpc() - start) / n
+	msg, sz = pack(...)
+	start = skynet.hpc()
+	for i=1,n do
+		skynet.unpack(msg, sz)
+	end
+	local unpack = (skynet.hpc() - start) / n
+	skynet.trash(msg, sz)
+	print(string.format("%-10s %7d bytes  pack %9.0f ns %6.2f ns/byte  unpack %9.0f ns %6.2f ns/byte",
+		name, sz, t, t / sz, unpack, unpack / sz))
+end
+
+skynet.start(function()
+	check()
+	for _, v in ipairs { { "pack", skynet.pack }, { "packcompact", skynet.packcompact } } do
+		local pack = v[2]
+		print(v[1])
+		bench(pack, "player", player())
+		bench(pack, "records", records())
+		bench(pack, "integers", integers())
+		bench(pack, "reals", reals())
+		bench(pack, "strmap", strmap())
+		bench(pack, "rpc", rpc())
+	end
+	skynet.abort()
+end)
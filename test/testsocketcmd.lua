@@ -0,0 +1,60 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+local driver = require "skynet.socketdriver"
+require "skynet.manager"	-- import skynet.abort
+
+-- socket 控制命令的吞吐：多个服务同时向 socket 线程发命令（对不存在的 id 设置 nodelay，socket 线程几乎不做事）
+-- 配合 thread = 16，每个工作线程上跑一个发送服务
+-- usage: start = "testsocketcmd [服务数] [每个服务的命令数]"
+
+local mode, arg1 = ...
+local INVALID_ID = 0x7fffffff
+
+if mode == "sender" then
+
+local n = tonumber(arg1)
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		for i=1,n do
+			driver.nodelay(INVALID_ID)
+		end
+		skynet.ret()
+	end)
+end)
+
+else
+
+local sender = tonumber(mode) or 16
+local n = tonumber(arg1) or 1000000
+
+skynet.start(function()
+	local senders = {}
+	for i=1,sender do
+		senders[i] = skynet.newservice(SERVICE_NAME, "sender", n)
+	end
+	print(string.format("thread = %s, %d senders, %d commands each", skynet.getenv "thread", sender, n))
+	local start = skynet.hpc()
+	local done = 0
+	local co = coroutine.running()
+	for i=1,sender do
+		skynet.fork(function()
+			skynet.call(senders[i], "lua")
+			done = done + 1
+			if done == sender then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	-- 命令按顺序处理，listen 之后 start 的回应到达时，前面的命令都已经处理完
+	local id = socket.listen("127.0.0.1", 0)
+	socket.start(id, function() end)
+	local t = (skynet.hpc() - start) / 1e9
+	local total = sender * n
+	print(string.format("%d commands in %.2fs, %.0f commands/s", total, t, total / t))
+	socket.close(id)
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,186 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- 配合 socket_thread = 4 之类的配置，对比单个 socket 线程时的吞吐
+-- 也可以用 socket_backend = "io_uring" 与默认的 epoll 做对比
+-- usage: start = "testsocketshard [连接数] [每连接包数] [客户端服务数]"
+-- 每个连接保持 DEPTH 批、每批 BURST 个包在路上，不等回应就继续发，服务端收到多少回多少，测的是吞吐而不是往返延迟
+-- 默认 256 个连接，客户端与服务端共占 500 多个 fd，一般的 ulimit -n 够用；连接数更多时先检查 fd 上限
+-- start = "testsocketshard reuse [次数]" 反复连接再关闭（默认 20000 次），检查分配出的 id 不会重复
+
+local mode, arg1, arg2, arg3 = ...
+local PORT = 8765
+local PACKET = string.rep("x", 64)
+local BURST = 16
+local DEPTH = 4
+
+if mode == "echo" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, fd)
+		socket.start(fd)
+		while true do
+			local s = socket.read(fd)
+			if not s then
+				break
+			end
+			socket.write(fd, s)
+		end
+		socket.close(fd)
+	end)
+end)
+
+elseif mode == "client" then
+
+local conn, round = tonumber(arg1), tonumber(arg2)
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local fds = {}
+		for i=1,conn do
+			local fd = socket.open("127.0.0.1", PORT)
+			assert(fd, "connect failed")
+			fds[i] = fd
+		end
+		local running = conn
+		local co = coroutine.running()
+		local burst = string.rep(PACKET, BURST)
+		local total = round // BURST
+		for i=1,conn do
+			skynet.fork(function()
+				local fd = fds[i]
+				local sent = 0
+				while sent < DEPTH and sent < total do
+					socket.write(fd, burst)
+					sent = sent + 1
+				end
+				for r=1,total do
+					local s = socket.read(fd, #burst)
+					assert(s == burst)
+					if sent < total then
+						socket.write(fd, burst)
+						sent = sent + 1
+					end
+				end
+				socket.close(fd)
+				running = running - 1
+				if running == 0 then
+					skynet.wakeup(co)
+				end
+			end)
+		end
+		skynet.wait(co)
+		skynet.ret()
+	end)
+end)
+
+elseif mode == "reuse" then
+
+local cycle = tonumber(arg1) or 20000
+
+skynet.start(function()
+	local ids = {}
+	local function check(fd)
+		assert(not ids[fd], "socket id reused")
+		ids[fd] = true
+	end
+	local accepted = 0
+	local co
+	local id = assert(socket.listen("127.0.0.1", PORT, 1024))
+	socket.start(id, function(fd, addr)
+		check(fd)
+		socket.close_fd(fd)
+		accepted = accepted + 1
+		if accepted == cycle and co then
+			skynet.wakeup(co)
+		end
+	end)
+	for i=1,cycle do
+		local fd = assert(socket.open("127.0.0.1", PORT), "connect failed")
+		check(fd)
+		-- 等服务端先关，TIME_WAIT 留在服务端，客户端的临时端口不会耗尽
+		assert(socket.read(fd) == false)
+		socket.close(fd)
+	end
+	if accepted < cycle then
+		co = coroutine.running()
+		skynet.wait(co)
+	end
+	print(string.format("socket_thread = %s, %d connect/close, %d ids, no reuse",
+		skynet.getenv "socket_thread" or 1, cycle, cycle * 2))
+	socket.close(id)
+	skynet.abort()
+end)
+
+else
+
+local conn = tonumber(mode) or 256
+local round = tonumber(arg1) or 1024
+local client = tonumber(arg2) or 8
+
+-- 客户端和服务端各占一个 fd，再留一些给其它用途；读不到上限（非 linux）时不检查
+local function check_nofile(need)
+	local f = io.open "/proc/self/limits"
+	if not f then
+		return
+	end
+	local limit
+	for line in f:lines() do
+		limit = line:match "^Max open files%s+(%d+)"
+		if limit then
+			break
+		end
+	end
+	f:close()
+	if limit and tonumber(limit) < need then
+		return string.format("%d connections need about %d fds, but ulimit -n is %s", conn, need, limit)
+	end
+end
+
+skynet.start(function()
+	local err = check_nofile(conn * 2 + 64)
+	if err then
+		skynet.error(err)
+		skynet.abort()
+		return
+	end
+	local echo = {}
+	for i=1,client do
+		echo[i] = skynet.newservice(SERVICE_NAME, "echo")
+	end
+	local balance = 0
+	local id = assert(socket.listen("127.0.0.1", PORT, 1024))
+	socket.start(id, function(fd, addr)
+		balance = balance % client + 1
+		skynet.send(echo[balance], "lua", fd)
+	end)
+
+	local per = conn // client
+	local clients = {}
+	for i=1,client do
+		clients[i] = skynet.newservice(SERVICE_NAME, "client", per, round)
+	end
+	print(string.format("socket_thread = %s, socket_backend = %s, connections = %d, %d packets per connection",
+		skynet.getenv "socket_thread" or 1, skynet.getenv "socket_backend" or "epoll", per * client, round // BURST * BURST))
+	local start = skynet.hpc()
+	local done = 0
+	local co = coroutine.running()
+	for i=1,client do
+		skynet.fork(function()
+			skynet.call(clients[i], "lua")
+			done = done + 1
+			if done == client then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	local t = (skynet.hpc() - start) / 1e9
+	local n = per * client * (round // BURST * BURST)
+	print(string.format("%d packets echoed in %.2fs, %.0f packets/s, %.2f MB/s", n, t, n / t, n * #PACKET / t / 1e6))
+	socket.close(id)
+	skynet.abort()
+end)
+
+end
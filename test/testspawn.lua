@@ -0,0 +1,61 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- snlua 服务的启动速度：启动若干个 agent 服务（加载 skynet、socket 等常用模块），统计每秒启动数
+-- usage: start = "testspawn [服务数] [并发数]"
+
+local mode, arg1 = ...
+
+if mode == "agent" then
+
+local socket = require "skynet.socket"
+local queue = require "skynet.queue"
+local crypt = require "skynet.crypt"
+
+local cs = queue()
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd)
+		cs(function()
+			skynet.ret()
+			if cmd == "exit" then
+				skynet.exit()
+			end
+		end)
+	end)
+end)
+
+else
+
+local n = tonumber(mode) or 5000
+local concurrent = tonumber(arg1) or 8
+
+skynet.start(function()
+	local agents = {}
+	local start = skynet.hpc()
+	local next_id = 0
+	local done = 0
+	local co = coroutine.running()
+	for i=1,concurrent do
+		skynet.fork(function()
+			while next_id < n do
+				next_id = next_id + 1
+				agents[next_id] = skynet.newservice(SERVICE_NAME, "agent")
+			end
+			done = done + 1
+			if done == concurrent then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	local t = (skynet.hpc() - start) / 1e9
+	print(string.format("%d agents in %.2fs, %.0f agents/s, %.2f K memory per agent",
+		n, t, n / t, skynet.call(agents[1], "debug", "MEM")))
+	for i=1,n do
+		skynet.call(agents[i], "lua", "exit")
+	end
+	skynet.abort()
+end)
+
+end
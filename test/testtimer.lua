@@ -24,9 +24,35 @@ local function test()
 	end
 end
 
+local function test_cancel()
+	local fired = false
+	local _, session = skynet.timeout(10, function() fired = true end)
+	assert(skynet.cancel_timeout(session) == true)
+	local done = false
+	_, session = skynet.timeout(0, function() done = true end)
+	skynet.yield()
+	assert(done)
+	-- 已经到期的定时器取消不了
+	assert(skynet.cancel_timeout(session) == false)
+	-- 等过原来的到期时间，取消的回调不会执行
+	skynet.sleep(20)
+	assert(not fired)
+	-- 取消的定时器的协程回到协程池，反复注册、取消不会新建协程
+	_, session = skynet.timeout(10, function() end)
+	skynet.cancel_timeout(session)
+	local cocreate = skynet.stat "cocreate"
+	for i=1,1000 do
+		_, session = skynet.timeout(10, function() fired = true end)
+		assert(skynet.cancel_timeout(session) == true)
+	end
+	assert(skynet.stat "cocreate" == cocreate)
+	print("cancel timeout ok")
+end
+
 skynet.start(function()
 	skynet.trace_timeout(true)	-- trun on trace for timeout, skynet.task will returns more info.
 	test()
+	test_cancel()
 
 	skynet.fork(wakeup, coroutine.running())
 	skynet.timeout(300, function() timeout "Hello World" end)
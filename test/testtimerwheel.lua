@@ -0,0 +1,114 @@
+local skynet = require "skynet"
+local c = require "skynet.core"
+require "skynet.manager"
+
+-- 时间轮的测试：100 万个定时器分散在 SERVICE 个服务里，在 [LEAD, LEAD + SPAN] 毫秒内到期
+-- 每次只注册 CHUNK 个，注册期间不长时间占住工作线程；到期从 LEAD 开始，这时注册都已经完成，服务是空闲的
+-- 延迟按 tick 统计：定时器只在 tick 上到期，不足一个 tick 的延迟是正常的
+-- 配置 timer_resolution = 1 和 10 分别运行
+
+local mode = ...
+
+local TOTAL = 1000000
+local SERVICE = 10
+local SPAN = 2000	-- ms
+local LEAD = 3000	-- ms
+local CHUNK = 1000
+
+if mode == "worker" then
+
+-- 直接用 callback 而不是 skynet.start，等待中的定时器不占用协程
+local expect = {}
+local hpc = skynet.hpc
+local tick = (tonumber(skynet.getenv "timer_resolution") or 10) * 1000000
+local n, left, count, late, maxlate = 0, 0, 0, 0, 0
+local hist = { 0, 0, 0 }	-- 延迟不足 1 个 tick、1~2 个 tick、更多
+local master, start
+
+c.callback(function(prototype, msg, sz, session, source)
+	if prototype == skynet.PTYPE_LUA then
+		local cmd, arg = skynet.unpack(msg, sz)
+		if cmd == "start" then
+			master = source
+			n, left = arg, arg
+			start = hpc()
+		end
+		local m = math.min(CHUNK, left)
+		for i=1,m do
+			local ms = LEAD + math.random(1, SPAN)
+			local session = c.intcommand("MTIMEOUT", ms)
+			expect[session] = hpc() + ms * 1000000
+		end
+		left = left - m
+		if left > 0 then
+			-- 剩下的下次再注册，中间可以处理别的消息
+			skynet.send(skynet.self(), "lua", "next")
+		else
+			skynet.send(master, "lua", "registered", (hpc() - start) / 1000000)
+		end
+	elseif prototype == skynet.PTYPE_RESPONSE then
+		local e = expect[session]
+		if e then
+			expect[session] = nil
+			local d = hpc() - e
+			if d < 0 then
+				d = 0
+			end
+			late = late + d
+			if d > maxlate then
+				maxlate = d
+			end
+			local t = math.min(d // tick + 1, 3)
+			hist[t] = hist[t] + 1
+			count = count + 1
+			if count == n then
+				skynet.send(master, "lua", "finish", late / n, maxlate, hist[1], hist[2], hist[3])
+			end
+		end
+	end
+end)
+skynet.send(".launcher", "lua", "LAUNCHOK")
+
+else
+
+skynet.start(function()
+	local resolution = tonumber(skynet.getenv "timer_resolution") or 10
+	local n = TOTAL // SERVICE
+	local registered, finish = 0, 0
+	local reg, late, maxlate = 0, 0, 0
+	local hist = { 0, 0, 0 }
+	local ti = skynet.hpc()
+	skynet.dispatch("lua", function(_,_, cmd, ...)
+		if cmd == "registered" then
+			registered = registered + 1
+			reg = math.max(reg, ...)
+			if registered == SERVICE and (skynet.hpc() - ti) / 1000000 > LEAD then
+				print(string.format("WARNING: registration took %.2fms, longer than LEAD %dms, lateness includes the registration", reg, LEAD))
+			end
+			return
+		end
+		local l, m, h1, h2, h3 = ...
+		finish = finish + 1
+		late = late + l
+		maxlate = math.max(maxlate, m)
+		hist[1] = hist[1] + h1
+		hist[2] = hist[2] + h2
+		hist[3] = hist[3] + h3
+		if finish == SERVICE then
+			local avg = late / SERVICE / 1000000
+			maxlate = maxlate / 1000000
+			print(string.format("timer_resolution %d : %d timers, register %.2fms, finish %.2fms, lateness avg %.2fms (%.2f tick) max %.2fms (%.2f tick)",
+				resolution, TOTAL, reg, (skynet.hpc() - ti) / 1000000,
+				avg, avg / resolution, maxlate, maxlate / resolution))
+			print(string.format("late by < 1 tick %.2f%%, 1~2 ticks %.2f%%, >= 2 ticks %.2f%%",
+				hist[1] * 100 / TOTAL, hist[2] * 100 / TOTAL, hist[3] * 100 / TOTAL))
+			skynet.abort()
+		end
+	end)
+	for i=1,SERVICE do
+		local w = skynet.newservice(SERVICE_NAME, "worker")
+		skynet.send(w, "lua", "start", n)
+	end
+end)
+
+end
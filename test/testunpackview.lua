@@ -0,0 +1,208 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- skynet.unpackview：只在访问时才解开 table，转发时用 viewmessage 原样发出整个消息
+-- 先校验视图和 unpack 的结果一致，再通过一个路由服务转发；最后对比路由只读消息头时 unpack 重新打包和视图转发的速度、内存
+-- usage: start = "testunpackview [测试次数]"
+
+local mode = ...
+
+if mode == "router" then
+
+local sink
+
+skynet.start(function()
+	skynet.unpacker("lua", skynet.unpackview)
+	skynet.dispatch("lua", function(_,_, cmd, header)
+		if cmd == "init" then
+			sink = header
+			skynet.ret()
+		elseif cmd == "sync" then
+			skynet.ret()
+		else
+			assert(header.dest == "sink")
+			skynet.rawsend(sink, "lua", skynet.viewmessage(header))
+		end
+	end)
+end)
+
+elseif mode == "sink" then
+
+local last
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd, header, body)
+		if cmd == "get" then
+			skynet.ret(skynet.pack(last))
+		else
+			last = { cmd = cmd, header = header, body = body }
+		end
+	end)
+end)
+
+else
+
+local times = tonumber(mode) or 2000
+
+local function equal(a, b)
+	if type(a) ~= type(b) then
+		return false
+	end
+	if type(a) ~= "table" then
+		return a == b and math.type(a) == math.type(b)
+	end
+	for k,v in pairs(a) do
+		if not equal(v, b[k]) then
+			return false
+		end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then
+			return false
+		end
+	end
+	return true
+end
+
+local function payload(n)
+	local items = {}
+	for i=1,n do
+		items[i] = { id = i, name = "item" .. i, count = i % 7, attrs = { atk = i * 3, def = i * 2 } }
+	end
+	local ints = {}
+	for i=1,n do
+		ints[i] = i * 1000
+	end
+	return { items = items, ints = ints, reals = { 1.5, 2.5, 3.5, 4.5, 5.5, 6.5, 7.5, 8.5, 9.5 }, tag = "payload" }
+end
+
+local function check()
+	local header = { dest = "sink", seq = 1 }
+	local body = payload(100)
+	local s = skynet.packstring("forward", header, body, 42)
+	local cmd, h, b, n = skynet.unpackview(s)
+	assert(cmd == "forward" and n == 42)
+	-- 没访问前是空 table，访问时才解开
+	assert(next(b) == nil and rawget(b, "tag") == nil)
+	assert(b.tag == "payload")
+	assert(rawget(b.items, 1) == nil)
+	assert(b.items[100].attrs.def == 200)
+	assert(#b.ints == 100 and b.ints[100] == 100000)
+	local sum = 0
+	for _, v in ipairs(b.reals) do
+		sum = sum + v
+	end
+	assert(sum == 49.5)
+	-- 没访问过的子 table 里的 key 引用和 pairs
+	local count = 0
+	for k, v in pairs(b.items[50]) do
+		count = count + 1
+		assert(k == "attrs" or v ~= nil)
+	end
+	assert(count == 4 and b.items[99].name == "item99")
+	-- 可以修改
+	h.seq = 2
+	b.items[1] = nil
+	assert(h.seq == 2 and b.items[1] == nil)
+	-- 访问全部之后和 unpack 结果一致
+	local _, h2, b2 = skynet.unpack(s)
+	h2.seq = 2
+	b2.items[1] = nil
+	assert(equal(h, h2) and equal(b, b2))
+
+	-- msg,sz 和 sharebuffer
+	local msg, sz = skynet.pack(header, body)
+	local vh, vb = skynet.unpackview(msg, sz)
+	skynet.trash(msg, sz)
+	assert(vh.dest == "sink" and vb.items[3].attrs.atk == 9)
+	-- packcompact 的 key 引用和纯数字数组
+	msg, sz = skynet.packcompact(header, body)
+	vh, vb = skynet.unpackview(msg, sz)
+	skynet.trash(msg, sz)
+	assert(vb.items[50].attrs.def == 100 and vb.ints[7] == 7000)
+	assert(equal(vh, header) and equal(vb, body))
+	local buf = skynet.packbuffer(header, body)
+	vh, vb = skynet.unpackview(buf)
+	buf = nil
+	collectgarbage()
+	assert(vh.seq == 1 and equal(vb, body))
+
+	-- 带 sharebuffer 的消息只能在 dispatch 时解开，见 test_router
+	msg, sz = skynet.pack({ buf = skynet.tobuffer("hello") })
+	assert(not pcall(skynet.unpackview, msg, sz))
+	skynet.trash(msg, sz)
+
+	-- viewmessage 得到和原消息相同的内容
+	_, h = skynet.unpackview(s)
+	msg, sz = skynet.viewmessage(h)
+	assert(skynet.tostring(msg, sz) == s)
+	skynet.trash(msg, sz)
+
+	-- 截断的数据在 unpackview 时就报错，和 unpack 一致
+	for i=1,#s-1 do
+		local sub = s:sub(1, i)
+		assert(pcall(skynet.unpackview, sub) == pcall(skynet.unpack, sub))
+	end
+	print("check ok")
+end
+
+local function test_router()
+	local sink = skynet.newservice(SERVICE_NAME, "sink")
+	local router = skynet.newservice(SERVICE_NAME, "router")
+	skynet.call(router, "lua", "init", sink)
+	local body = payload(100)
+	-- 消息里的 sharebuffer 由 router 的视图接管，转发出去的消息另外持有引用
+	skynet.send(router, "lua", "forward", { dest = "sink", buf = skynet.tobuffer("hello") }, body)
+	-- 等 router 转发出去
+	skynet.call(router, "lua", "sync")
+	collectgarbage()
+	local last = skynet.call(sink, "lua", "get")
+	assert(last.cmd == "forward" and last.header.dest == "sink" and equal(last.body, body))
+	assert(skynet.tostring(last.header.buf) == "hello")
+	print("router ok")
+end
+
+local function bench()
+	local body = payload(1000)
+	local msg, sz = skynet.pack("forward", { dest = "sink", seq = 1 }, body)
+	local route = {
+		unpack = function()
+			local cmd, header, b = skynet.unpack(msg, sz)
+			assert(header.dest == "sink")
+			skynet.trash(skynet.pack(cmd, header, b))
+		end,
+		view = function()
+			local _, header = skynet.unpackview(msg, sz)
+			assert(header.dest == "sink")
+			skynet.trash(skynet.viewmessage(header))
+		end,
+	}
+	for _, m in ipairs { "unpack", "view" } do
+		local f = route[m]
+		local start = skynet.hpc()
+		for i=1,times do
+			f()
+		end
+		local t = (skynet.hpc() - start) / times
+		-- 每个消息产生的 lua 内存（也就是 gc 的压力）
+		collectgarbage()
+		collectgarbage "stop"
+		local mem = collectgarbage "count"
+		for i=1,100 do
+			f()
+		end
+		mem = (collectgarbage "count" - mem) / 100
+		collectgarbage "restart"
+		print(string.format("%-6s %d bytes  %9.0f ns  %8.2f K lua memory per message", m, sz, t, mem))
+	end
+	skynet.trash(msg, sz)
+end
+
+skynet.start(function()
+	check()
+	test_router()
+	bench()
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,104 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- 写缓冲的高低水位与上限：接收端先不读，让发送端的写缓冲积压
+-- 1. 超过高水位收到 warning(size > 0)，接收端开始读后降到低水位以下收到 warning(0)
+-- 2. 上限 + "drop"：超过上限后 lwrite 的低优先级数据被丢弃，write 的数据完整收到
+-- 3. 上限 + "close"：超过上限后连接被关闭
+
+local PORT = 8769
+local CHUNK = 64 * 1024
+local HIGH = string.rep("H", CHUNK)
+local LOW = string.rep("L", CHUNK)
+
+local function wait_for(f)
+	for i=1,500 do
+		if f() then
+			return
+		end
+		skynet.sleep(1)
+	end
+	error "timeout"
+end
+
+-- 接收端先不 start，socket 线程不会读它，数据都积压在发送端
+local function connect(port)
+	local id = assert(socket.listen("127.0.0.1", port))
+	local peer
+	socket.start(id, function(fd, addr)
+		peer = fd
+	end)
+	local fd = assert(socket.open("127.0.0.1", port))
+	wait_for(function() return peer end)
+	socket.close(id)
+	return fd, peer
+end
+
+local function test_watermark()
+	local fd, peer = connect(PORT)
+	local warning = {}
+	socket.warning(fd, function(id, size)
+		table.insert(warning, size)
+	end)
+	socket.watermark(fd, 256 * 1024, 64 * 1024)
+	local n = 0
+	while not socket.overload(fd) do
+		socket.write(fd, HIGH)
+		n = n + 1
+		skynet.yield()
+		assert(n < 1024)
+	end
+	assert(warning[1] >= 256)
+	print(string.format("high watermark: %d K queued after %d chunks", warning[1], n))
+	socket.start(peer)
+	wait_for(function() return not socket.overload(fd) end)
+	assert(warning[#warning] == 0)
+	local s = socket.read(peer, n * CHUNK)
+	assert(s == string.rep(HIGH, n))
+	print("low watermark ok")
+	socket.close(fd)
+	socket.close(peer)
+end
+
+local function test_drop()
+	local fd, peer = connect(PORT + 1)
+	socket.warning(fd, function() end)
+	socket.watermark(fd, 256 * 1024, 0, 1024 * 1024, "drop")
+	local high, low = 64, 64
+	for i=1,high do
+		socket.write(fd, HIGH)
+	end
+	for i=1,low do
+		socket.lwrite(fd, LOW)
+	end
+	socket.start(peer)
+	socket.close(fd)
+	local s = socket.readall(peer)
+	socket.close(peer)
+	local h = select(2, s:gsub("H", ""))
+	local l = select(2, s:gsub("L", ""))
+	assert(h == high * CHUNK, "high priority data lost")
+	assert(l % CHUNK == 0 and l < low * CHUNK, "low priority data should be dropped")
+	print(string.format("drop: recv %d K high, %d K of %d K low", h // 1024, l // 1024, low * CHUNK // 1024))
+end
+
+local function test_close()
+	local fd, peer = connect(PORT + 2)
+	socket.warning(fd, function() end)
+	socket.watermark(fd, 0, 0, 1024 * 1024, "close")
+	for i=1,256 do
+		socket.write(fd, HIGH)
+	end
+	wait_for(function() return socket.disconnected(fd) end)
+	print("close ok")
+	socket.close(fd)
+	socket.close(peer)
+end
+
+skynet.start(function()
+	test_watermark()
+	test_drop()
+	test_close()
+	skynet.abort()
+end)
@@ -0,0 +1,120 @@
+local skynet = require "skynet"
+local socket = require "skynet.socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- 大量小包发送的吞吐测试：每个连接每个 tick 写若干小包
+-- socket.write 在写队列为空时由工作线程直接写，测不到写队列；默认用 socket.lwrite，
+-- 所有包都经过 socket 线程的写队列，观察聚合发送（writev）的效果
+-- usage: start = "testwritev [连接数] [每 tick 每连接包数] [tick 数] [write|lwrite]"
+
+local mode, arg1, arg2, arg3, arg4 = ...
+local PORT = 8766
+local PACKET = string.rep("x", 32)
+local SENDER = 8
+
+if mode == "sender" then
+
+local conn, msg, tick = tonumber(arg1), tonumber(arg2), tonumber(arg3)
+local write = socket[arg4]
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local fds = {}
+		for i=1,conn do
+			fds[i] = assert(socket.open("127.0.0.1", PORT))
+		end
+		for t=1,tick do
+			for i=1,conn do
+				local fd = fds[i]
+				for j=1,msg do
+					write(fd, PACKET)
+				end
+			end
+			skynet.sleep(1)
+		end
+		for i=1,conn do
+			socket.close(fds[i])
+		end
+		skynet.ret()
+	end)
+end)
+
+elseif mode == "drain" then
+
+skynet.start(function()
+	local total = 0
+	skynet.dispatch("lua", function(_,_, cmd, fd)
+		if cmd == "count" then
+			skynet.ret(skynet.pack(total))
+			return
+		end
+		socket.start(fd)
+		while true do
+			local s = socket.read(fd)
+			if not s then
+				break
+			end
+			total = total + #s
+		end
+		socket.close(fd)
+	end)
+end)
+
+else
+
+local conn = tonumber(mode) or 1000
+local msg = tonumber(arg1) or 100
+local tick = tonumber(arg2) or 20
+local method = arg3 or "lwrite"
+
+skynet.start(function()
+	local drain = {}
+	for i=1,SENDER do
+		drain[i] = skynet.newservice(SERVICE_NAME, "drain")
+	end
+	local balance = 0
+	local id = assert(socket.listen("127.0.0.1", PORT, 1024))
+	socket.start(id, function(fd, addr)
+		balance = balance % SENDER + 1
+		skynet.send(drain[balance], "lua", "start", fd)
+	end)
+
+	local per = conn // SENDER
+	local senders = {}
+	for i=1,SENDER do
+		senders[i] = skynet.newservice(SERVICE_NAME, "sender", per, msg, tick, method)
+	end
+	local n = per * SENDER * msg * tick
+	print(string.format("connections = %d, %d packets per tick, %d ticks, %s", per * SENDER, msg, tick, method))
+	local start = skynet.hpc()
+	local done = 0
+	local co = coroutine.running()
+	for i=1,SENDER do
+		skynet.fork(function()
+			skynet.call(senders[i], "lua")
+			done = done + 1
+			if done == SENDER then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	-- 等接收端读完
+	local expect = n * #PACKET
+	while true do
+		local total = 0
+		for i=1,SENDER do
+			total = total + skynet.call(drain[i], "lua", "count")
+		end
+		if total >= expect then
+			break
+		end
+		skynet.sleep(1)
+	end
+	local t = (skynet.hpc() - start) / 1e9
+	print(string.format("%d packets in %.2fs, %.0f packets/s", n, t, n / t))
+	socket.close(id)
+	skynet.abort()
+end)
+
+end